@@ -0,0 +1,71 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SPINOFF_TOOLKIT_ASYNC_READER_H
+#define SPINOFF_TOOLKIT_ASYNC_READER_H
+
+#include <memory>
+#include "claim.h"
+
+using namespace std;
+
+namespace bst {
+
+    static const unsigned ASYNC_QUEUE_DEPTH = 128;
+    // bytes read per probe. the records around the probe come along, so a search's last levels need no reads
+    static const int ASYNC_WINDOW_SIZE = 4096;
+
+    struct async_ring;
+    struct async_search;
+
+    /*
+    Batch lookups for snapshots that aren't in the page cache. Every hash gets its own binary search, and up to
+    queue_depth searches run side by side through io_uring, each moving on as its read completes instead of
+    waiting on one seek at a time. Where io_uring isn't available (old kernel, or blocked by seccomp) the same
+    searches run one pread at a time.
+
+    A reader isn't thread safe, give each thread its own.
+     */
+    class AsyncSnapshotReader {
+    public:
+        // use_uring false always takes the pread path, for comparing the two
+        explicit AsyncSnapshotReader(unsigned queue_depth = ASYNC_QUEUE_DEPTH, bool use_uring = true);
+        ~AsyncSnapshotReader();
+
+        bool usingUring() const { return ring.get() != 0; }
+        // reads issued by the last getEntries
+        uint64_t reads() const { return read_count; }
+
+        // found and entries line up with hashes. false if a read failed, and if the ring failed part way the
+        // reader drops back to pread for later calls
+        bool getEntries(const SnapshotEntryCollection& collection, const vector<uint160_t>& hashes,
+                        vector<snapshot_entry>& entries, vector<bool>& found);
+
+    private:
+        AsyncSnapshotReader(const AsyncSnapshotReader&);
+        AsyncSnapshotReader& operator=(const AsyncSnapshotReader&);
+
+        bool getEntriesUring(const SnapshotEntryCollection& collection, const vector<uint160_t>& hashes,
+                             vector<snapshot_entry>& entries, vector<bool>& found);
+
+        unsigned queue_depth;
+        unique_ptr<async_ring> ring;
+        // one per queue slot, kept so their buffers are reused from call to call
+        vector<async_search> searches;
+        uint64_t read_count;
+    };
+}
+
+#endif
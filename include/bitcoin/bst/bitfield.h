@@ -0,0 +1,51 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SPINOFF_TOOLKIT_BITFIELD_H
+#define SPINOFF_TOOLKIT_BITFIELD_H
+
+#include <cstdint>
+#include <string>
+#include "common.h"
+
+using namespace std;
+
+namespace bst {
+
+    /*
+    The claim bitfield file mapped into memory, so that many threads can mark claims at once.
+    Bits are read and set with atomic operations on the 64 bit word containing them, so two
+    claims landing in the same byte can no longer lose each other's update.
+     */
+    struct claim_bitfield
+    {
+        int fd;
+        uint8_t* data;
+        uint64_t size;
+
+        claim_bitfield() : fd(-1), data(0), size(0) {}
+    };
+
+    bool openClaimBitfield(claim_bitfield& bitfield, const string& name = SNAPSHOT_CLAIMED_NAME);
+    void closeClaimBitfield(claim_bitfield& bitfield);
+    bool syncClaimBitfield(claim_bitfield& bitfield);
+
+    // bits past the end of the file read as claimed and are never set
+    bool isClaimed(const claim_bitfield& bitfield, uint64_t bit);
+    // atomically sets the bit, returning whether it was already set
+    bool testAndSetClaimed(claim_bitfield& bitfield, uint64_t bit);
+}
+
+#endif
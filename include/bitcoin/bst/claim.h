@@ -17,117 +17,382 @@
 #define SPINOFF_TOOLKIT_CLAIM_H
 
 #include <fstream>
+#include <memory>
 #include "common.h"
+#include "record.h"
+#include "bitfield.h"
+#include "filter.h"
+#include "eytzinger.h"
+#include "model.h"
+#include "perfect_hash.h"
+#include "thread_pool.h"
 
 using namespace std;
 
 namespace bst {
 
+    struct scan_buffer;
+    class ClaimJournal;
+
+    // records read per chunk by a sequential scan, about 1.8MB
+    static const int64_t SCAN_BUFFER_ENTRIES = 1 << 16;
+    // records per range of a parallel scan. 1024 records are exactly 7 pages (8 for aligned records), so ranges
+    // that start on a page boundary of the file end on one too
+    static const int64_t PARALLEL_SCAN_ENTRIES = 1024 * 64;
+
+    // descriptor for the snapshot file alongside the stream, and its mapping once mapSnapshot is called.
+    // both are released with the last reader
+    struct snapshot_file
+    {
+        int fd;
+        const uint8_t* data;
+        uint64_t size;
+        // the length data was mapped with, rounded up to huge pages once warmed into a copy
+        uint64_t mapping_size;
+
+        snapshot_file() : fd(-1), data(0), size(0), mapping_size(0) {}
+        ~snapshot_file();
+    };
+
+    /*
+    Thread safety: once openSnapshot returns, any number of threads may look entries up through the same reader,
+    its copies and the collections made from them. Records are read from the shared mapping, or with pread on the
+    shared descriptor, so no file position is shared; the stream is only used for the header. Each thread keeps
+    its own scan iterators and random access iterators.
+
+    Not safe alongside lookups: openSnapshot or mapSnapshot on the same reader, a huge page warmup, and changing
+    the reader's fields. setClaimed rewrites the claim file unlocked; concurrent claims go through
+    testAndSetClaimed on a claim_bitfield.
+     */
     struct snapshot_reader
     {
         ifstream* snapshot;
         snapshot_header header;
+        // loaded by openSnapshot when a filter built for this snapshot is present
+        shared_ptr<snapshot_filter> filter;
+        // likewise for a search index
+        shared_ptr<eytzinger_index> search_index;
+        // read from the snapshot's model trailer when it has one
+        shared_ptr<snapshot_model> model;
+        // mapped by openSnapshot when a perfect hash built for this snapshot is present
+        shared_ptr<perfect_hash_index> perfect_hash;
+        shared_ptr<snapshot_file> file;
+        // when set, claimed bits are read from this mapping instead of opening the claim file for every entry
+        claim_bitfield* claims;
+        // chosen by openSnapshot from the header version
+        const record_format* format;
 
-        snapshot_reader() {}
+        snapshot_reader() : snapshot(0), claims(0), format(recordFormat(SNAPSHOT_VERSION)) {}
         snapshot_reader(const snapshot_reader& other) {
             snapshot = other.snapshot;
             header = other.header;
+            filter = other.filter;
+            search_index = other.search_index;
+            model = other.model;
+            perfect_hash = other.perfect_hash;
+            file = other.file;
+            claims = other.claims;
+            format = other.format;
         }
     };
 
+    struct claim_request
+    {
+        string claim;
+        // base64, as produced by wallets signing a message
+        string signature;
+
+        claim_request() {}
+        claim_request(const string& claim_, const string& signature_) : claim(claim_), signature(signature_) {}
+    };
+
+    enum claim_status {
+        CLAIM_VALID,
+        CLAIM_BAD_SIGNATURE,
+        CLAIM_NOT_FOUND,
+        // the transaction could not be parsed or has no such input
+        CLAIM_BAD_TRANSACTION,
+        // set only where claims are committed: the entry's bit was already set, or an earlier claim in the same
+        // batch named the same entry
+        CLAIM_ALREADY_CLAIMED,
+        // the claim could not be made durable, or the batch was malformed
+        CLAIM_ERROR
+    };
+
+    // one input of a p2sh claim transaction and the address it claims
+    struct p2sh_claim_input
+    {
+        uint32_t input_index;
+        string address;
+    };
+
+    struct claim_result
+    {
+        claim_status status;
+        uint64_t amount;
+        int64_t index;
+
+        claim_result() : status(CLAIM_NOT_FOUND), amount(0), index(-1) {}
+    };
+
     class SnapshotEntryCollection {
     public:
-        SnapshotEntryCollection(const snapshot_reader& reader_, int64_t amount_, uint64_t offset_, uint64_t claimed_offset_) {
+        SnapshotEntryCollection(const snapshot_reader& reader_, int64_t amount_, uint64_t offset_, uint64_t claimed_offset_,
+                                const section_filter* filter_ = 0, const eytzinger_section* search_index_ = 0,
+                                const section_model* model_ = 0, const perfect_hash_section* perfect_hash_ = 0) {
             reader = reader_;
             amount = amount_;
             offset = offset_;
             claimed_offset = claimed_offset_;
+            filter = filter_;
+            search_index = search_index_;
+            model = model_;
+            perfect_hash = perfect_hash_;
         }
         SnapshotEntryCollection(const SnapshotEntryCollection& other) {
             reader = other.reader;
             amount = other.amount;
             offset = other.offset;
             claimed_offset = other.claimed_offset;
+            filter = other.filter;
+            search_index = other.search_index;
+            model = other.model;
+            perfect_hash = other.perfect_hash;
         }
         SnapshotEntryCollection& operator=(const SnapshotEntryCollection& other) {
             reader = other.reader;
             amount = other.amount;
             offset = other.offset;
             claimed_offset = other.claimed_offset;
+            filter = other.filter;
+            search_index = other.search_index;
+            model = other.model;
+            perfect_hash = other.perfect_hash;
             return *this;
         }
 
-        void getEntry(int64_t index, snapshot_entry& entry) const;
+        // fails if the record can't be read
+        bool getEntry(int64_t index, snapshot_entry& entry) const;
         bool getEntry(const uint256_t& hash, snapshot_entry& entry);
         bool getEntry(const string& claim, const string& signature, snapshot_entry& entry);
         bool getEntry(const string& claim, const uint256_t signature, snapshot_entry& entry);
+        // recovers every claim's address on the pool, then looks them all up. results are in the order of claims
+        void getEntries(const vector<claim_request>& claims, vector<claim_result>& results, ThreadPool& pool);
+        // sorts the hashes and resolves them in one pass over the section. found and entries line up with hashes
+        void getEntries(const vector<uint160_t>& hashes, vector<snapshot_entry>& entries, vector<bool>& found,
+                        ThreadPool& pool);
         void setClaimed(int64_t index);
+        // thread safe, returns whether the entry was already claimed
+        bool testAndSetClaimed(claim_bitfield& bitfield, int64_t index);
         snapshot_reader reader;
         int64_t amount;
         uint64_t offset;
         uint64_t claimed_offset;
+        // owned by reader, may be null
+        const section_filter* filter;
+        // owned by reader, may be null. these cover the whole section, so subranges drop them
+        const eytzinger_section* search_index;
+        const section_model* model;
+        const perfect_hash_section* perfect_hash;
+
+        // reads just the hash of an entry, failing if it can't be read
+        bool getKey(int64_t index, uint160_t& hash) const;
 
-        class iterator {
+        /*
+        Random access over the section. Entries live on disk, so dereferencing reads one and returns it by value:
+        reference is a proxy value rather than an lvalue, which the std algorithms that only read (lower_bound,
+        distance, partitioning by index) are fine with. Value is snapshot_entry for whole entries or uint160_t to
+        read only hashes, which is all a search needs.
+         */
+        template <typename Value>
+        class basic_iterator {
         public:
-            typedef iterator self_type;
-            typedef snapshot_entry value_type;
-            typedef snapshot_entry& reference;
-            typedef snapshot_entry* pointer;
+            typedef basic_iterator self_type;
+            typedef Value value_type;
+            typedef Value reference;
             typedef int64_t difference_type;
             typedef random_access_iterator_tag iterator_category;
-            iterator() : collection(0), index(0) {} // broken, dunno why I should implement this
-            iterator(const SnapshotEntryCollection* collection_) : index(0) { collection = collection_; }
-            iterator(const SnapshotEntryCollection* collection_, int64_t index_) { collection = collection_; index = index_; }
-            self_type operator++() { self_type i = *this; index++; return i; }
-            self_type operator++(int junk) { index++; return *this; }
-            reference operator*() { collection->getEntry(index, current_entry); return current_entry; }
-            pointer operator->() { collection->getEntry(index, current_entry); return &current_entry; }
-            bool operator==(const self_type& rhs) { return index == rhs.index; }
-            bool operator!=(const self_type& rhs) { return index != rhs.index; }
-        //protected:
+
+            struct pointer {
+                Value value;
+                const Value* operator->() const { return &value; }
+            };
+
+            basic_iterator() : collection(0), index(0) {}
+            basic_iterator(const SnapshotEntryCollection* collection_, int64_t index_ = 0)
+                : collection(collection_), index(index_) {}
+
+            reference operator*() const { Value value; load(index, value); return value; }
+            pointer operator->() const { pointer p; load(index, p.value); return p; }
+            reference operator[](difference_type n) const { Value value; load(index + n, value); return value; }
+
+            self_type& operator++() { index++; return *this; }
+            self_type operator++(int junk) { self_type i = *this; index++; return i; }
+            self_type& operator--() { index--; return *this; }
+            self_type operator--(int junk) { self_type i = *this; index--; return i; }
+            self_type& operator+=(difference_type n) { index += n; return *this; }
+            self_type& operator-=(difference_type n) { index -= n; return *this; }
+            self_type operator+(difference_type n) const { return self_type(collection, index + n); }
+            self_type operator-(difference_type n) const { return self_type(collection, index - n); }
+            friend self_type operator+(difference_type n, const self_type& i) { return i + n; }
+            difference_type operator-(const self_type& rhs) const { return index - rhs.index; }
+
+            bool operator==(const self_type& rhs) const { return index == rhs.index; }
+            bool operator!=(const self_type& rhs) const { return index != rhs.index; }
+            bool operator<(const self_type& rhs) const { return index < rhs.index; }
+            bool operator>(const self_type& rhs) const { return index > rhs.index; }
+            bool operator<=(const self_type& rhs) const { return index <= rhs.index; }
+            bool operator>=(const self_type& rhs) const { return index >= rhs.index; }
+
+            int64_t position() const { return index; }
+
+        private:
+            void load(int64_t i, snapshot_entry& entry) const { collection->getEntry(i, entry); }
+            void load(int64_t i, uint160_t& hash) const { collection->getKey(i, hash); }
+
             const SnapshotEntryCollection* collection;
-            snapshot_entry current_entry;
             int64_t index;
         };
 
-        class const_iterator {
+        // entries are read only through the collection, so both iterators are the same
+        typedef basic_iterator<snapshot_entry> iterator;
+        typedef basic_iterator<snapshot_entry> const_iterator;
+        typedef basic_iterator<uint160_t> key_iterator;
+
+        const_iterator begin() const { return const_iterator(this); }
+        const_iterator end() const { return const_iterator(this, amount); }
+        key_iterator keysBegin() const { return key_iterator(this); }
+        key_iterator keysEnd() const { return key_iterator(this, amount); }
+
+        // entries [begin, end) as a collection of their own. indexes in it count from begin
+        SnapshotEntryCollection subrange(int64_t begin, int64_t end) const {
+            SnapshotEntryCollection range(*this);
+            range.offset = offset + begin * reader.format->record_size;
+            range.claimed_offset = claimed_offset + begin;
+            range.amount = end - begin;
+            range.search_index = 0;
+            range.model = 0;
+            range.perfect_hash = 0;
+            return range;
+        }
+        // parts nearly equal subranges covering the collection, for handing to separate workers
+        vector<SnapshotEntryCollection> split(int64_t parts) const;
+
+        /*
+        Single pass iterator for full scans. Records and their claim bits are read a chunk at a time into buffers
+        the iterator keeps, and the kernel is told the range will be read sequentially. Copies share the buffers,
+        so only one copy should be advanced. Each scan has its own descriptors, so scans may run on different threads.
+         */
+        class scan_iterator {
         public:
-            typedef const_iterator self_type;
+            typedef scan_iterator self_type;
             typedef snapshot_entry value_type;
             typedef const snapshot_entry& reference;
             typedef const snapshot_entry* pointer;
             typedef int64_t difference_type;
             typedef input_iterator_tag iterator_category;
-            const_iterator(const SnapshotEntryCollection* collection_) : index(0) { collection = collection_; }
-            const_iterator(const SnapshotEntryCollection* collection_, int64_t index_) { collection = collection_; index = index_; }
-            const_iterator(const iterator& other) {collection = other.collection; index = other.index; }
-            self_type operator++() { self_type i = *this; index++; return i; }
-            self_type operator++(int junk) { index++; return *this; }
-            reference operator*() { collection->getEntry(index, current_entry); return current_entry; }
-            pointer operator->() { collection->getEntry(index, current_entry); return &current_entry; }
-            bool operator==(const self_type& rhs) { return index == rhs.index; }
-            bool operator!=(const self_type& rhs) { return index != rhs.index; }
+            scan_iterator() : index(0) {}
+            scan_iterator(const SnapshotEntryCollection* collection, int64_t index_, int64_t end, int64_t chunk_entries);
+            self_type& operator++() { index++; return *this; }
+            self_type operator++(int junk) { self_type i = *this; index++; return i; }
+            reference operator*() const;
+            pointer operator->() const { return &**this; }
+            bool operator==(const self_type& rhs) const { return index == rhs.index; }
+            bool operator!=(const self_type& rhs) const { return index != rhs.index; }
+            int64_t position() const { return index; }
+            // whether any records or claim bits of the scan so far could not be read. those entries read as zeros,
+            // or as claimed
+            bool failed() const;
         private:
-            const SnapshotEntryCollection* collection;
-            snapshot_entry current_entry;
+            shared_ptr<scan_buffer> buffer;
             int64_t index;
         };
-        iterator begin() { return iterator(this); }
-        iterator end() { return iterator(this, amount);}
-        const_iterator begin() const { return const_iterator(this); }
-        const_iterator end() const { return const_iterator(this, amount); }
+        // scans [begin, end), end of -1 meaning the whole section
+        scan_iterator scanBegin(int64_t begin = 0, int64_t end = -1, int64_t chunk_entries = SCAN_BUFFER_ENTRIES) const {
+            return scan_iterator(this, begin, end < 0 ? amount : end, chunk_entries);
+        }
+        scan_iterator scanEnd(int64_t end = -1) const {
+            return scan_iterator(0, end < 0 ? amount : end, end, 0);
+        }
+
+        // consecutive [begin, end) ranges covering the collection, split where records start on a page boundary
+        vector<pair<int64_t, int64_t> > pageRanges(int64_t entries_per_range = PARALLEL_SCAN_ENTRIES) const;
+
+        // calls function(entry) for every entry. ranges run on the pool at once, each through its own scan, so
+        // function must be safe to call from several threads
+        template <typename Function>
+        void parallelForEach(ThreadPool& pool, Function function,
+                             int64_t entries_per_range = PARALLEL_SCAN_ENTRIES) const {
+            vector<pair<int64_t, int64_t> > ranges = pageRanges(entries_per_range);
+            pool.parallelFor(ranges.size(), 1, [&](uint64_t first, uint64_t last) {
+                for (uint64_t r = first; r < last; r++) {
+                    scan_iterator end = scanEnd(ranges[r].second);
+                    for (scan_iterator i = scanBegin(ranges[r].first, ranges[r].second); i != end; ++i) {
+                        function(*i);
+                    }
+                }
+            });
+        }
+
+        // accumulate(partial, entry) folds each range into its own partial, starting from identity. the partials
+        // are then folded with combine(result, partial) in range order, so the result doesn't depend on timing
+        template <typename T, typename Accumulate, typename Combine>
+        T parallelReduce(ThreadPool& pool, const T& identity, Accumulate accumulate, Combine combine,
+                         int64_t entries_per_range = PARALLEL_SCAN_ENTRIES) const {
+            vector<pair<int64_t, int64_t> > ranges = pageRanges(entries_per_range);
+            vector<T> partials(ranges.size(), identity);
+            pool.parallelFor(ranges.size(), 1, [&](uint64_t first, uint64_t last) {
+                for (uint64_t r = first; r < last; r++) {
+                    scan_iterator end = scanEnd(ranges[r].second);
+                    for (scan_iterator i = scanBegin(ranges[r].first, ranges[r].second); i != end; ++i) {
+                        accumulate(partials[r], *i);
+                    }
+                }
+            });
+            T result = identity;
+            for (const T& partial : partials) combine(result, partial);
+            return result;
+        }
     };
 
-    bool openSnapshot(ifstream& stream, snapshot_reader& reader);
+    // opens the named snapshot file if the stream isn't open yet. name should be the stream's file either way.
+    // fails for snapshot versions without a record format
+    bool openSnapshot(ifstream& stream, snapshot_reader& reader, const string& name = SNAPSHOT_NAME);
 
     SnapshotEntryCollection getP2PKHCollection(const snapshot_reader& reader);
     SnapshotEntryCollection getP2SHCollection(const snapshot_reader& reader);
 
+    // maps the whole snapshot read only. lookups then read memory instead of seeking the shared stream
+    bool mapSnapshot(snapshot_reader& reader);
+
+    // routes by the address version byte (0 and 111 are p2pkh, 5 and 196 are p2sh), other versions search both
+    bool findEntry(snapshot_reader& reader, const string& address, snapshot_entry& entry, snapshot_section& section);
+    // searches both sections at once, alternating probes between them and hinting the next probes to the kernel
+    bool findEntry(snapshot_reader& reader, const uint160_t& hash, snapshot_entry& entry, snapshot_section& section);
+
     void printSnapshot();
     void printHeader();
 
     uint64_t getP2PKHAmount(SnapshotEntryCollection& collection, const string& claim, const string& signature);
+    void getP2PKHAmounts(SnapshotEntryCollection& collection, const vector<claim_request>& claims,
+                         vector<claim_result>& results, ThreadPool& pool);
+    // claims the entries of the valid results in bitfield. where several results name the same entry the one ranked
+    // first wins, by order[i] when order is given (ties broken by position) and by position otherwise. the others,
+    // and results for entries claimed before, become CLAIM_ALREADY_CLAIMED. entries are grouped on the pool and
+    // each group claims its bit on its own, so nothing waits on a lock. an order not lining up with results claims
+    // nothing and marks the valid results CLAIM_ERROR
+    void claimEntries(SnapshotEntryCollection& collection, claim_bitfield& bitfield, vector<claim_result>& results,
+                      ThreadPool& pool, const vector<uint64_t>& order = vector<uint64_t>());
+    // the same resolution, write ahead: winners are queued in the journal rather than set in the bitfield, which
+    // happens once they are durable. wait on ticket before reporting them, and report the ones still CLAIM_VALID as
+    // errors if the wait fails. returns false, with the winners marked CLAIM_ERROR, if the journal took none of them
+    // or order does not line up with results
+    bool claimEntries(ClaimJournal& journal, snapshot_section section, vector<claim_result>& results,
+                      ThreadPool& pool, uint64_t& ticket, const vector<uint64_t>& order = vector<uint64_t>());
     uint64_t getP2SHAmount(SnapshotEntryCollection& collection, const string& transaction, const string& address, const uint32_t input_index);
+    // parses the transaction once, checks all inputs in parallel and looks up every claimed script hash as one batch
+    void getP2SHAmounts(SnapshotEntryCollection& collection, const string& transaction,
+                        const vector<p2sh_claim_input>& inputs, vector<claim_result>& results, ThreadPool& pool);
 }
 
 #endif
@@ -25,6 +25,13 @@ using namespace std;
 namespace bst {
     static const string SNAPSHOT_NAME = "snapshot";
     static const string SNAPSHOT_CLAIMED_NAME = "snapshot.claimed";
+    static const string JOURNAL_EXTENSION = ".journal";
+    static const string SNAPSHOT_JOURNAL_NAME = SNAPSHOT_CLAIMED_NAME + JOURNAL_EXTENSION;
+
+    enum snapshot_section {
+        SECTION_P2PKH = 0,
+        SECTION_P2SH = 1
+    };
 
     // std::array seems a problem, not sure why. Find out and switch these
     typedef std::vector<uint8_t> uint160_t;
@@ -49,18 +56,23 @@ namespace bst {
         uint256_t block_hash;
         uint64_t nP2PKH;
         uint64_t nP2SH;
+        // not stored in the header: taken from the snapshot file by openSnapshot, and recorded in the sidecar files
+        // built from it, so a sidecar is only used with the exact file it was built from
+        uint64_t fingerprint;
 
-        snapshot_header() : version(0), block_hash(32), nP2PKH(0), nP2SH(0) { }
+        snapshot_header() : version(0), block_hash(32), nP2PKH(0), nP2SH(0), fingerprint(0) { }
         snapshot_header(const snapshot_header& other) {
             version = other.version;
             block_hash = other.block_hash;
             nP2PKH = other.nP2PKH;
             nP2SH = other.nP2SH;
+            fingerprint = other.fingerprint;
         }
     };
     static const int HEADER_SIZE = 4 + 32 + 8 + 8;
 
-    void resetClaims(snapshot_header& header);
+    // also discards the claim journal belonging to the claim file. fails if either can't be done
+    bool resetClaims(snapshot_header& header, const string& name = SNAPSHOT_CLAIMED_NAME);
 }
 
 #endif
\ No newline at end of file
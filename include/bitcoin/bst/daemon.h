@@ -0,0 +1,192 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SPINOFF_TOOLKIT_DAEMON_H
+#define SPINOFF_TOOLKIT_DAEMON_H
+
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <memory>
+#include <set>
+#include "common.h"
+#include "claim.h"
+#include "journal.h"
+#include "thread_pool.h"
+#include "warmup.h"
+
+using namespace std;
+
+namespace bst {
+
+    static const string DAEMON_SOCKET_NAME = "snapshot.sock";
+
+    /*
+    Request
+    Length             bytes following this field                                  4 bytes (uint32)
+    Id                 chosen by the client, echoed in the response                4 bytes (uint32)
+    Type               1 balance, 2 claim                                          1 byte
+    Section            0 p2pkh, 1 p2sh, 0xff either                                1 byte
+    balance:
+    Hash               hash160 to look up                                          20 bytes
+    claim (p2pkh only):
+    Signature          compact signature of the message                            65 bytes
+    Message            the claim message                                           rest of the frame
+
+    Response
+    Length             always 14                                                   4 bytes (uint32)
+    Id                 id of the request                                           4 bytes (uint32)
+    Status             daemon_status                                               1 byte
+    Section            section the entry was found in                              1 byte
+    Amount             amount of the entry, zero unless found                      8 bytes (uint64)
+
+    Requests may be pipelined. Responses on a connection come back in request order.
+     */
+    enum daemon_request_type {
+        REQUEST_BALANCE = 1,
+        REQUEST_CLAIM = 2
+    };
+
+    enum daemon_status {
+        STATUS_OK = 0,
+        STATUS_NOT_FOUND = 1,
+        STATUS_BAD_SIGNATURE = 2,
+        STATUS_ALREADY_CLAIMED = 3,
+        STATUS_BAD_REQUEST = 4,
+        STATUS_ERROR = 5
+    };
+
+    static const uint8_t SECTION_ANY = 0xff;
+    static const uint32_t MAX_REQUEST_SIZE = 1 << 16;
+    static const uint32_t RESPONSE_SIZE = 4 + 4 + 1 + 1 + 8;
+
+    struct daemon_request
+    {
+        uint32_t id;
+        uint8_t type;
+        uint8_t section;
+        uint160_t hash;
+        uint256_t signature;
+        string message;
+
+        daemon_request() : id(0), type(0), section(SECTION_ANY), hash(20) {}
+    };
+
+    struct daemon_response
+    {
+        uint32_t id;
+        uint8_t status;
+        uint8_t section;
+        uint64_t amount;
+
+        daemon_response() : id(0), status(STATUS_ERROR), section(SECTION_ANY), amount(0) {}
+    };
+
+    void encodeRequest(const daemon_request& request, vector<uint8_t>& out);
+    // returns the bytes used, 0 if the frame is incomplete, or -1 if it can never be valid
+    int64_t decodeRequest(const uint8_t* data, size_t length, daemon_request& request);
+    void encodeResponse(const daemon_response& response, vector<uint8_t>& out);
+    int64_t decodeResponse(const uint8_t* data, size_t length, daemon_response& response);
+
+    struct daemon_options
+    {
+        string socket_name;
+        string snapshot_name;
+        string claimed_name;
+        // zero means one per core
+        unsigned threads;
+        journal_options journal;
+        string journal_name;
+        // warm the snapshot and claim bitfield on open, blocking or in the background as warmup says
+        bool warm;
+        warmup_options warmup;
+
+        daemon_options() : socket_name(DAEMON_SOCKET_NAME), snapshot_name(SNAPSHOT_NAME),
+                           claimed_name(SNAPSHOT_CLAIMED_NAME), threads(0), journal_name(SNAPSHOT_JOURNAL_NAME),
+                           warm(false) {}
+    };
+
+    /*
+    Keeps the snapshot and claim bitfield mapped and answers balance and claim requests over a unix socket.
+    Each connection gets a thread; every request already buffered on a connection is answered as one batch,
+    with the work spread over a shared pool. Accepted claims are made durable through the claim journal.
+     */
+    class SnapshotDaemon {
+    public:
+        SnapshotDaemon();
+        ~SnapshotDaemon();
+
+        bool open(const daemon_options& options);
+        // serves connections until stop is called
+        void run();
+        // safe to call from a signal handler
+        void stop();
+        void close();
+
+        void processBatch(const vector<daemon_request>& requests, vector<daemon_response>& responses);
+
+    private:
+        SnapshotDaemon(const SnapshotDaemon&);
+        SnapshotDaemon& operator=(const SnapshotDaemon&);
+
+        void serveConnection(int fd);
+
+        daemon_options options;
+        ifstream stream;
+        snapshot_reader reader;
+        claim_bitfield bitfield;
+        SnapshotWarmer warmer;
+        ClaimJournal journal;
+        unique_ptr<ThreadPool> pool;
+        int listen_fd;
+        atomic<bool> stopping;
+
+        mutex connections_lock;
+        condition_variable connections_done;
+        set<int> connections;
+    };
+
+    // client side of the protocol. queue requests, flush, then receive responses in the same order
+    class SnapshotClient {
+    public:
+        SnapshotClient();
+        ~SnapshotClient();
+
+        bool connect(const string& socket_name = DAEMON_SOCKET_NAME);
+        void close();
+
+        void queueBalance(uint32_t id, const uint160_t& hash, uint8_t section = SECTION_ANY);
+        // signature is the 65 byte compact signature, not base64
+        void queueClaim(uint32_t id, const string& message, const uint256_t& signature);
+        bool flush();
+        bool receive(daemon_response& response);
+
+        // single round trips
+        bool getBalance(const uint160_t& hash, daemon_response& response, uint8_t section = SECTION_ANY);
+        bool claim(const string& message, const uint256_t& signature, daemon_response& response);
+
+    private:
+        SnapshotClient(const SnapshotClient&);
+        SnapshotClient& operator=(const SnapshotClient&);
+
+        int fd;
+        uint32_t next_id;
+        vector<uint8_t> outgoing;
+        vector<uint8_t> incoming;
+        size_t incoming_start;
+    };
+}
+
+#endif
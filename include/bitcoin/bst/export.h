@@ -0,0 +1,113 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SPINOFF_TOOLKIT_EXPORT_H
+#define SPINOFF_TOOLKIT_EXPORT_H
+
+#include <cstdint>
+#include <string>
+#include "claim.h"
+
+using namespace std;
+
+namespace bst {
+
+    enum export_format {
+        // what printSnapshot always printed: a section line, then "address amount" per entry
+        EXPORT_TEXT,
+        // address,type,amount,claimed with a header row
+        EXPORT_CSV,
+        // one {"address":...,"type":...,"amount":...,"claimed":...} object per line
+        EXPORT_JSONL
+    };
+
+    // longest base58check encoding of a version byte and a 20 byte hash
+    static const int MAX_ADDRESS_LENGTH = 35;
+
+    struct export_options
+    {
+        export_format format;
+        // address version bytes, testnet by default like printSnapshot
+        uint8_t p2pkh_version;
+        uint8_t p2sh_version;
+        // zero means one per core
+        unsigned threads;
+
+        export_options() : format(EXPORT_TEXT), p2pkh_version(111), p2sh_version(196), threads(0) {}
+    };
+
+    // base58check of version followed by the 20 byte hash, without a bignum. writes no terminator, returns the length
+    int encodeAddress(uint8_t version, const uint8_t* hash, char* out);
+
+    /*
+    Writes every entry of both sections to fd. Ranges of entries are encoded on a pool while the calling thread
+    writes finished ranges in order, each with a single write, so output matches a sequential export exactly.
+     */
+    bool exportSnapshot(const snapshot_reader& reader, int fd, const export_options& options = export_options());
+
+    static const string COLUMNS_EXTENSION = ".columns";
+    static const uint64_t COLUMN_ALIGNMENT = 4096;
+
+    enum column_type {
+        COLUMN_BINARY = 1,
+        COLUMN_UINT64 = 2,
+        COLUMN_BITMAP = 3,
+        COLUMN_UINT8 = 4
+    };
+
+    /*
+    Columns file, everything little endian
+    Magic              "BSTC"                                                      4 bytes
+    Version            01 00 00 00                                                 4 bytes (uint32)
+    Blockhash          block hash of the snapshot the columns came from            32 bytes
+    Rows               number of rows                                              8 bytes (uint64)
+    Columns            number of columns                                           4 bytes (uint32)
+    Reserved           zero                                                        4 bytes
+    then per column
+    Name               zero padded                                                 16 bytes
+    Type               column_type                                                 4 bytes (uint32)
+    Width              bytes per value, 0 for a bitmap                             4 bytes (uint32)
+    Offset             from the start of the file, a multiple of 4096              8 bytes (uint64)
+    Length             bytes of column data, not counting padding                  8 bytes (uint64)
+
+    Columns are "hash" (binary, 20), "amount" (uint64) and "claimed" (bitmap, row n in bit n % 8 of byte n / 8,
+    like snapshot.claimed). A combined file adds "section" (uint8, 0 p2pkh and 1 p2sh). Every column starts on a
+    page, so it can be mapped and used as an array in place.
+     */
+    struct column_info
+    {
+        string name;
+        uint32_t type;
+        uint32_t width;
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    struct column_file
+    {
+        uint256_t block_hash;
+        uint64_t rows;
+        vector<column_info> columns;
+
+        column_file() : block_hash(32), rows(0) {}
+    };
+
+    // writes prefix.p2pkh.columns and prefix.p2sh.columns, or one prefix.columns with a section column if combined
+    bool exportColumns(const snapshot_reader& reader, const string& prefix = SNAPSHOT_NAME, bool combined = false,
+                       unsigned threads = 0);
+    bool readColumnDirectory(const string& name, column_file& file);
+}
+
+#endif
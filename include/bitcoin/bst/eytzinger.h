@@ -0,0 +1,85 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SPINOFF_TOOLKIT_EYTZINGER_H
+#define SPINOFF_TOOLKIT_EYTZINGER_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <string>
+#include "common.h"
+
+using namespace std;
+
+namespace bst {
+
+    static const string INDEX_EXTENSION = ".eytzinger";
+    static const string SNAPSHOT_INDEX_NAME = SNAPSHOT_NAME + INDEX_EXTENSION;
+    // every 16th record is sampled, which leaves at most 16 records, about 7 cache lines, to search in the section
+    static const uint64_t INDEX_SAMPLE_STEP = 16;
+
+    /*
+    Sampled keys of one section in Eytzinger (breadth first) order: the children of node k are 2k and 2k + 1, so
+    the top of the tree shares a few cache lines and a descent can prefetch the nodes it will reach three levels
+    down. Nodes hold the first 8 bytes of a sampled hash as a big endian number, and the entry index it came from.
+     */
+    struct eytzinger_section
+    {
+        uint64_t step;
+        uint64_t nodes;
+        // nodes + 1 keys, node 0 unused. cache line aligned so the 8 grandchildren three levels down share a line
+        shared_ptr<uint64_t> keys;
+        vector<int64_t> indexes;
+
+        eytzinger_section() : step(0), nodes(0) {}
+
+        void init(uint64_t nodes);
+        /*
+        Narrows the search for hash in a section of amount entries to [low, high). When the sample at high - 1
+        starts with the same 8 bytes as hash, open is set: hash may still come after it, anywhere up to amount.
+         */
+        void bounds(const uint8_t* hash, int64_t amount, int64_t& low, int64_t& high, bool& open) const;
+    };
+
+    /*
+    Index file
+    Magic              "BSTE"                                                      4 bytes
+    Version            02 00 00 00                                                 4 bytes (uint32)
+    Blockhash          block hash of the snapshot the index was built from         32 bytes
+    nP2PKH, nP2SH      entry counts of that snapshot                               16 bytes (uint64)
+    Fingerprint        fingerprint of that snapshot file                           8 bytes (uint64)
+    then for P2PKH and P2SH in turn
+    Step               records between samples                                     8 bytes (uint64)
+    Nodes              number of samples                                           8 bytes (uint64)
+    Keys               hash prefixes in Eytzinger order, from node 1               nodes * 8 bytes
+    Indexes            entry index of each node                                    nodes * 8 bytes
+     */
+    struct eytzinger_index
+    {
+        snapshot_header header;
+        eytzinger_section sections[2];
+    };
+
+    // samples every step'th record of the snapshot, 1 indexing every record. no indexName means the snapshot's own,
+    // snapshotName + INDEX_EXTENSION
+    bool buildSnapshotIndex(const string& snapshotName = SNAPSHOT_NAME, const string& indexName = string(),
+                            const uint64_t step = INDEX_SAMPLE_STEP);
+    // fails if the file is missing, damaged or belongs to a different snapshot
+    bool readSnapshotIndex(eytzinger_index& index, const snapshot_header& header,
+                           const string& indexName = SNAPSHOT_INDEX_NAME);
+}
+
+#endif
@@ -0,0 +1,75 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SPINOFF_TOOLKIT_FILTER_H
+#define SPINOFF_TOOLKIT_FILTER_H
+
+#include <cstdint>
+#include <vector>
+#include <string>
+#include "common.h"
+
+using namespace std;
+
+namespace bst {
+
+    // a snapshot's filter sits next to it, named after it
+    static const string FILTER_EXTENSION = ".filter";
+    static const string SNAPSHOT_FILTER_NAME = SNAPSHOT_NAME + FILTER_EXTENSION;
+    static const int FILTER_BITS_PER_KEY = 10;
+
+    /*
+    Blocked Bloom filter over the hashes of one snapshot section. Each hash picks one 512 bit block (a single cache
+    line) and sets one bit in each of its eight words, which gives about 1% false positives at 10 bits per key.
+     */
+    struct section_filter
+    {
+        uint64_t blocks;
+        vector<uint64_t> words;
+
+        section_filter() : blocks(0) {}
+
+        void init(uint64_t entries);
+        void add(const uint8_t* hash);
+        // false means the hash is definitely not in the section
+        bool mayContain(const uint8_t* hash) const;
+    };
+
+    /*
+    Filter file
+    Magic              "BSTF"                                                      4 bytes
+    Version            02 00 00 00                                                 4 bytes (uint32)
+    Blockhash          block hash of the snapshot the filter was built from        32 bytes
+    nP2PKH, nP2SH      entry counts of that snapshot                               16 bytes (uint64)
+    Fingerprint        fingerprint of that snapshot file                           8 bytes (uint64)
+    then for P2PKH and P2SH in turn
+    Blocks             number of 64 byte blocks, fixed by the section's count      8 bytes (uint64)
+    Words              the blocks                                                  blocks * 64 bytes
+     */
+    struct snapshot_filter
+    {
+        snapshot_header header;
+        section_filter sections[2];
+    };
+
+    // reads the snapshot front to back and writes a filter for both of its sections. no filterName means the
+    // snapshot's own, snapshotName + FILTER_EXTENSION
+    bool buildSnapshotFilter(const string& snapshotName = SNAPSHOT_NAME, const string& filterName = string());
+    // fails if the file is missing, damaged or belongs to a different snapshot
+    bool readSnapshotFilter(snapshot_filter& filter, const snapshot_header& header,
+                            const string& filterName = SNAPSHOT_FILTER_NAME);
+}
+
+#endif
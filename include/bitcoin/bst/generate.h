@@ -19,6 +19,8 @@
 #include <fstream>
 #include <sqlite3.h>
 #include "common.h"
+#include "record.h"
+#include "model.h"
 
 using namespace std;
 
@@ -40,7 +42,45 @@ namespace bst {
     // also cleans up
     bool writeSnapshot(snapshot_preparer& preparer, const uint256_t& blockhash, const uint64_t dustLimit);
     bool writeJustSqlite(snapshot_preparer& preparer);
-    bool writeSnapshotFromSqlite(const uint256_t& blockhash, const uint64_t dustLimit);
+
+    struct snapshot_options
+    {
+        // builds the negative lookup filter next to the snapshot
+        bool write_filter;
+        // builds the search index next to the snapshot
+        bool write_index;
+        // snapshot version to write, which picks the record layout
+        uint32_t version;
+        // above zero, a learned index with this error is appended to the snapshot
+        uint32_t model_error;
+
+        snapshot_options() : write_filter(false), write_index(false), version(SNAPSHOT_VERSION), model_error(0) {}
+    };
+
+    // filters and indexes of the snapshot being replaced are removed first, then the ones asked for are built
+    bool writeSnapshotFromSqlite(const uint256_t& blockhash, const uint64_t dustLimit,
+                                 const snapshot_options& options = snapshot_options());
+
+    // streams entries into a snapshot file: all p2pkh entries, then all p2sh entries, each section sorted by hash
+    struct snapshot_writer
+    {
+        ofstream snapshot;
+        snapshot_header header;
+        const record_format* format;
+        vector<char> buffer;
+        // zero when no model is written
+        uint32_t model_error;
+        SplineBuilder models[2];
+    };
+
+    // fails for versions without a record format. with a modelError above zero, a model of the entries is built as
+    // they are written and appended by closeSnapshotWriter
+    bool openSnapshotWriter(snapshot_writer& writer, const uint256_t& blockhash, const string& name = SNAPSHOT_NAME,
+                            const uint32_t version = SNAPSHOT_VERSION, const uint32_t modelError = 0);
+    void writeSnapshotEntry(snapshot_writer& writer, const snapshot_section section, const uint8_t* hash,
+                            const uint64_t amount);
+    // fills in the header and writes an empty claim file for the snapshot. fails if either can't be written
+    bool closeSnapshotWriter(snapshot_writer& writer, const string& claimedName = SNAPSHOT_CLAIMED_NAME);
 
 }
 
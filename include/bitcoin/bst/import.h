@@ -0,0 +1,76 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SPINOFF_TOOLKIT_IMPORT_H
+#define SPINOFF_TOOLKIT_IMPORT_H
+
+#include <cstdint>
+#include <string>
+#include "common.h"
+#include "record.h"
+
+using namespace std;
+
+namespace bst {
+
+    struct import_options
+    {
+        // 40 hex character hashes carry no version byte, so they all go to this section
+        snapshot_section hex_section;
+        // entries whose total is below this are left out, like the dust limit of writeSnapshotFromSqlite
+        uint64_t dust_limit;
+        // zero means one per core
+        unsigned threads;
+        // otherwise the import fails on the first bad line without writing anything
+        bool skip_invalid;
+        // snapshot version to write, which picks the record layout
+        uint32_t version;
+        // above zero, a learned index with this error is appended to the snapshot
+        uint32_t model_error;
+
+        import_options() : hex_section(SECTION_P2PKH), dust_limit(0), threads(0), skip_invalid(false),
+                           version(SNAPSHOT_VERSION), model_error(0) {}
+    };
+
+    struct import_stats
+    {
+        uint64_t lines;
+        uint64_t invalid;
+        // byte offset of the first invalid line, when there is one
+        uint64_t first_invalid;
+        // lines folded into an earlier line for the same hash
+        uint64_t merged;
+        uint64_t dust;
+        uint64_t p2pkh;
+        uint64_t p2sh;
+
+        import_stats() : lines(0), invalid(0), first_invalid(0), merged(0), dust(0), p2pkh(0), p2sh(0) {}
+    };
+
+    // base58check of a version byte and a 20 byte hash
+    bool decodeAddress(const char* text, size_t length, uint8_t& version, uint8_t* hash);
+
+    /*
+    Builds a snapshot and empty claim file straight from a balance file, one "address,amount" per line. The
+    separator may be a comma, tab or space, and a first line that doesn't parse is taken for a header. Addresses are
+    base58check with versions 0 or 111 for p2pkh and 5 or 196 for p2sh, or 40 hex characters of hash. Lines for the
+    same hash are summed. The file is mapped and parsed in parallel chunks, and the entries are sorted on the pool.
+     */
+    bool importBalances(const string& inputName, const uint256_t& blockhash, const import_options& options,
+                        import_stats& stats, const string& snapshotName = SNAPSHOT_NAME,
+                        const string& claimedName = SNAPSHOT_CLAIMED_NAME);
+}
+
+#endif
@@ -0,0 +1,119 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SPINOFF_TOOLKIT_JOURNAL_H
+#define SPINOFF_TOOLKIT_JOURNAL_H
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_set>
+#include "common.h"
+#include "bitfield.h"
+
+using namespace std;
+
+namespace bst {
+
+    /*
+    Journal record, 48 bytes
+    Checksum           FNV-1a of the remaining 44 bytes                            4 bytes (uint32)
+    Section            snapshot_section the claim belongs to                       1 byte
+    Flags              1 if a claim transaction is referenced                      1 byte
+    Reserved           zero                                                        2 bytes
+    Index              index of the entry within its section                       8 bytes (int64)
+    Transaction        hash of the claim transaction, or zero                      32 bytes
+     */
+    static const int JOURNAL_RECORD_SIZE = 4 + 1 + 1 + 2 + 8 + 32;
+
+    struct journal_options {
+        // a claim waits at most this long for the group commit that makes it durable
+        uint32_t max_latency_us;
+        // commit as soon as this many claims are waiting
+        uint32_t max_batch;
+        // once the journal grows past this, the bitfield is synced and the journal emptied
+        uint64_t checkpoint_bytes;
+
+        journal_options() : max_latency_us(1000), max_batch(4096), checkpoint_bytes(64 << 20) {}
+    };
+
+    /*
+    Append-only log of accepted claims. Many threads may append at once; a single committer thread writes and
+    fsyncs whatever has queued up as one group and wakes the appenders. Only then does it apply the claims to the
+    mapped bitfield and, once the journal is big enough, checkpoint, so appenders never wait on either.
+    Opening the journal replays any records left over from a crash into the bitfield.
+     */
+    class ClaimJournal {
+    public:
+        ClaimJournal();
+        ~ClaimJournal();
+
+        // fails if the journal holds claims of entries the bitfield doesn't have
+        bool open(const snapshot_header& header, claim_bitfield& bitfield,
+                  const journal_options& options = journal_options(), const string& name = SNAPSHOT_JOURNAL_NAME);
+        void close();
+
+        // blocks until the claim is durable, returns false if it could not be written
+        bool append(snapshot_section section, int64_t index, const uint256_t& transaction = uint256_t());
+        // write ahead claiming: queues the claims of entries neither claimed nor queued already, marking the rest in
+        // taken, without waiting. their bits are set only once they are durable. returns false if the journal failed
+        bool reserve(snapshot_section section, const vector<int64_t>& indexes, vector<bool>& taken,
+                     uint64_t& ticket);
+        // blocks until everything queued up to ticket is durable, returns false if it could not be written
+        bool wait(uint64_t ticket);
+
+        uint64_t replayed() const { return replayed_records; }
+        uint64_t commits() const { return commit_count; }
+        uint64_t checkpointFailures() const { return checkpoint_failures; }
+
+    private:
+        ClaimJournal(const ClaimJournal&);
+        ClaimJournal& operator=(const ClaimJournal&);
+
+        void commitLoop();
+        bool replay();
+        bool checkpoint();
+        // sets the bits of the records, returning how many were for entries outside the bitfield
+        uint64_t apply(const vector<uint8_t>& records);
+        // forgets the reservations of records once their bits are set, or once they failed to be written
+        void release(const vector<uint8_t>& records);
+        uint64_t recordBit(const uint8_t* record) const;
+
+        int fd;
+        claim_bitfield* bitfield;
+        uint64_t p2sh_offset;
+        uint64_t journal_size;
+        journal_options options;
+
+        mutex lock;
+        condition_variable work_ready;
+        condition_variable work_done;
+        thread committer;
+        vector<uint8_t> pending;
+        // bits of reserved claims not yet applied to the bitfield
+        unordered_set<uint64_t> reserved;
+        uint64_t appended;
+        uint64_t committed;
+        bool stopping;
+        bool failed;
+
+        uint64_t replayed_records;
+        uint64_t commit_count;
+        atomic<uint64_t> checkpoint_failures;
+    };
+}
+
+#endif
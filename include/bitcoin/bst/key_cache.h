@@ -0,0 +1,216 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SPINOFF_TOOLKIT_KEY_CACHE_H
+#define SPINOFF_TOOLKIT_KEY_CACHE_H
+
+#include <cstdint>
+#include <cstring>
+#include <array>
+#include <mutex>
+#include <memory>
+#include <unordered_map>
+#include <bitcoin/bitcoin.hpp>
+#include "common.h"
+
+using namespace std;
+
+namespace bst {
+
+    static const size_t KEY_CACHE_CAPACITY = 1 << 18;
+    static const size_t SCRIPT_CACHE_CAPACITY = 1 << 18;
+    static const unsigned KEY_CACHE_SHARDS = 64;
+
+    struct key_cache_stats
+    {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t entries;
+
+        key_cache_stats() : hits(0), misses(0), entries(0) {}
+    };
+
+    // keys made of hashes and signatures are spread well enough already, any eight of their bytes will do
+    template <size_t N>
+    struct byte_key_hasher
+    {
+        size_t operator()(const array<uint8_t, N>& key) const
+        {
+            uint64_t a, b;
+            memcpy(&a, &key[0], sizeof(a));
+            memcpy(&b, &key[N - sizeof(b)], sizeof(b));
+            return (size_t) (a ^ b);
+        }
+    };
+
+    /*
+    Bounded map spread over independently locked shards. Each shard keeps a young and an old generation: new entries
+    go to the young one, hits in the old one are moved back to the young one, and when the young generation fills up
+    the old one is dropped. That bounds the cache at capacity entries and keeps whatever was used recently.
+     */
+    template <typename Key, typename Value, typename Hasher>
+    class ShardedCache {
+    public:
+        ShardedCache(size_t capacity, unsigned shards_) : shard_count(shards_ ? shards_ : 1)
+        {
+            // two generations per shard, each allowed half of the shard's share
+            generation_size = capacity / shard_count / 2;
+            if (generation_size == 0) generation_size = 1;
+            shards.reset(new shard[shard_count]);
+        }
+
+        bool find(const Key& key, Value& value)
+        {
+            shard& s = shardFor(key);
+            lock_guard<mutex> guard(s.lock);
+
+            auto found = s.young.find(key);
+            if (found != s.young.end()) {
+                value = found->second;
+            } else {
+                auto aged = s.old.find(key);
+                if (aged == s.old.end()) {
+                    s.misses++;
+                    return false;
+                }
+                // still in use, keep it through the next generation change
+                value = aged->second;
+                s.old.erase(aged);
+                store(s, key, value);
+            }
+            s.hits++;
+            return true;
+        }
+
+        void insert(const Key& key, const Value& value)
+        {
+            shard& s = shardFor(key);
+            lock_guard<mutex> guard(s.lock);
+            store(s, key, value);
+        }
+
+        void clear()
+        {
+            for (unsigned i = 0; i < shard_count; i++) {
+                lock_guard<mutex> guard(shards[i].lock);
+                shards[i].young.clear();
+                shards[i].old.clear();
+                shards[i].hits = 0;
+                shards[i].misses = 0;
+            }
+        }
+
+        key_cache_stats stats()
+        {
+            key_cache_stats result;
+            for (unsigned i = 0; i < shard_count; i++) {
+                lock_guard<mutex> guard(shards[i].lock);
+                result.hits += shards[i].hits;
+                result.misses += shards[i].misses;
+                result.entries += shards[i].young.size() + shards[i].old.size();
+            }
+            return result;
+        }
+
+    private:
+        ShardedCache(const ShardedCache&);
+        ShardedCache& operator=(const ShardedCache&);
+
+        struct shard
+        {
+            mutex lock;
+            unordered_map<Key, Value, Hasher> young;
+            unordered_map<Key, Value, Hasher> old;
+            uint64_t hits;
+            uint64_t misses;
+
+            shard() : hits(0), misses(0) {}
+        };
+
+        shard& shardFor(const Key& key)
+        {
+            size_t hash = Hasher()(key);
+            return shards[(hash ^ (hash >> 29)) % shard_count];
+        }
+
+        void store(shard& s, const Key& key, const Value& value)
+        {
+            if (s.young.size() >= generation_size && s.young.find(key) == s.young.end()) {
+                s.old.swap(s.young);
+                s.young.clear();
+            }
+            s.young[key] = value;
+        }
+
+        size_t generation_size;
+        unique_ptr<shard[]> shards;
+        unsigned shard_count;
+    };
+
+    // remembers the pubkey hash recovered for a (message hash, signature) pair, so a resubmitted claim skips EC recovery
+    class RecoveredKeyCache {
+    public:
+        explicit RecoveredKeyCache(size_t capacity = KEY_CACHE_CAPACITY, unsigned shards = KEY_CACHE_SHARDS)
+            : cache(capacity, shards) {}
+
+        bool find(const bc::hash_digest& message_hash, const bc::message_signature& signature, uint160_t& hash);
+        void insert(const bc::hash_digest& message_hash, const bc::message_signature& signature, const uint160_t& hash);
+        void clear() { cache.clear(); }
+        key_cache_stats stats() { return cache.stats(); }
+
+    private:
+        typedef array<uint8_t, 32 + 65> cache_key;
+        typedef array<uint8_t, 20> cache_value;
+
+        static void makeKey(const bc::hash_digest& message_hash, const bc::message_signature& signature, cache_key& key);
+
+        ShardedCache<cache_key, cache_value, byte_key_hasher<32 + 65> > cache;
+    };
+
+    /*
+    Remembers whether an input of a claim transaction satisfied a p2sh output script. Keyed by txid and input index,
+    plus the script hash the input was checked against, since the same input can be offered for a different address.
+     */
+    class ScriptValidationCache {
+    public:
+        explicit ScriptValidationCache(size_t capacity = SCRIPT_CACHE_CAPACITY, unsigned shards = KEY_CACHE_SHARDS)
+            : cache(capacity, shards) {}
+
+        bool find(const bc::hash_digest& txid, uint32_t input_index, const uint160_t& script_hash, bool& valid);
+        void insert(const bc::hash_digest& txid, uint32_t input_index, const uint160_t& script_hash, bool valid);
+        void clear() { cache.clear(); }
+        key_cache_stats stats() { return cache.stats(); }
+
+    private:
+        typedef array<uint8_t, 32 + 4 + 20> cache_key;
+
+        static void makeKey(const bc::hash_digest& txid, uint32_t input_index, const uint160_t& script_hash,
+                            cache_key& key);
+
+        ShardedCache<cache_key, bool, byte_key_hasher<32 + 4 + 20> > cache;
+    };
+
+    // the caches used by claim lookups
+    RecoveredKeyCache& recoveredKeyCache();
+    ScriptValidationCache& scriptValidationCache();
+
+    // recover_address through a cache, repeated claims only pay for hashing the message
+    bool recover_address(const string& message, const bc::message_signature& signature, vector<uint8_t>& paymentVector,
+                         RecoveredKeyCache& cache);
+    bool recover_address(const string& message, const string& signature, vector<uint8_t>& paymentVector,
+                         RecoveredKeyCache& cache);
+}
+
+#endif
@@ -27,6 +27,7 @@ namespace bst {
     string getVerificationMessage(string address, string message, string signature);
     bool recover_address(const string &message, const string &signature, vector <uint8_t> &paymentVector);
     bool recover_address(const string &message, const bc::message_signature &signature, vector <uint8_t> &paymentVector);
+    bool recover_address(const bc::hash_digest &message_hash, const bc::message_signature &signature, vector <uint8_t> &paymentVector);
 
     // remove these two
     void prettyPrintVector(const vector<uint8_t>& vector, stringstream& ss);
@@ -0,0 +1,102 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SPINOFF_TOOLKIT_MODEL_H
+#define SPINOFF_TOOLKIT_MODEL_H
+
+#include <cstdint>
+#include <vector>
+#include "common.h"
+
+using namespace std;
+
+namespace bst {
+
+    // records either side of a prediction. 256 keeps the window to two pages of packed records, and a uniform
+    // section needs a spline point for about every 65k records at that error
+    static const uint32_t MODEL_ERROR = 256;
+    static const uint32_t MAX_RADIX_BITS = 16;
+
+    struct spline_point
+    {
+        uint64_t key;
+        uint64_t position;
+    };
+
+    /*
+    Radix spline over one section: the hash prefix to position curve as a few points joined by straight lines,
+    every position within error of the line. The radix table maps the top bits of a prefix to the points whose
+    segment may hold it, so a prediction is a table lookup, a short search and an interpolation.
+     */
+    struct section_model
+    {
+        uint32_t error;
+        uint32_t radix_bits;
+        vector<spline_point> points;
+        // 2^radix_bits + 1 entries, the first point at or past each radix bucket
+        vector<uint32_t> radix;
+
+        section_model() : error(0), radix_bits(0) {}
+
+        // [low, high) within a section of amount entries that should hold the lower bound of hash
+        void predict(const uint8_t* hash, int64_t amount, int64_t& low, int64_t& high) const;
+    };
+
+    /*
+    Builds a section model in one pass over its sorted hashes (the greedy spline corridor of RadixSpline): a point
+    is only added when the next key can't be reached by a line from the last point within the error.
+     */
+    class SplineBuilder {
+    public:
+        explicit SplineBuilder(uint32_t error = MODEL_ERROR);
+
+        void add(const uint8_t* hash);
+        void finish(section_model& model);
+
+    private:
+        void addPoint(uint64_t key, uint64_t position);
+
+        uint32_t error;
+        uint64_t count;
+        vector<spline_point> points;
+        spline_point previous;
+        spline_point upper;
+        spline_point lower;
+    };
+
+    /*
+    Model trailer, appended after the last record. Readers that don't know it never look past the records
+    For P2PKH and P2SH in turn
+    Error              records either side of a prediction                         4 bytes (uint32)
+    Radix bits         bits of prefix the radix table is indexed by                4 bytes (uint32)
+    Points             number of spline points                                     8 bytes (uint64)
+    Spline             key and position of each point                              points * 16 bytes
+    Radix              first point of each bucket                                  (2^bits + 1) * 4 bytes
+    then
+    Size               bytes of the sections above                                 8 bytes (uint64)
+    Version            01 00 00 00                                                 4 bytes (uint32)
+    Magic              "BSTM"                                                      4 bytes
+     */
+    struct snapshot_model
+    {
+        section_model sections[2];
+    };
+
+    void encodeSnapshotModel(const snapshot_model& model, vector<uint8_t>& trailer);
+    // reads the trailer of an open snapshot whose records end at recordsEnd. false when there is none
+    bool readSnapshotModel(snapshot_model& model, int fd, uint64_t recordsEnd, const snapshot_header& header);
+}
+
+#endif
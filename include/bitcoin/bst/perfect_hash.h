@@ -0,0 +1,100 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SPINOFF_TOOLKIT_PERFECT_HASH_H
+#define SPINOFF_TOOLKIT_PERFECT_HASH_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "common.h"
+
+using namespace std;
+
+namespace bst {
+
+    static const string PERFECT_HASH_EXTENSION = ".mphf";
+    static const string SNAPSHOT_PERFECT_HASH_NAME = SNAPSHOT_NAME + PERFECT_HASH_EXTENSION;
+    // bits per key in the first level. 2 builds quickly and costs about 3.3 bits per key over all levels
+    static const double PERFECT_HASH_GAMMA = 2.0;
+    static const uint32_t PERFECT_HASH_LEVELS = 32;
+
+    /*
+    Minimal perfect hash of one section, BBHash style. Each level is a bit array sized gamma times the keys that
+    reach it; a key hashes to one bit per level and stops at the first level where no other remaining key hashed
+    to the same bit. Set bits across all levels number exactly the keys, so the rank of a key's bit is a slot of
+    its own, and indexes maps that slot to the key's entry. Keys still colliding after the last level are kept
+    whole, sorted, in the fallback records.
+
+    A hash that isn't in the section lands on some key's slot or on none, so a lookup reads at most one record
+    and compares its hash. Everything points into the mapped index file.
+     */
+    struct perfect_hash_section
+    {
+        uint64_t keys;
+        uint32_t levels;
+        // level l covers bits [level_start[l], level_start[l + 1])
+        uint64_t level_start[PERFECT_HASH_LEVELS + 1];
+        // cache lines of the set bits in all lines before, then 448 bits of the levels, so finding a key's bit and
+        // ranking it touch one line
+        const uint64_t* lines;
+        const uint32_t* indexes;
+        uint32_t fallback_count;
+        // hash then uint32 entry index, 24 bytes each
+        const uint8_t* fallback;
+
+        perfect_hash_section() : keys(0), levels(0), lines(0), indexes(0), fallback_count(0), fallback(0) {}
+
+        // sets index to the only entry that may hold hash, or returns false when none can
+        bool find(const uint8_t* hash, int64_t& index) const;
+        uint64_t bits() const { return level_start[levels]; }
+    };
+
+    /*
+    Perfect hash file. Arrays start on an 8 byte boundary, and lines on a 64 byte one, so the file is used in place
+    once mapped
+    Magic              "BSTP"                                                      4 bytes
+    Version            02 00 00 00                                                 4 bytes (uint32)
+    Blockhash          block hash of the snapshot the index was built from         32 bytes
+    nP2PKH, nP2SH      entry counts of that snapshot                               16 bytes (uint64)
+    Fingerprint        fingerprint of that snapshot file                           8 bytes (uint64)
+    then for P2PKH and P2SH in turn
+    Keys               entries in the section                                      8 bytes (uint64)
+    Levels             levels in use                                               4 bytes (uint32)
+    Fallback           keys left after the last level                              4 bytes (uint32)
+    Level bits         size of each level, a multiple of 64, unused levels 0      32 * 8 bytes (uint64)
+    Lines              rank then 7 words of level bits, 64 byte aligned            ceil(bits / 448) * 64 bytes
+    Indexes            entry index of each slot                                    (keys - fallback) * 4 bytes, padded
+    Fallback records   hash and entry index, sorted by hash                        fallback * 24 bytes
+     */
+    struct perfect_hash_index
+    {
+        snapshot_header header;
+        perfect_hash_section sections[2];
+        // the file's mapping, unmapped with the last copy
+        shared_ptr<const uint8_t> mapping;
+    };
+
+    // builds both sections on threads worker threads, zero meaning one per core. keys of a section are held in
+    // memory while it is built, 20 bytes per entry. no indexName means the snapshot's own,
+    // snapshotName + PERFECT_HASH_EXTENSION
+    bool buildPerfectHash(const string& snapshotName = SNAPSHOT_NAME, const string& indexName = string(),
+                          const double gamma = PERFECT_HASH_GAMMA, const unsigned threads = 0);
+    // maps the file. fails if it is missing, damaged or belongs to a different snapshot
+    bool readPerfectHash(perfect_hash_index& index, const snapshot_header& header,
+                         const string& indexName = SNAPSHOT_PERFECT_HASH_NAME);
+}
+
+#endif
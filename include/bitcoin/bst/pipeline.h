@@ -0,0 +1,116 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SPINOFF_TOOLKIT_PIPELINE_H
+#define SPINOFF_TOOLKIT_PIPELINE_H
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <future>
+#include <memory>
+#include "claim.h"
+#include "bitfield.h"
+#include "journal.h"
+#include "thread_pool.h"
+
+using namespace std;
+
+namespace bst {
+
+    struct pipeline_options
+    {
+        // threads per stage. zero recover threads means one per core
+        unsigned decode_threads;
+        unsigned recover_threads;
+        unsigned lookup_threads;
+        unsigned commit_threads;
+        // claims each queue between stages holds before the stage feeding it blocks
+        size_t queue_capacity;
+        // most claims a stage takes off its queue at once, and so the most one commit makes durable together
+        size_t batch_size;
+
+        pipeline_options() : decode_threads(1), recover_threads(0), lookup_threads(2), commit_threads(1),
+                             queue_capacity(1024), batch_size(256) {}
+    };
+
+    struct pipeline_claim;
+
+    /*
+    Claims of p2pkh entries, processed in stages with a set of threads each and a bounded queue in between:
+    decode     base64 signature and message hash
+    recover    the signing key's address, through the recovered key cache
+    lookup     the entry in the snapshot
+    commit     the claims claimed in submission order and written to the journal together, their bits set once
+               durable
+    Recovery is CPU bound and lookups may wait on the disk, so with both running at once neither waits for the
+    other. A claim that fails a stage completes straight away and passes through the rest untouched. Several claims
+    on one entry resolve the same way however the threads interleave: the first submitted wins.
+
+    Completion callbacks run on the pipeline's threads, in whatever order claims finish. They should be quick,
+    and must not submit to the pipeline, which could wait on a full queue the calling thread has to drain.
+     */
+    class ClaimPipeline {
+    public:
+        ClaimPipeline();
+        // finishes the claims already submitted
+        ~ClaimPipeline();
+
+        // reader and bitfield must stay open until close. journal may be null, claims then only set the bitfield
+        bool open(const snapshot_reader& reader, claim_bitfield& bitfield, ClaimJournal* journal,
+                  const pipeline_options& options = pipeline_options());
+        // blocks while the first queue is full
+        void submit(const claim_request& request, const function<void(const claim_result&)>& done);
+        future<claim_result> submit(const claim_request& request);
+        // waits for every submitted claim to complete, then stops the threads
+        void close();
+
+        // journal appends made so far, each covering a batch of claims
+        uint64_t commits() const { return commit_count; }
+
+    private:
+        ClaimPipeline(const ClaimPipeline&);
+        ClaimPipeline& operator=(const ClaimPipeline&);
+
+        typedef unique_ptr<pipeline_claim> claim_ptr;
+        typedef BoundedQueue<claim_ptr> claim_queue;
+
+        void startStage(unsigned threads, claim_queue* input, claim_queue* output,
+                        void (ClaimPipeline::*process)(vector<claim_ptr>&));
+        void decode(vector<claim_ptr>& batch);
+        void recover(vector<claim_ptr>& batch);
+        void lookup(vector<claim_ptr>& batch);
+        void commit(vector<claim_ptr>& batch);
+
+        unique_ptr<SnapshotEntryCollection> entries;
+        claim_bitfield* bitfield;
+        ClaimJournal* journal;
+        pipeline_options options;
+        // claims waiting for each stage: decode, recover, lookup, commit
+        unique_ptr<claim_queue> queues[4];
+        vector<thread> threads;
+        atomic<uint64_t> commit_count;
+        atomic<uint64_t> next_sequence;
+        unique_ptr<ThreadPool> pool;
+        // claims that reached the commit stage ahead of one submitted before them
+        mutex order_lock;
+        map<uint64_t, claim_ptr> waiting;
+        uint64_t next_commit;
+        bool opened;
+    };
+}
+
+#endif
@@ -0,0 +1,115 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SPINOFF_TOOLKIT_RECORD_H
+#define SPINOFF_TOOLKIT_RECORD_H
+
+#include <cstring>
+#include "common.h"
+
+using namespace std;
+
+namespace bst {
+
+    /*
+    Record layouts by snapshot version. Sections start at the first multiple of the alignment after the header.
+
+    Version 0 and 1, packed. Sections start right after the header, so records fall anywhere
+    Hash               20 bytes
+    Amount             8 bytes (uint64)
+
+    Version 2, aligned. Sections start at 64, so no record crosses a cache line or a page
+    Hash               20 bytes
+    Padding            4 bytes, zero
+    Amount             8 bytes (uint64)
+     */
+    template <int RecordSize, int KeySize, int AmountOffset, int Alignment>
+    struct record_codec
+    {
+        static_assert(AmountOffset >= KeySize && AmountOffset + 8 <= RecordSize, "amount overlaps the record");
+        static_assert(RecordSize % Alignment == 0, "records must keep the section alignment");
+
+        static const int RECORD_SIZE = RecordSize;
+        static const int KEY_SIZE = KeySize;
+        static const int AMOUNT_OFFSET = AmountOffset;
+        static const int DATA_OFFSET = (HEADER_SIZE + Alignment - 1) / Alignment * Alignment;
+
+        static int compare(const uint8_t* record, const uint8_t* hash) {
+            return memcmp(record, hash, KeySize);
+        }
+        static uint64_t amount(const uint8_t* record) {
+            uint64_t value;
+            memcpy(&value, record + AmountOffset, sizeof(value));
+            return value;
+        }
+        static void decode(const uint8_t* record, snapshot_entry& entry) {
+            entry.hash.assign(record, record + KeySize);
+            entry.amount = amount(record);
+        }
+        static void encode(uint8_t* record, const uint8_t* hash, uint64_t amount) {
+            memset(record, 0, RecordSize);
+            memcpy(record, hash, KeySize);
+            memcpy(record + AmountOffset, &amount, sizeof(amount));
+        }
+    };
+
+    // the first 8 bytes of a hash as a number that orders the way memcmp orders hashes
+    static inline uint64_t hashPrefix(const uint8_t* hash)
+    {
+        uint64_t value = 0;
+        for (int i = 0; i < 8; i++) value = (value << 8) | hash[i];
+        return value;
+    }
+
+    typedef record_codec<28, 20, 20, 4> packed_codec;
+    typedef record_codec<32, 20, 24, 32> aligned_codec;
+
+    static const uint32_t SNAPSHOT_VERSION = 0;
+    static const uint32_t SNAPSHOT_ALIGNED_VERSION = 2;
+    static const int MAX_RECORD_SIZE = 32;
+
+    struct snapshot_reader;
+
+    /*
+    The codec for one snapshot version, with the lookup paths instantiated over it. openSnapshot picks the format
+    once from the header, and every record offset, search and decode after that goes through it.
+     */
+    struct record_format
+    {
+        int record_size;
+        int key_size;
+        // offset of the first p2pkh record
+        uint64_t data_offset;
+
+        void (*encode)(uint8_t* record, const uint8_t* hash, uint64_t amount);
+        void (*decode)(const uint8_t* record, snapshot_entry& entry);
+        // the hash and amount of the record at index in the section starting at offset. both fail if the record
+        // can't be read
+        bool (*readEntry)(const snapshot_reader& reader, uint64_t offset, int64_t index, snapshot_entry& entry);
+        bool (*readKey)(const snapshot_reader& reader, uint64_t offset, int64_t index, uint8_t* key);
+        // index of the first of amount records whose hash isn't less than hash, or -1 if a record can't be read
+        int64_t (*lowerBound)(const snapshot_reader& reader, uint64_t offset, int64_t amount, const uint8_t* hash);
+        // walks records [first, first + count) alongside the hashes order puts in ascending order, starting at
+        // order[next]. fills in the index of every hash found, appends it to hits and returns the new next
+        size_t (*matchSorted)(const uint8_t* records, int64_t first, int64_t count, const vector<uint160_t>& hashes,
+                              const vector<size_t>& order, size_t next, vector<snapshot_entry>& entries,
+                              vector<size_t>& hits);
+    };
+
+    // null for versions this build can't read
+    const record_format* recordFormat(uint32_t version);
+}
+
+#endif
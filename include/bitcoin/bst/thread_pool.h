@@ -0,0 +1,153 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SPINOFF_TOOLKIT_THREAD_POOL_H
+#define SPINOFF_TOOLKIT_THREAD_POOL_H
+
+#include <cstdint>
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+
+using namespace std;
+
+namespace bst {
+
+    /*
+    Fixed set of worker threads that live as long as the pool, so batch calls don't pay for thread startup and any
+    per-thread state the work keeps stays warm from one call to the next.
+     */
+    class ThreadPool {
+    public:
+        // zero means one thread per core
+        explicit ThreadPool(unsigned threads = 0);
+        ~ThreadPool();
+
+        unsigned size() const { return (unsigned) workers.size(); }
+
+        void submit(const function<void()>& task);
+
+        // calls task(begin, end) over [0, count) in chunks of at least grain items, returning when all are done.
+        // The calling thread works through queued tasks while it waits, so this may be called from inside a task.
+        void parallelFor(uint64_t count, uint64_t grain, const function<void(uint64_t, uint64_t)>& task);
+
+    private:
+        ThreadPool(const ThreadPool&);
+        ThreadPool& operator=(const ThreadPool&);
+
+        void workerLoop();
+        bool runOne(unique_lock<mutex>& guard);
+
+        vector<thread> workers;
+        deque<function<void()> > tasks;
+        mutex lock;
+        condition_variable task_ready;
+        condition_variable task_done;
+        bool stopping;
+    };
+
+    /*
+    Queue between two sets of threads. Producers block while it is full, so a slow consumer holds the producers
+    back instead of letting work pile up. Consumers take whatever has queued up, up to a limit, in one go.
+     */
+    template <typename T>
+    class BoundedQueue {
+    public:
+        explicit BoundedQueue(size_t capacity_ = 1024) : capacity(max(capacity_, (size_t) 1)), closed(false) {}
+
+        // returns false, dropping the item, once the queue is closed
+        bool push(T&& item)
+        {
+            unique_lock<mutex> guard(lock);
+            not_full.wait(guard, [this] { return items.size() < capacity || closed; });
+            if (closed) return false;
+            items.push_back(move(item));
+            not_empty.notify_one();
+            return true;
+        }
+
+        // waits for at least one item, then moves up to limit items onto batch. false once closed and empty
+        bool pop(vector<T>& batch, size_t limit)
+        {
+            unique_lock<mutex> guard(lock);
+            not_empty.wait(guard, [this] { return ! items.empty() || closed; });
+            if (items.empty()) return false;
+            while (! items.empty() && batch.size() < limit) {
+                batch.push_back(move(items.front()));
+                items.pop_front();
+            }
+            not_full.notify_all();
+            return true;
+        }
+
+        // items already queued can still be popped
+        void close()
+        {
+            lock_guard<mutex> guard(lock);
+            closed = true;
+            not_full.notify_all();
+            not_empty.notify_all();
+        }
+
+    private:
+        BoundedQueue(const BoundedQueue&);
+        BoundedQueue& operator=(const BoundedQueue&);
+
+        size_t capacity;
+        deque<T> items;
+        mutex lock;
+        condition_variable not_full;
+        condition_variable not_empty;
+        bool closed;
+    };
+
+    // sorts runs on the pool, then merges neighbouring runs pairwise until one is left
+    template <typename RandomIt, typename Compare>
+    void parallelSort(ThreadPool& pool, RandomIt first, RandomIt last, Compare less)
+    {
+        uint64_t count = last - first;
+        uint64_t runs = pool.size();
+        if (runs < 2 || count < 4096) {
+            sort(first, last, less);
+            return;
+        }
+        uint64_t runSize = (count + runs - 1) / runs;
+
+        pool.parallelFor(runs, 1, [&](uint64_t begin, uint64_t end) {
+            for (uint64_t run = begin; run < end; run++) {
+                uint64_t runBegin = min(count, run * runSize);
+                sort(first + runBegin, first + min(count, runBegin + runSize), less);
+            }
+        });
+
+        for (uint64_t width = runSize; width < count; width *= 2) {
+            uint64_t merges = (count + 2 * width - 1) / (2 * width);
+            pool.parallelFor(merges, 1, [&](uint64_t begin, uint64_t end) {
+                for (uint64_t merge = begin; merge < end; merge++) {
+                    uint64_t mergeBegin = merge * 2 * width;
+                    uint64_t middle = min(count, mergeBegin + width);
+                    uint64_t mergeEnd = min(count, mergeBegin + 2 * width);
+                    inplace_merge(first + mergeBegin, first + middle, first + mergeEnd, less);
+                }
+            });
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,116 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SPINOFF_TOOLKIT_WARMUP_H
+#define SPINOFF_TOOLKIT_WARMUP_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "claim.h"
+#include "bitfield.h"
+
+using namespace std;
+
+namespace bst {
+
+    // each warming thread takes this much of a file at a time
+    static const uint64_t WARMUP_CHUNK_SIZE = 4 << 20;
+
+    enum residency_mode {
+        // faults the file mappings in place, so the pages stay in the page cache
+        RESIDENCY_PAGE_CACHE,
+        // copies the snapshot into anonymous memory on huge pages: reserved MAP_HUGETLB pages when there are
+        // enough, transparent huge pages otherwise. the claim bitfield is written back to its file, so it is
+        // always faulted in place
+        RESIDENCY_HUGE_PAGES
+    };
+
+    struct warmup_options
+    {
+        residency_mode mode;
+        // zero means one per core
+        unsigned threads;
+        // when false, faulting in goes on in the background and lookups are served from the mappings meanwhile
+        bool wait;
+        // called from the warming threads as chunks finish, with the bytes done and the total
+        function<void(uint64_t, uint64_t)> progress;
+
+        warmup_options() : mode(RESIDENCY_PAGE_CACHE), threads(0), wait(true) {}
+    };
+
+    /*
+    Brings a snapshot and its claim bitfield into memory ahead of the lookups that would otherwise fault them in
+    one page at a time, with several threads so the reads overlap on the device.
+
+    A huge page copy replaces the reader's mapping before start returns, so it always blocks and must happen
+    before anything reads through the reader. Faulting in leaves the mappings as they are and is safe to run
+    alongside lookups. The bitfield has to stay mapped until warming finishes or is cancelled.
+     */
+    class SnapshotWarmer {
+    public:
+        SnapshotWarmer();
+        // cancels warming still going on in the background
+        ~SnapshotWarmer();
+
+        // maps the snapshot when it isn't yet. bitfield may be null. fails, leaving the reader's mapping as it was,
+        // if a huge page copy is cancelled before it completes
+        bool start(snapshot_reader& reader, claim_bitfield* bitfield, const warmup_options& options);
+        void wait();
+        // stops at the next chunk boundary and waits for the threads
+        void cancel();
+
+        bool finished() const { return running == 0; }
+        uint64_t bytesDone() const { return done; }
+        uint64_t bytesTotal() const { return total; }
+        // whether the snapshot was copied onto huge pages, reserved or transparent
+        bool hugePages() const { return huge; }
+
+    private:
+        SnapshotWarmer(const SnapshotWarmer&);
+        SnapshotWarmer& operator=(const SnapshotWarmer&);
+
+        struct region
+        {
+            uint8_t* data;
+            uint64_t size;
+            // copied from here when set, otherwise faulted in
+            const uint8_t* source;
+        };
+
+        void launch(const vector<region>& regions);
+        void work();
+
+        warmup_options options;
+        // keeps the snapshot mapping alive while threads touch it
+        shared_ptr<snapshot_file> file;
+        vector<region> regions;
+        vector<pair<size_t, uint64_t> > chunks;
+        atomic<uint64_t> next_chunk;
+        atomic<uint64_t> done;
+        atomic<uint64_t> total;
+        atomic<unsigned> running;
+        atomic<bool> cancelled;
+        bool huge;
+        // start and a cancel from another thread may both wait for the threads
+        mutex threads_lock;
+        vector<thread> threads;
+    };
+}
+
+#endif
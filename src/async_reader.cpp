@@ -0,0 +1,445 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "bitcoin/bst/common.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+#include "bitcoin/bst/async_reader.h"
+#include "bitcoin/bst/bitfield.h"
+
+using namespace std;
+
+namespace bst {
+
+    /*
+    One lower_bound search. [low, low + count) is what's left of the range, and [first, first + records) the
+    window of records held in buffer from the last read.
+     */
+    struct async_search
+    {
+        size_t hash;
+        int64_t low;
+        int64_t count;
+        int64_t first;
+        int64_t records;
+        vector<uint8_t> buffer;
+        struct iovec iov;
+        // what the pending read should return
+        size_t expected;
+    };
+
+#ifdef __NR_io_uring_setup
+
+    // the rings shared with the kernel, mapped the way io_uring_setup(2) describes
+    struct async_ring
+    {
+        int fd;
+        void* sq_map;
+        size_t sq_map_size;
+        void* cq_map;
+        size_t cq_map_size;
+        io_uring_sqe* sqes;
+        size_t sqes_size;
+
+        unsigned* sq_head;
+        unsigned* sq_tail;
+        unsigned sq_mask;
+        unsigned* sq_array;
+        unsigned sq_entries;
+        unsigned* cq_head;
+        unsigned* cq_tail;
+        unsigned cq_mask;
+        io_uring_cqe* cqes;
+
+        // queued but not yet passed to io_uring_enter
+        unsigned unsubmitted;
+
+        async_ring() : fd(-1), sq_map(MAP_FAILED), sq_map_size(0), cq_map(MAP_FAILED), cq_map_size(0),
+                       sqes(static_cast<io_uring_sqe*>(MAP_FAILED)), sqes_size(0), unsubmitted(0) {}
+        ~async_ring() {
+            if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+            if (cq_map != MAP_FAILED && cq_map != sq_map) munmap(cq_map, cq_map_size);
+            if (sq_map != MAP_FAILED) munmap(sq_map, sq_map_size);
+            if (fd >= 0) close(fd);
+        }
+
+        bool setup(unsigned entries);
+        // false when the submission queue is full
+        bool queue(uint8_t opcode, int file, const struct iovec* iov, uint64_t offset, uint64_t user_data);
+        // submits everything queued and waits for at least wait completions
+        bool enter(unsigned wait);
+        // calls handle(user_data, result) for every completion so far
+        template <typename Handle>
+        void reap(Handle handle);
+    };
+
+    bool async_ring::setup(unsigned entries)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0) return false;
+
+        sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single) sq_map_size = cq_map_size = max(sq_map_size, cq_map_size);
+
+        sq_map = mmap(0, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_map == MAP_FAILED) return false;
+        cq_map = single ? sq_map : mmap(0, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                        IORING_OFF_CQ_RING);
+        if (cq_map == MAP_FAILED) return false;
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        void* mapped = mmap(0, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (mapped == MAP_FAILED) return false;
+        sqes = static_cast<io_uring_sqe*>(mapped);
+
+        uint8_t* sq = static_cast<uint8_t*>(sq_map);
+        sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sq_entries = params.sq_entries;
+        uint8_t* cq = static_cast<uint8_t*>(cq_map);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    bool async_ring::queue(uint8_t opcode, int file, const struct iovec* iov, uint64_t offset, uint64_t user_data)
+    {
+        unsigned tail = *sq_tail;
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) return false;
+        unsigned slot = tail & sq_mask;
+        io_uring_sqe& sqe = sqes[slot];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = opcode;
+        sqe.fd = file;
+        sqe.off = offset;
+        sqe.addr = reinterpret_cast<uint64_t>(iov);
+        sqe.len = iov ? 1 : 0;
+        sqe.user_data = user_data;
+        sq_array[slot] = slot;
+        // the kernel must see the entry before the tail that publishes it
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        unsubmitted++;
+        return true;
+    }
+
+    bool async_ring::enter(unsigned wait)
+    {
+        while (true) {
+            int result = (int) syscall(__NR_io_uring_enter, fd, unsubmitted, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0,
+                                       0, 0);
+            if (result >= 0) {
+                unsubmitted -= min(unsubmitted, (unsigned) result);
+                if (unsubmitted == 0) return true;
+                // the rest is still queued, go again without waiting
+                wait = 0;
+                continue;
+            }
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) return false;
+            // EAGAIN and EBUSY mean completions have to be reaped first, which only the caller can do
+            if (errno != EINTR) return true;
+        }
+    }
+
+    template <typename Handle>
+    void async_ring::reap(Handle handle)
+    {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            const io_uring_cqe& cqe = cqes[head & cq_mask];
+            handle(cqe.user_data, cqe.res);
+            head++;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    // a ring that can't even complete a no-op is no use, seccomp filters sometimes allow setup but not enter
+    static unique_ptr<async_ring> openRing(unsigned entries)
+    {
+        unique_ptr<async_ring> ring(new async_ring());
+        if (! ring->setup(entries)) return unique_ptr<async_ring>();
+        if (! ring->queue(IORING_OP_NOP, -1, 0, 0, 0) || ! ring->enter(1)) return unique_ptr<async_ring>();
+        int result = -1;
+        ring->reap([&](uint64_t, int res) { result = res; });
+        if (result != 0) return unique_ptr<async_ring>();
+        return ring;
+    }
+
+#else
+
+    struct async_ring
+    {
+    };
+
+    static unique_ptr<async_ring> openRing(unsigned entries)
+    {
+        return unique_ptr<async_ring>();
+    }
+
+#endif
+
+    AsyncSnapshotReader::AsyncSnapshotReader(unsigned queue_depth_, bool use_uring)
+            : queue_depth(max(1u, queue_depth_)), read_count(0)
+    {
+        if (use_uring) ring = openRing(queue_depth);
+        searches.resize(queue_depth);
+    }
+
+    AsyncSnapshotReader::~AsyncSnapshotReader()
+    {
+    }
+
+    /*
+    Moves a search on as far as the records it holds allow. True when it needs another read, which is then set up
+    in iov and offset; false when the search is over and low is the lower bound.
+     */
+    static bool advance(const SnapshotEntryCollection& collection, const uint8_t* hash, async_search& search,
+                        uint64_t& offset)
+    {
+        const record_format& format = *collection.reader.format;
+        int64_t target;
+        while (true) {
+            if (search.count == 0) {
+                target = search.low;
+                // the lower bound needs its record to tell a hit from the next hash up
+                if (target == collection.amount || (target >= search.first && target < search.first + search.records)) {
+                    return false;
+                }
+                break;
+            }
+            int64_t step = search.count / 2;
+            target = search.low + step;
+            if (target < search.first || target >= search.first + search.records) break;
+            const uint8_t* record = &search.buffer[(target - search.first) * format.record_size];
+            if (memcmp(record, hash, format.key_size) < 0) {
+                search.low = target + 1;
+                search.count -= step + 1;
+            } else {
+                search.count = step;
+            }
+        }
+
+        // the window is centred on the probe, and only covers records still in the range
+        int64_t window = max((int64_t) 1, (int64_t) ASYNC_WINDOW_SIZE / format.record_size);
+        int64_t rangeEnd = max(search.low + search.count, target + 1);
+        search.first = max(search.low, target - window / 2);
+        search.records = min(rangeEnd, search.first + window) - search.first;
+        search.expected = search.records * format.record_size;
+        if (search.buffer.size() < search.expected) search.buffer.resize(window * format.record_size);
+        search.iov.iov_base = &search.buffer[0];
+        search.iov.iov_len = search.expected;
+        offset = collection.offset + search.first * format.record_size;
+        return true;
+    }
+
+    static void start(const SnapshotEntryCollection& collection, size_t hash, async_search& search)
+    {
+        search.hash = hash;
+        search.low = 0;
+        search.count = collection.amount;
+        search.first = 0;
+        search.records = 0;
+    }
+
+    static bool readWindow(int fd, async_search& search, uint64_t offset)
+    {
+        size_t done = 0;
+        while (done < search.expected) {
+            ssize_t bytes = pread(fd, &search.buffer[done], search.expected - done, offset + done);
+            if (bytes <= 0) return false;
+            done += bytes;
+        }
+        return true;
+    }
+
+    // records the hit, if the lower bound is the hash itself
+    static void finish(const SnapshotEntryCollection& collection, const vector<uint160_t>& hashes,
+                       const async_search& search, vector<snapshot_entry>& entries, vector<bool>& found)
+    {
+        if (search.low == collection.amount) return;
+        const record_format& format = *collection.reader.format;
+        const uint8_t* record = &search.buffer[(search.low - search.first) * format.record_size];
+        if (memcmp(record, &hashes[search.hash][0], format.key_size) != 0) return;
+        snapshot_entry& entry = entries[search.hash];
+        format.decode(record, entry);
+        entry.index = search.low;
+        found[search.hash] = true;
+    }
+
+    bool AsyncSnapshotReader::getEntries(const SnapshotEntryCollection& collection, const vector<uint160_t>& hashes,
+                                         vector<snapshot_entry>& entries, vector<bool>& found)
+    {
+        entries.assign(hashes.size(), snapshot_entry());
+        found.assign(hashes.size(), false);
+        read_count = 0;
+        const snapshot_reader& reader = collection.reader;
+        if (! reader.file || reader.file->fd < 0) return false;
+
+        bool ok = true;
+        if (ring) {
+            ok = getEntriesUring(collection, hashes, entries, found);
+            if (! ok) ring.reset();
+        } else {
+            async_search& search = searches[0];
+            for (size_t i = 0; i < hashes.size(); i++) {
+                if (hashes[i].size() != (size_t) reader.format->key_size) continue;
+                if (collection.filter && ! collection.filter->mayContain(&hashes[i][0])) continue;
+                start(collection, i, search);
+                uint64_t offset;
+                bool readable = true;
+                while (readable && advance(collection, &hashes[i][0], search, offset)) {
+                    readable = readWindow(reader.file->fd, search, offset);
+                    read_count++;
+                }
+                if (readable) {
+                    finish(collection, hashes, search, entries, found);
+                } else {
+                    ok = false;
+                }
+            }
+        }
+
+        // claim bits are a small file next to the snapshot and likely cached, so plain reads do
+        int claimedFd = reader.claims ? -1 : open(SNAPSHOT_CLAIMED_NAME.c_str(), O_RDONLY);
+        for (size_t i = 0; i < hashes.size(); i++) {
+            if (! found[i]) continue;
+            uint64_t bit = entries[i].index + collection.claimed_offset;
+            if (reader.claims) {
+                entries[i].claimed = isClaimed(*reader.claims, bit);
+                continue;
+            }
+            // past the end of a short claim file reads as claimed, as it does in the bitfield
+            uint8_t byte = 0xff;
+            ssize_t bytes;
+            do {
+                bytes = claimedFd >= 0 ? pread(claimedFd, &byte, 1, bit / 8) : -1;
+            } while (bytes < 0 && errno == EINTR);
+            if (bytes < 0) ok = false;
+            entries[i].claimed = (byte & (1 << (bit % 8))) != 0;
+        }
+        if (claimedFd >= 0) close(claimedFd);
+        return ok;
+    }
+
+#ifdef __NR_io_uring_setup
+
+    bool AsyncSnapshotReader::getEntriesUring(const SnapshotEntryCollection& collection, const vector<uint160_t>& hashes,
+                                              vector<snapshot_entry>& entries, vector<bool>& found)
+    {
+        const snapshot_reader& reader = collection.reader;
+        int fd = reader.file->fd;
+        size_t next = 0;
+        unsigned inFlight = 0;
+        vector<unsigned> idle;
+        for (unsigned s = 0; s < queue_depth; s++) idle.push_back(s);
+        // searches whose read didn't fit the submission queue yet
+        vector<pair<unsigned, uint64_t> > waiting;
+
+        auto submit = [&](unsigned s, uint64_t offset) {
+            if (ring->queue(IORING_OP_READV, fd, &searches[s].iov, offset, s)) {
+                inFlight++;
+                read_count++;
+            } else {
+                waiting.push_back(make_pair(s, offset));
+            }
+        };
+
+        while (true) {
+            // idle searches take the next hashes. ones that need no read at all finish straight away
+            while (! idle.empty() && next < hashes.size()) {
+                size_t i = next++;
+                if (hashes[i].size() != (size_t) reader.format->key_size) continue;
+                if (collection.filter && ! collection.filter->mayContain(&hashes[i][0])) continue;
+                unsigned s = idle.back();
+                start(collection, i, searches[s]);
+                uint64_t offset;
+                if (advance(collection, &hashes[i][0], searches[s], offset)) {
+                    idle.pop_back();
+                    submit(s, offset);
+                } else {
+                    finish(collection, hashes, searches[s], entries, found);
+                }
+            }
+            if (inFlight == 0 && waiting.empty()) return true;
+
+            if (! ring->enter(inFlight > 0 ? 1 : 0)) return false;
+            bool failed = false;
+            ring->reap([&](uint64_t s, int result) {
+                inFlight--;
+                async_search& search = searches[s];
+                // short or failed reads are redone synchronously rather than dropped
+                if (result != (int) search.expected) {
+                    uint64_t offset = collection.offset + search.first * reader.format->record_size;
+                    if (! readWindow(fd, search, offset)) {
+                        failed = true;
+                        idle.push_back(s);
+                        return;
+                    }
+                }
+                uint64_t offset;
+                if (advance(collection, &hashes[search.hash][0], search, offset)) {
+                    submit(s, offset);
+                } else {
+                    finish(collection, hashes, search, entries, found);
+                    idle.push_back(s);
+                }
+            });
+            if (failed) {
+                // wait out the reads still in flight, their buffers belong to searches that are about to be reused
+                while (inFlight > 0 && ring->enter(1)) {
+                    ring->reap([&](uint64_t, int) { inFlight--; });
+                }
+                return false;
+            }
+
+            vector<pair<unsigned, uint64_t> > retry;
+            retry.swap(waiting);
+            for (auto& w : retry) {
+                if (ring->queue(IORING_OP_READV, fd, &searches[w.first].iov, w.second, w.first)) {
+                    inFlight++;
+                    read_count++;
+                } else {
+                    waiting.push_back(w);
+                }
+            }
+        }
+    }
+
+#else
+
+    bool AsyncSnapshotReader::getEntriesUring(const SnapshotEntryCollection& collection, const vector<uint160_t>& hashes,
+                                              vector<snapshot_entry>& entries, vector<bool>& found)
+    {
+        return false;
+    }
+
+#endif
+}
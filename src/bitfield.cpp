@@ -0,0 +1,112 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bitcoin/bst/bitfield.h"
+
+using namespace std;
+
+namespace bst {
+
+    bool openClaimBitfield(claim_bitfield& bitfield, const string& name)
+    {
+        bitfield.fd = open(name.c_str(), O_RDWR);
+        if (bitfield.fd < 0) {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(bitfield.fd, &st) != 0) {
+            close(bitfield.fd);
+            bitfield.fd = -1;
+            return false;
+        }
+        bitfield.size = st.st_size;
+        bitfield.data = 0;
+
+        // an empty snapshot has nothing to map
+        if (bitfield.size == 0) {
+            return true;
+        }
+
+        void* mapped = mmap(0, bitfield.size, PROT_READ | PROT_WRITE, MAP_SHARED, bitfield.fd, 0);
+        if (mapped == MAP_FAILED) {
+            close(bitfield.fd);
+            bitfield.fd = -1;
+            return false;
+        }
+        bitfield.data = static_cast<uint8_t*>(mapped);
+        return true;
+    }
+
+    void closeClaimBitfield(claim_bitfield& bitfield)
+    {
+        if (bitfield.data) {
+            munmap(bitfield.data, bitfield.size);
+            bitfield.data = 0;
+        }
+        if (bitfield.fd >= 0) {
+            close(bitfield.fd);
+            bitfield.fd = -1;
+        }
+        bitfield.size = 0;
+    }
+
+    bool syncClaimBitfield(claim_bitfield& bitfield)
+    {
+        if (! bitfield.data) return true;
+        return msync(bitfield.data, bitfield.size, MS_SYNC) == 0;
+    }
+
+    /*
+    The file stores bit n in byte n / 8, at position n % 8. Mappings are page aligned, so the 64 bit word
+    holding that byte is always aligned and always inside a mapped page, even when the file length is not
+    a multiple of 8. The mask is built from the byte's position in the word so this holds on either endianness.
+     */
+    static inline uint64_t* wordFor(const claim_bitfield& bitfield, uint64_t bit)
+    {
+        return reinterpret_cast<uint64_t*>(bitfield.data) + (bit / 64);
+    }
+
+    static inline uint64_t maskFor(uint64_t bit)
+    {
+        uint64_t byteInWord = (bit / 8) % 8;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        byteInWord = 7 - byteInWord;
+#endif
+        return ((uint64_t) 1 << (bit % 8)) << (byteInWord * 8);
+    }
+
+    // a bit past the end of the file comes from a different snapshot. it reads as claimed and is never written,
+    // so such an entry can't be paid out
+    bool isClaimed(const claim_bitfield& bitfield, uint64_t bit)
+    {
+        if (bit >= bitfield.size * 8) return true;
+        uint64_t word = __atomic_load_n(wordFor(bitfield, bit), __ATOMIC_ACQUIRE);
+        return (word & maskFor(bit)) != 0;
+    }
+
+    bool testAndSetClaimed(claim_bitfield& bitfield, uint64_t bit)
+    {
+        if (bit >= bitfield.size * 8) return true;
+        uint64_t mask = maskFor(bit);
+        uint64_t previous = __atomic_fetch_or(wordFor(bitfield, bit), mask, __ATOMIC_ACQ_REL);
+        return (previous & mask) != 0;
+    }
+}
@@ -14,22 +14,349 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <tuple>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <bitcoin/bitcoin.hpp>
 #include "bitcoin/bst/claim.h"
 #include "bitcoin/bst/misc.h"
 #include "bitcoin/bst/common.h"
+#include "bitcoin/bst/thread_pool.h"
+#include "bitcoin/bst/key_cache.h"
+#include "bitcoin/bst/export.h"
+#include "bitcoin/bst/journal.h"
 
 using namespace std;
 
 namespace bst {
 
-    bool openSnapshot(ifstream& stream, snapshot_reader& reader)
+    snapshot_file::~snapshot_file()
     {
+        if (data) munmap(const_cast<uint8_t*>(data), mapping_size);
+        if (fd >= 0) close(fd);
+    }
+
+    bool mapSnapshot(snapshot_reader& reader)
+    {
+        if (! reader.file || reader.file->fd < 0) return false;
+        if (reader.file->data) return true;
+
+        struct stat st;
+        if (fstat(reader.file->fd, &st) != 0 || st.st_size < HEADER_SIZE) return false;
+        void* mapped = mmap(0, st.st_size, PROT_READ, MAP_SHARED, reader.file->fd, 0);
+        if (mapped == MAP_FAILED) return false;
+        reader.file->data = static_cast<const uint8_t*>(mapped);
+        reader.file->size = st.st_size;
+        reader.file->mapping_size = st.st_size;
+        return true;
+    }
+
+    // fails on an error or at the end of the file, leaving whatever was already read in place
+    static bool readFully(int fd, uint8_t* destination, size_t length, uint64_t offset)
+    {
+        while (length > 0) {
+            ssize_t bytes = pread(fd, destination, length, offset);
+            if (bytes < 0 && errno == EINTR) continue;
+            if (bytes <= 0) return false;
+            destination += bytes;
+            length -= bytes;
+            offset += bytes;
+        }
+        return true;
+    }
+
+    // reads from the mapping when there is one, otherwise with pread, so threads sharing the reader don't share a
+    // file position
+    static inline bool readSnapshot(const snapshot_reader& reader, uint64_t offset, void* destination, size_t length)
+    {
+        if (reader.file->data) {
+            memcpy(destination, reader.file->data + offset, length);
+            return true;
+        }
+        return readFully(reader.file->fd, static_cast<uint8_t*>(destination), length, offset);
+    }
+
+    template <typename Codec>
+    static bool readRecordEntry(const snapshot_reader& reader, uint64_t offset, int64_t index, snapshot_entry& entry)
+    {
+        uint8_t record[Codec::RECORD_SIZE];
+        if (! readSnapshot(reader, offset + index * Codec::RECORD_SIZE, record, Codec::RECORD_SIZE)) return false;
+        Codec::decode(record, entry);
+        return true;
+    }
+
+    template <typename Codec>
+    static bool readRecordKey(const snapshot_reader& reader, uint64_t offset, int64_t index, uint8_t* key)
+    {
+        return readSnapshot(reader, offset + index * Codec::RECORD_SIZE, key, Codec::KEY_SIZE);
+    }
+
+    template <typename Codec>
+    static int64_t lowerBoundRecord(const snapshot_reader& reader, uint64_t offset, int64_t amount, const uint8_t* hash)
+    {
+        int64_t low = 0;
+        int64_t count = amount;
+        if (reader.file && reader.file->data) {
+            // compare in place, nothing to copy
+            const uint8_t* records = reader.file->data + offset;
+            while (count > 0) {
+                int64_t step = count / 2;
+                if (Codec::compare(records + (low + step) * Codec::RECORD_SIZE, hash) < 0) {
+                    low += step + 1;
+                    count -= step + 1;
+                } else {
+                    count = step;
+                }
+            }
+            return low;
+        }
+        uint8_t key[Codec::KEY_SIZE];
+        while (count > 0) {
+            int64_t step = count / 2;
+            if (! readSnapshot(reader, offset + (low + step) * Codec::RECORD_SIZE, key, Codec::KEY_SIZE)) return -1;
+            if (Codec::compare(key, hash) < 0) {
+                low += step + 1;
+                count -= step + 1;
+            } else {
+                count = step;
+            }
+        }
+        return low;
+    }
+
+    template <typename Codec>
+    static size_t matchSortedRecords(const uint8_t* records, int64_t first, int64_t count, const vector<uint160_t>& hashes,
+                                     const vector<size_t>& order, size_t next, vector<snapshot_entry>& entries,
+                                     vector<size_t>& hits)
+    {
+        int64_t record = 0;
+        while (record < count && next < order.size()) {
+            size_t i = order[next];
+            int comparison = Codec::compare(records + record * Codec::RECORD_SIZE, &hashes[i][0]);
+            if (comparison > 0) {
+                next++;
+            } else if (comparison == 0) {
+                entries[i].index = first + record;
+                hits.push_back(i);
+                // don't move on yet, the same hash may have been asked for twice
+                next++;
+            } else {
+                record++;
+            }
+        }
+        return next;
+    }
+
+    static const record_format PACKED_FORMAT = {
+            packed_codec::RECORD_SIZE, packed_codec::KEY_SIZE, packed_codec::DATA_OFFSET,
+            &packed_codec::encode, &packed_codec::decode, &readRecordEntry<packed_codec>,
+            &readRecordKey<packed_codec>, &lowerBoundRecord<packed_codec>, &matchSortedRecords<packed_codec>
+    };
+    static const record_format ALIGNED_FORMAT = {
+            aligned_codec::RECORD_SIZE, aligned_codec::KEY_SIZE, aligned_codec::DATA_OFFSET,
+            &aligned_codec::encode, &aligned_codec::decode, &readRecordEntry<aligned_codec>,
+            &readRecordKey<aligned_codec>, &lowerBoundRecord<aligned_codec>, &matchSortedRecords<aligned_codec>
+    };
+
+    const record_format* recordFormat(uint32_t version)
+    {
+        switch (version) {
+            case 0:
+            case 1:
+                return &PACKED_FORMAT;
+            case SNAPSHOT_ALIGNED_VERSION:
+                return &ALIGNED_FORMAT;
+            default:
+                return 0;
+        }
+    }
+
+    struct scan_buffer
+    {
+        SnapshotEntryCollection collection;
+        int64_t end;
+        int64_t chunk_entries;
+        int64_t chunk_begin;
+        int64_t chunk_end;
+        vector<uint8_t> records;
+        // claim bits for the chunk, starting at the byte holding chunk_begin's bit
+        vector<uint8_t> claims;
+        int claimed_fd;
+        snapshot_entry entry;
+        // a chunk of records could not be read and was zero filled, or its claim bits could not be read
+        bool failed;
+
+        scan_buffer(const SnapshotEntryCollection& collection_, int64_t end_, int64_t chunk_entries_)
+                : collection(collection_), end(end_), chunk_entries(chunk_entries_), chunk_begin(0), chunk_end(0),
+                  claimed_fd(-1), failed(false) {}
+        ~scan_buffer() { if (claimed_fd >= 0) close(claimed_fd); }
+
+        void fill(int64_t index);
+    };
+
+    void scan_buffer::fill(int64_t index)
+    {
+        const snapshot_reader& reader = collection.reader;
+        chunk_begin = index;
+        chunk_end = min(end, index + chunk_entries);
+        uint64_t count = chunk_end - chunk_begin;
+
+        records.resize(count * reader.format->record_size);
+        uint64_t recordOffset = collection.offset + chunk_begin * reader.format->record_size;
+        if (! readSnapshot(reader, recordOffset, &records[0], records.size())) {
+            memset(&records[0], 0, records.size());
+            failed = true;
+        }
+
+        if (reader.claims) return;
+        uint64_t firstBit = chunk_begin + collection.claimed_offset;
+        uint64_t lastBit = chunk_end - 1 + collection.claimed_offset;
+        // past the end of a short claim file reads as claimed, as it does in the bitfield
+        claims.assign(lastBit / 8 - firstBit / 8 + 1, 0xff);
+        if (claimed_fd < 0) {
+            failed = true;
+            return;
+        }
+        uint8_t* destination = &claims[0];
+        size_t length = claims.size();
+        uint64_t offset = firstBit / 8;
+        while (length > 0) {
+            ssize_t bytes = pread(claimed_fd, destination, length, offset);
+            if (bytes < 0 && errno == EINTR) continue;
+            if (bytes < 0) failed = true;
+            if (bytes <= 0) break;
+            destination += bytes;
+            length -= bytes;
+            offset += bytes;
+        }
+    }
+
+    SnapshotEntryCollection::scan_iterator::scan_iterator(const SnapshotEntryCollection* collection, int64_t index_,
+                                                          int64_t end, int64_t chunk_entries) : index(index_)
+    {
+        if (! collection || index >= end) return;
+        buffer = make_shared<scan_buffer>(*collection, end, chunk_entries > 0 ? chunk_entries : SCAN_BUFFER_ENTRIES);
+
+        const snapshot_reader& reader = collection->reader;
+        // a mapped snapshot is copied from memory, the hint is for preads
+        if (reader.file && reader.file->fd >= 0 && ! reader.file->data) {
+            int size = reader.format->record_size;
+            posix_fadvise(reader.file->fd, collection->offset + index * size, (end - index) * size, POSIX_FADV_SEQUENTIAL);
+        }
+        if (! reader.claims) {
+            buffer->claimed_fd = open(SNAPSHOT_CLAIMED_NAME.c_str(), O_RDONLY);
+            if (buffer->claimed_fd >= 0) {
+                uint64_t firstBit = index + collection->claimed_offset;
+                posix_fadvise(buffer->claimed_fd, firstBit / 8, (end - index) / 8 + 1, POSIX_FADV_SEQUENTIAL);
+            }
+        }
+    }
+
+    bool SnapshotEntryCollection::scan_iterator::failed() const
+    {
+        return buffer && buffer->failed;
+    }
+
+    SnapshotEntryCollection::scan_iterator::reference SnapshotEntryCollection::scan_iterator::operator*() const
+    {
+        scan_buffer& b = *buffer;
+        if (index < b.chunk_begin || index >= b.chunk_end) b.fill(index);
+
+        const record_format& format = *b.collection.reader.format;
+        format.decode(&b.records[(index - b.chunk_begin) * format.record_size], b.entry);
+        b.entry.index = index;
+        uint64_t bit = index + b.collection.claimed_offset;
+        if (b.collection.reader.claims) {
+            b.entry.claimed = isClaimed(*b.collection.reader.claims, bit);
+        } else {
+            uint64_t firstByte = (b.chunk_begin + b.collection.claimed_offset) / 8;
+            b.entry.claimed = (b.claims[bit / 8 - firstByte] & (1 << (bit % 8))) != 0;
+        }
+        return b.entry;
+    }
+
+    // fnv-1a over the file size, modification time and a sample of records spread over the file, so a filter or
+    // index built for another snapshot is not taken for this one even when the header fields agree
+    static bool snapshotFingerprint(int fd, const record_format& format, uint64_t records, uint64_t& fingerprint)
+    {
+        const uint64_t SAMPLES = 1024;
+        struct stat st;
+        if (fstat(fd, &st) != 0) return false;
+        uint64_t hash = 14695981039346656037ULL;
+        auto mix = [&hash](const uint8_t* data, size_t length) {
+            for (size_t i = 0; i < length; i++) {
+                hash ^= data[i];
+                hash *= 1099511628211ULL;
+            }
+        };
+        uint64_t stamp[3] = { (uint64_t) st.st_size, (uint64_t) st.st_mtim.tv_sec, (uint64_t) st.st_mtim.tv_nsec };
+        mix(reinterpret_cast<const uint8_t*>(stamp), sizeof(stamp));
+
+        uint64_t count = min(records, SAMPLES);
+        vector<uint8_t> record(format.record_size);
+        for (uint64_t i = 0; i < count; i++) {
+            uint64_t index = count < records ? i * (records - 1) / (count - 1) : i;
+            off_t offset = format.data_offset + index * format.record_size;
+            if (pread(fd, &record[0], record.size(), offset) != (ssize_t) record.size()) return false;
+            mix(&record[0], record.size());
+        }
+        fingerprint = hash;
+        return true;
+    }
+
+    bool openSnapshot(ifstream& stream, snapshot_reader& reader, const string& name)
+    {
+        if (! stream.is_open()) {
+            stream.open(name, ios::binary);
+            if (! stream.is_open()) return false;
+        }
+        reader.file = make_shared<snapshot_file>();
+        reader.file->fd = open(name.c_str(), O_RDONLY);
+        if (reader.file->fd < 0) return false;
         reader.snapshot = &stream;
         stream.read(reinterpret_cast<char*>(&reader.header.version), sizeof(reader.header.version));
         stream.read(reinterpret_cast<char*>(&reader.header.block_hash[0]), 32);
         stream.read(reinterpret_cast<char*>(&reader.header.nP2PKH), sizeof(reader.header.nP2PKH));
         stream.read(reinterpret_cast<char*>(&reader.header.nP2SH), sizeof(reader.header.nP2SH));
+        if (! stream.good()) return false;
+        const record_format* format = recordFormat(reader.header.version);
+        if (! format) return false;
+        reader.format = format;
+        if (! snapshotFingerprint(reader.file->fd, *format, reader.header.nP2PKH + reader.header.nP2SH,
+                                  reader.header.fingerprint)) {
+            return false;
+        }
+
+        shared_ptr<snapshot_filter> filter = make_shared<snapshot_filter>();
+        if (readSnapshotFilter(*filter, reader.header, name + FILTER_EXTENSION)) {
+            reader.filter = filter;
+        } else {
+            reader.filter.reset();
+        }
+        shared_ptr<eytzinger_index> index = make_shared<eytzinger_index>();
+        if (readSnapshotIndex(*index, reader.header, name + INDEX_EXTENSION)) {
+            reader.search_index = index;
+        } else {
+            reader.search_index.reset();
+        }
+        uint64_t recordsEnd = format->data_offset + (reader.header.nP2PKH + reader.header.nP2SH) * format->record_size;
+        shared_ptr<snapshot_model> model = make_shared<snapshot_model>();
+        if (readSnapshotModel(*model, reader.file->fd, recordsEnd, reader.header)) {
+            reader.model = model;
+        } else {
+            reader.model.reset();
+        }
+        shared_ptr<perfect_hash_index> perfectHash = make_shared<perfect_hash_index>();
+        if (readPerfectHash(*perfectHash, reader.header, name + PERFECT_HASH_EXTENSION)) {
+            reader.perfect_hash = perfectHash;
+        } else {
+            reader.perfect_hash.reset();
+        }
         return true;
     }
 
@@ -39,25 +366,9 @@ namespace bst {
         snapshot_reader reader;
         openSnapshot(stream, reader);
 
-        cout << "p2pkh:" << endl;
-        SnapshotEntryCollection p2pkhEntries = getP2PKHCollection(reader);
-        for (SnapshotEntryCollection::const_iterator i = p2pkhEntries.begin(); i != p2pkhEntries.end(); i++) {
-            snapshot_entry entry = *i;
-            bc::short_hash sh;
-            copy(entry.hash.begin(), entry.hash.end(), sh.begin());
-            bc::payment_address address(111, sh);
-            cout << address.encoded() << " " << entry.amount << endl;
-        }
-
-        cout << "p2sh:" << endl;
-        SnapshotEntryCollection p2shEntries = getP2SHCollection(reader);
-        for (SnapshotEntryCollection::const_iterator i = p2shEntries.begin(); i != p2shEntries.end(); i++) {
-            snapshot_entry entry = *i;
-            bc::short_hash sh;
-            copy(entry.hash.begin(), entry.hash.end(), sh.begin());
-            bc::payment_address address(196, sh);
-            cout << address.encoded() << " " << entry.amount << endl;
-        }
+        // the export writes straight to the descriptor, so nothing buffered in cout may come after it
+        cout.flush();
+        exportSnapshot(reader, STDOUT_FILENO);
 
         reader.snapshot->close();
     }
@@ -86,32 +397,6 @@ namespace bst {
         return 0;
     }
 
-    int64_t getIndex(snapshot_reader &reader, const vector<uint8_t>& address, int64_t high, uint64_t base_offset)
-    {
-        int64_t low = 0;
-        while (low <= high) {
-            int64_t mid = (low + high) / 2;
-            uint64_t offset = base_offset + mid * 28;
-            reader.snapshot->seekg(offset);
-
-            vector<uint8_t> hashVec(20);
-            reader.snapshot->read(reinterpret_cast<char *>(&hashVec[0]), 20);
-
-            int comparison = compare(address, hashVec);
-            if (comparison == 0) {
-                return mid;
-            }
-            if (comparison < 0) {
-                high = mid - 1;
-            } else {
-                low = mid + 1;
-            }
-        }
-
-        // not found
-        return -1;
-    }
-
     bool getClaimed(int64_t index, uint64_t offset)
     {
         uint64_t claimIndex = index + offset;
@@ -139,28 +424,98 @@ namespace bst {
         claimedFile.close();
     }
 
-    void SnapshotEntryCollection::getEntry(int64_t index, snapshot_entry& entry) const {
+    bool SnapshotEntryCollection::getEntry(int64_t index, snapshot_entry& entry) const {
         entry.index = index;
-        reader.snapshot->seekg(offset + index * 28);
-        reader.snapshot->read(reinterpret_cast<char*>(&entry.hash[0]), 20);
-        reader.snapshot->read(reinterpret_cast<char*>(&entry.amount), sizeof(amount));
-        entry.claimed = getClaimed(index, claimed_offset);
+        if (! reader.format->readEntry(reader, offset, index, entry)) return false;
+        if (reader.claims) {
+            entry.claimed = isClaimed(*reader.claims, index + claimed_offset);
+        } else {
+            entry.claimed = getClaimed(index, claimed_offset);
+        }
+        return true;
     }
 
     bool SnapshotEntryCollection::getEntry(const uint256_t& hash, snapshot_entry& entry) {
-        int64_t index = getIndex(reader, hash, amount, offset);
+        if (hash.size() != (size_t) reader.format->key_size) return false;
+        if (filter && ! filter->mayContain(&hash[0])) return false;
+
+        // the perfect hash names the one entry the hash can be, so a single record read settles it
+        if (perfect_hash) {
+            int64_t index;
+            if (! perfect_hash->find(&hash[0], index) || index >= amount) return false;
+            return getEntry(index, entry) && entry.hash == hash;
+        }
+
+        // a model or index narrows the search to a few records. the model's window is only a prediction, so a
+        // search that ends on either edge of it goes on past that edge; the index is exact below, and above too
+        // unless a sample shares the hash's prefix
+        int64_t low = 0;
+        int64_t high = amount;
+        bool lowOpen = false;
+        bool highOpen = false;
+        if (model) {
+            model->predict(&hash[0], amount, low, high);
+            lowOpen = low > 0;
+            highOpen = high < amount;
+        } else if (search_index) {
+            search_index->bounds(&hash[0], amount, low, high, highOpen);
+        }
+        const int size = reader.format->record_size;
+        // a lower bound of -1 means a record could not be read
+        int64_t index = reader.format->lowerBound(reader, offset + low * size, high - low, &hash[0]);
         if (index < 0) return false;
+        index += low;
+        if (index == low && lowOpen) {
+            index = reader.format->lowerBound(reader, offset, low, &hash[0]);
+        } else if (index == high && highOpen) {
+            index = reader.format->lowerBound(reader, offset + high * size, amount - high, &hash[0]);
+            if (index >= 0) index += high;
+        }
+        if (index < 0 || index == amount) return false;
+        return getEntry(index, entry) && entry.hash == hash;
+    }
 
-        getEntry(index, entry);
-        return true;
+    bool SnapshotEntryCollection::getKey(int64_t index, uint160_t& hash) const {
+        hash.resize(reader.format->key_size);
+        return reader.format->readKey(reader, offset, index, &hash[0]);
+    }
+
+    vector<pair<int64_t, int64_t> > SnapshotEntryCollection::pageRanges(int64_t entries_per_range) const {
+        const uint64_t page = 4096;
+        int64_t step = max((int64_t) 1024, entries_per_range / 1024 * 1024);
+
+        // offsets are multiples of the record alignment, and 1024 consecutive records reach every such offset
+        // within a page
+        int64_t aligned = 0;
+        while (aligned < 1024 && (offset + aligned * reader.format->record_size) % page != 0) aligned++;
+        if (aligned == 1024) aligned = 0;
+
+        vector<pair<int64_t, int64_t> > ranges;
+        int64_t begin = 0;
+        int64_t end = min(amount, aligned > 0 ? aligned : step);
+        while (begin < amount) {
+            ranges.push_back(make_pair(begin, end));
+            begin = end;
+            end = min(amount, end + step);
+        }
+        return ranges;
+    }
+
+    vector<SnapshotEntryCollection> SnapshotEntryCollection::split(int64_t parts) const {
+        vector<SnapshotEntryCollection> ranges;
+        if (parts < 1) parts = 1;
+        for (int64_t part = 0; part < parts; part++) {
+            ranges.push_back(subrange(amount * part / parts, amount * (part + 1) / parts));
+        }
+        return ranges;
     }
 
     bool getEntry (SnapshotEntryCollection& entries, const string &claim, const bc::message_signature &signature, snapshot_entry& entry) {
 
         // first, get p2pkh value for claim
         vector<uint8_t> claimVector = vector<uint8_t>(20);
-        if (!recover_address(claim, signature, claimVector)) {
-            false;
+        if (!recover_address(claim, signature, claimVector, recoveredKeyCache())) {
+            return false;
         }
 
         return entries.getEntry(claimVector, entry);
@@ -169,7 +524,7 @@ namespace bst {
     bool SnapshotEntryCollection::getEntry(const string& claim, const string& signature, snapshot_entry& entry) {
         bc::message_signature decodedSignature = bc::message_signature();
         bc::data_chunk chunk;
-        if (!bc::decode_base64(chunk, signature)) return false;
+        if (!bc::decode_base64(chunk, signature) || chunk.size() != decodedSignature.size()) return false;
         copy(chunk.begin(), chunk.end(), decodedSignature.begin());
 
         return bst::getEntry(*this, claim, decodedSignature, entry);
@@ -177,26 +532,284 @@ namespace bst {
 
     bool SnapshotEntryCollection::getEntry(const string& claim, const uint256_t signature, snapshot_entry& entry) {
         bc::message_signature message_signature = bc::message_signature();
+        if (signature.size() != message_signature.size()) return false;
         copy(signature.begin(), signature.end(), message_signature.begin());
 
         return bst::getEntry(*this, claim, message_signature, entry);
     }
 
+    void SnapshotEntryCollection::getEntries(const vector<claim_request>& claims, vector<claim_result>& results,
+                                             ThreadPool& pool) {
+        results.assign(claims.size(), claim_result());
+        vector<uint160_t> hashes(claims.size(), uint160_t(20));
+
+        // EC recovery is where the time goes, and it only needs the claim itself
+        pool.parallelFor(claims.size(), 16, [&](uint64_t begin, uint64_t end) {
+            for (uint64_t i = begin; i < end; i++) {
+                bool recovered = false;
+                try {
+                    recovered = recover_address(claims[i].claim, claims[i].signature, hashes[i], recoveredKeyCache());
+                } catch (...) {
+                }
+                if (! recovered) {
+                    results[i].status = CLAIM_BAD_SIGNATURE;
+                }
+            }
+        });
+
+        vector<size_t> recovered;
+        vector<uint160_t> recoveredHashes;
+        for (size_t i = 0; i < claims.size(); i++) {
+            if (results[i].status == CLAIM_BAD_SIGNATURE) continue;
+            recovered.push_back(i);
+            recoveredHashes.push_back(hashes[i]);
+        }
+
+        vector<snapshot_entry> entries;
+        vector<bool> found;
+        getEntries(recoveredHashes, entries, found, pool);
+        for (size_t j = 0; j < recovered.size(); j++) {
+            if (! found[j]) continue;
+            claim_result& result = results[recovered[j]];
+            result.status = CLAIM_VALID;
+            result.amount = entries[j].amount;
+            result.index = entries[j].index;
+        }
+    }
+
+    static const int64_t SCAN_CHUNK_ENTRIES = 4096;
+
+    void SnapshotEntryCollection::getEntries(const vector<uint160_t>& hashes, vector<snapshot_entry>& entries,
+                                             vector<bool>& found, ThreadPool& pool) {
+        entries.assign(hashes.size(), snapshot_entry());
+        found.assign(hashes.size(), false);
+        if (hashes.empty() || amount == 0) return;
+
+        // most misses never get past the filter
+        vector<uint8_t> candidate(hashes.size(), 1);
+        if (filter) {
+            pool.parallelFor(hashes.size(), 1024, [&](uint64_t begin, uint64_t end) {
+                for (uint64_t i = begin; i < end; i++) {
+                    candidate[i] = filter->mayContain(&hashes[i][0]);
+                }
+            });
+        }
+        vector<size_t> order;
+        order.reserve(hashes.size());
+        for (size_t i = 0; i < hashes.size(); i++) {
+            if (candidate[i]) order.push_back(i);
+        }
+        parallelSort(pool, order.begin(), order.end(), [&](size_t a, size_t b) { return hashes[a] < hashes[b]; });
+
+        const record_format& format = *reader.format;
+        vector<size_t> hits;
+        if (perfect_hash && (uint64_t) order.size() * 64 < (uint64_t) amount) {
+            uint8_t key[MAX_RECORD_SIZE];
+            for (size_t i : order) {
+                int64_t index;
+                if (! perfect_hash->find(&hashes[i][0], index) || index >= amount) continue;
+                if (! format.readKey(reader, offset, index, key)) continue;
+                if (memcmp(key, &hashes[i][0], format.key_size) != 0) continue;
+                entries[i].index = index;
+                hits.push_back(i);
+            }
+            // hits are read back in index order
+            sort(hits.begin(), hits.end(), [&](size_t a, size_t b) { return entries[a].index < entries[b].index; });
+        } else if ((uint64_t) order.size() * 64 < (uint64_t) amount) {
+            // too few hashes to be worth reading the whole section. each search starts at the previous hit instead
+            int64_t low = 0;
+            uint8_t key[MAX_RECORD_SIZE];
+            for (size_t i : order) {
+                int64_t step = format.lowerBound(reader, offset + low * format.record_size, amount - low, &hashes[i][0]);
+                if (step < 0) break;
+                low += step;
+                if (low == amount) break;
+                if (! format.readKey(reader, offset, low, key)) break;
+                if (memcmp(key, &hashes[i][0], format.key_size) != 0) continue;
+                entries[i].index = low;
+                hits.push_back(i);
+            }
+        } else {
+            // one sequential pass over the section, walking the sorted hashes alongside it
+            vector<uint8_t> buffer;
+            bool mapped = reader.file && reader.file->data;
+            if (! mapped) buffer.resize(SCAN_CHUNK_ENTRIES * format.record_size);
+            size_t next = 0;
+            for (int64_t first = 0; first < amount && next < order.size(); first += SCAN_CHUNK_ENTRIES) {
+                int64_t count = min(SCAN_CHUNK_ENTRIES, amount - first);
+                uint64_t chunkOffset = offset + first * format.record_size;
+                const uint8_t* records = mapped ? reader.file->data + chunkOffset : &buffer[0];
+                // hashes falling in a chunk that can't be read are passed over as not found
+                if (! mapped && ! readSnapshot(reader, chunkOffset, &buffer[0], count * format.record_size)) continue;
+                next = format.matchSorted(records, first, count, hashes, order, next, entries, hits);
+            }
+        }
+
+        // hits come out in index order, so the amounts and claim bits are read front to back
+        int claimedFd = -1;
+        struct stat claimedStat;
+        if (! reader.claims) {
+            claimedFd = open(SNAPSHOT_CLAIMED_NAME.c_str(), O_RDONLY);
+            // without the claim bits an entry can't be reported, so every hit is left not found
+            if (claimedFd >= 0 && fstat(claimedFd, &claimedStat) != 0) {
+                close(claimedFd);
+                claimedFd = -1;
+            }
+            if (claimedFd < 0) return;
+        }
+        int64_t claimedByteIndex = -1;
+        uint8_t claimedByte = 0;
+        for (size_t i : hits) {
+            snapshot_entry& entry = entries[i];
+            if (! format.readEntry(reader, offset, entry.index, entry)) continue;
+
+            uint64_t claimIndex = entry.index + claimed_offset;
+            if (reader.claims) {
+                entry.claimed = isClaimed(*reader.claims, claimIndex);
+                found[i] = true;
+                continue;
+            }
+            if ((int64_t) (claimIndex / 8) != claimedByteIndex) {
+                claimedByteIndex = -1;
+                if ((off_t) (claimIndex / 8) >= claimedStat.st_size) {
+                    // past the end of a short claim file counts as claimed, as it does in the bitfield
+                    claimedByte = 0xff;
+                } else if (! readFully(claimedFd, &claimedByte, 1, claimIndex / 8)) {
+                    continue;
+                }
+                claimedByteIndex = claimIndex / 8;
+            }
+            entry.claimed = (claimedByte & (1 << (claimIndex % 8))) != 0;
+            found[i] = true;
+        }
+        if (claimedFd >= 0) close(claimedFd);
+    }
+
     void SnapshotEntryCollection::setClaimed(int64_t index) {
         setClaimedWithOffset(index, claimed_offset);
     }
 
+    bool SnapshotEntryCollection::testAndSetClaimed(claim_bitfield& bitfield, int64_t index) {
+        return bst::testAndSetClaimed(bitfield, index + claimed_offset);
+    }
+
     SnapshotEntryCollection getP2PKHCollection(const snapshot_reader& reader) {
-        SnapshotEntryCollection collection = SnapshotEntryCollection(reader, reader.header.nP2PKH, HEADER_SIZE, 0);
+        const section_filter* filter = reader.filter ? &reader.filter->sections[SECTION_P2PKH] : 0;
+        const eytzinger_section* index = reader.search_index ? &reader.search_index->sections[SECTION_P2PKH] : 0;
+        const section_model* model = reader.model ? &reader.model->sections[SECTION_P2PKH] : 0;
+        const perfect_hash_section* perfectHash = reader.perfect_hash ? &reader.perfect_hash->sections[SECTION_P2PKH] : 0;
+        SnapshotEntryCollection collection = SnapshotEntryCollection(reader, reader.header.nP2PKH,
+                                                                     reader.format->data_offset, 0, filter, index,
+                                                                     model, perfectHash);
         return collection;
     }
 
     SnapshotEntryCollection getP2SHCollection(const snapshot_reader& reader) {
-        uint64_t offset = HEADER_SIZE + reader.header.nP2PKH * 28;
-        SnapshotEntryCollection collection = SnapshotEntryCollection(reader, reader.header.nP2SH, offset, reader.header.nP2PKH);
+        uint64_t offset = reader.format->data_offset + reader.header.nP2PKH * reader.format->record_size;
+        const section_filter* filter = reader.filter ? &reader.filter->sections[SECTION_P2SH] : 0;
+        const eytzinger_section* index = reader.search_index ? &reader.search_index->sections[SECTION_P2SH] : 0;
+        const section_model* model = reader.model ? &reader.model->sections[SECTION_P2SH] : 0;
+        const perfect_hash_section* perfectHash = reader.perfect_hash ? &reader.perfect_hash->sections[SECTION_P2SH] : 0;
+        SnapshotEntryCollection collection = SnapshotEntryCollection(reader, reader.header.nP2SH, offset,
+                                                                     reader.header.nP2PKH, filter, index, model,
+                                                                     perfectHash);
         return collection;
     }
 
+    // asks the kernel to start reading the page holding an entry, so it is in flight before we need it
+    static void prefetchEntry(const snapshot_reader& reader, uint64_t offset)
+    {
+        posix_fadvise(reader.file->fd, offset, reader.format->record_size, POSIX_FADV_WILLNEED);
+    }
+
+    struct section_search
+    {
+        SnapshotEntryCollection collection;
+        int64_t low;
+        int64_t high;
+        bool active;
+
+        section_search(const SnapshotEntryCollection& collection_, bool active_)
+                : collection(collection_), low(0), high(collection_.amount - 1), active(active_ && high >= 0) {}
+    };
+
+    bool findEntry(snapshot_reader& reader, const uint160_t& hash, snapshot_entry& entry, snapshot_section& section)
+    {
+        if (hash.size() != (size_t) reader.format->key_size) return false;
+        SnapshotEntryCollection p2pkhEntries = getP2PKHCollection(reader);
+        SnapshotEntryCollection p2shEntries = getP2SHCollection(reader);
+        if (p2pkhEntries.perfect_hash && p2shEntries.perfect_hash) {
+            // one record read per section, no search to interleave
+            section = SECTION_P2PKH;
+            if (p2pkhEntries.getEntry(hash, entry)) return true;
+            section = SECTION_P2SH;
+            return p2shEntries.getEntry(hash, entry);
+        }
+        section_search searches[2] = {
+                section_search(p2pkhEntries, ! p2pkhEntries.filter || p2pkhEntries.filter->mayContain(&hash[0])),
+                section_search(p2shEntries, ! p2shEntries.filter || p2shEntries.filter->mayContain(&hash[0]))
+        };
+
+        const int size = reader.format->record_size;
+        vector<uint8_t> key(reader.format->key_size);
+        // a mapped snapshot is read from memory, so hints would only cost a system call per probe
+        const bool hint = reader.file && reader.file->fd >= 0 && ! reader.file->data;
+        while (searches[0].active || searches[1].active) {
+            // hint this round's probes and both possible probes of the next round, for both sections
+            for (int s = 0; s < 2 && hint; s++) {
+                section_search& search = searches[s];
+                if (! search.active) continue;
+                int64_t mid = (search.low + search.high) / 2;
+                uint64_t base = search.collection.offset;
+                prefetchEntry(reader, base + mid * size);
+                if ((search.high - search.low) * size > 4096) {
+                    prefetchEntry(reader, base + ((search.low + mid - 1) / 2) * size);
+                    prefetchEntry(reader, base + ((mid + 1 + search.high) / 2) * size);
+                }
+            }
+
+            for (int s = 0; s < 2; s++) {
+                section_search& search = searches[s];
+                if (! search.active) continue;
+                int64_t mid = (search.low + search.high) / 2;
+                if (! reader.format->readKey(reader, search.collection.offset, mid, &key[0])) return false;
+
+                int comparison = compare(hash, key);
+                if (comparison == 0) {
+                    section = s == 0 ? SECTION_P2PKH : SECTION_P2SH;
+                    return search.collection.getEntry(mid, entry);
+                }
+                if (comparison < 0) {
+                    search.high = mid - 1;
+                } else {
+                    search.low = mid + 1;
+                }
+                search.active = search.low <= search.high;
+            }
+        }
+        return false;
+    }
+
+    bool findEntry(snapshot_reader& reader, const string& address, snapshot_entry& entry, snapshot_section& section)
+    {
+        bc::payment_address payment_address;
+        if (! payment_address.set_encoded(address)) return false;
+        uint160_t hash(payment_address.hash().begin(), payment_address.hash().end());
+
+        switch (payment_address.version()) {
+            case 0:
+            case 111:
+                section = SECTION_P2PKH;
+                return getP2PKHCollection(reader).getEntry(hash, entry);
+            case 5:
+            case 196:
+                section = SECTION_P2SH;
+                return getP2SHCollection(reader).getEntry(hash, entry);
+            default:
+                return findEntry(reader, hash, entry, section);
+        }
+    }
+
     uint64_t getP2PKHAmount(SnapshotEntryCollection& collection, const string &claim, const string &signature) {
 
         snapshot_entry entry;
@@ -206,29 +819,123 @@ namespace bst {
         return 0;
     }
 
-    uint64_t getP2SHAmount(SnapshotEntryCollection& collection, const string &transaction, const string &address,
-                           const uint32_t input_index) {
-        bc::payment_address payment_address = bc::payment_address(address);
-        vector <uint8_t> claimVector = vector<uint8_t>(payment_address.hash().begin(), payment_address.hash().end());
+    void getP2PKHAmounts(SnapshotEntryCollection& collection, const vector<claim_request>& claims,
+                         vector<claim_result>& results, ThreadPool& pool) {
+        collection.getEntries(claims, results, pool);
+    }
+
+    // of the valid results naming one entry, leaves the one ranked first valid and marks the others
+    static void resolveDuplicates(vector<claim_result>& results, ThreadPool& pool, const vector<uint64_t>& order) {
+        // entry index, rank, position
+        typedef tuple<int64_t, uint64_t, size_t> contender;
+        vector<contender> contenders;
+        for (size_t i = 0; i < results.size(); i++) {
+            if (results[i].status != CLAIM_VALID) continue;
+            contenders.push_back(contender(results[i].index, order.empty() ? i : order[i], i));
+        }
+        parallelSort(pool, contenders.begin(), contenders.end(), less<contender>());
+
+        // a group starts wherever the entry index changes
+        pool.parallelFor(contenders.size(), 1024, [&](uint64_t begin, uint64_t end) {
+            for (uint64_t c = begin; c < end; c++) {
+                if (c > 0 && get<0>(contenders[c - 1]) == get<0>(contenders[c])) {
+                    results[get<2>(contenders[c])].status = CLAIM_ALREADY_CLAIMED;
+                }
+            }
+        });
+    }
+
+    // an order must rank every result. otherwise nothing is claimed and the valid results become errors
+    static bool checkOrder(vector<claim_result>& results, const vector<uint64_t>& order) {
+        if (order.empty() || order.size() == results.size()) return true;
+        for (auto& result : results) {
+            if (result.status == CLAIM_VALID) result.status = CLAIM_ERROR;
+        }
+        return false;
+    }
+
+    void claimEntries(SnapshotEntryCollection& collection, claim_bitfield& bitfield, vector<claim_result>& results,
+                      ThreadPool& pool, const vector<uint64_t>& order) {
+        if (! checkOrder(results, order)) return;
+        resolveDuplicates(results, pool, order);
+        // only one result per entry is left, so no two threads share a bit
+        pool.parallelFor(results.size(), 1024, [&](uint64_t begin, uint64_t end) {
+            for (uint64_t i = begin; i < end; i++) {
+                if (results[i].status != CLAIM_VALID) continue;
+                if (collection.testAndSetClaimed(bitfield, results[i].index)) results[i].status = CLAIM_ALREADY_CLAIMED;
+            }
+        });
+    }
+
+    bool claimEntries(ClaimJournal& journal, snapshot_section section, vector<claim_result>& results,
+                      ThreadPool& pool, uint64_t& ticket, const vector<uint64_t>& order) {
+        ticket = 0;
+        if (! checkOrder(results, order)) return false;
+        resolveDuplicates(results, pool, order);
+        vector<size_t> winners;
+        vector<int64_t> indexes;
+        for (size_t i = 0; i < results.size(); i++) {
+            if (results[i].status != CLAIM_VALID) continue;
+            winners.push_back(i);
+            indexes.push_back(results[i].index);
+        }
+
+        vector<bool> taken;
+        bool queued = journal.reserve(section, indexes, taken, ticket);
+        for (size_t w = 0; w < winners.size(); w++) {
+            if (! queued) {
+                results[winners[w]].status = CLAIM_ERROR;
+            } else if (taken[w]) {
+                results[winners[w]].status = CLAIM_ALREADY_CLAIMED;
+            }
+        }
+        return queued;
+    }
+
+    static bool parseTransaction(const string& transaction, bc::transaction_type& transaction_type) {
+        bc::data_chunk transaction_chunk;
+        if (! bc::decode_base16(transaction_chunk, transaction)) return false;
+        try {
+            bc::satoshi_load(transaction_chunk.begin(), transaction_chunk.end(), transaction_type);
+        } catch (...) {
+            return false;
+        }
+        return true;
+    }
+
+    // runs the input against the p2sh output script for scriptHash, remembering the outcome per (txid, input)
+    static bool validateP2SHInput(const bc::transaction_type& transaction_type, const bc::hash_digest& txid,
+                                  const uint32_t input_index, const uint160_t& scriptHash) {
+        bool valid;
+        if (scriptValidationCache().find(txid, input_index, scriptHash, valid)) return valid;
 
         // construct output script from script hash
         vector <uint8_t> output_vector = vector<uint8_t>(23);
-        copy(claimVector.begin(), claimVector.end(), output_vector.begin() + 2);
+        copy(scriptHash.begin(), scriptHash.end(), output_vector.begin() + 2);
         output_vector[0] = (uint8_t) bc::opcode::hash160;
         output_vector[1] = 0x14; // special - 20 bytes of data follow
         output_vector[22] = (uint8_t) bc::opcode::equal;
         bc::array_slice <uint8_t> output_slice(output_vector);
         bc::script_type output_script = bc::parse_script(output_slice);
 
+        bc::script_type input_script = transaction_type.inputs[input_index].script;
+        valid = output_script.run(input_script, transaction_type, input_index);
+        scriptValidationCache().insert(txid, input_index, scriptHash, valid);
+        return valid;
+    }
+
+    uint64_t getP2SHAmount(SnapshotEntryCollection& collection, const string &transaction, const string &address,
+                           const uint32_t input_index) {
+        bc::payment_address payment_address = bc::payment_address(address);
+        vector <uint8_t> claimVector = vector<uint8_t>(payment_address.hash().begin(), payment_address.hash().end());
+
         // construct transaction
-        bc::data_chunk transaction_chunk;
-        bc::decode_base16(transaction_chunk, transaction);
         bc::transaction_type transaction_type;
-        bc::satoshi_load(transaction_chunk.begin(), transaction_chunk.end(), transaction_type);
-        bc::script_type input_script = transaction_type.inputs[input_index].script;
+        if (! parseTransaction(transaction, transaction_type)) return 0;
+        if (input_index >= transaction_type.inputs.size()) return 0;
 
         // if transaction validates against output script, find amount in snapshot
-        if (output_script.run(input_script, transaction_type, input_index)) {
+        if (validateP2SHInput(transaction_type, bc::hash_transaction(transaction_type), input_index, claimVector)) {
             snapshot_entry entry;
             if ( collection.getEntry(claimVector, entry)) {
                 return entry.amount;
@@ -237,4 +944,57 @@ namespace bst {
         return 0;
     }
 
+    void getP2SHAmounts(SnapshotEntryCollection& collection, const string& transaction,
+                        const vector<p2sh_claim_input>& inputs, vector<claim_result>& results, ThreadPool& pool) {
+        results.assign(inputs.size(), claim_result());
+
+        bc::transaction_type transaction_type;
+        if (! parseTransaction(transaction, transaction_type)) {
+            for (auto& result : results) result.status = CLAIM_BAD_TRANSACTION;
+            return;
+        }
+        const bc::hash_digest txid = bc::hash_transaction(transaction_type);
+
+        // every input only reads the shared transaction, so the script runs are independent
+        vector<uint160_t> hashes(inputs.size(), uint160_t(20));
+        pool.parallelFor(inputs.size(), 1, [&](uint64_t begin, uint64_t end) {
+            for (uint64_t i = begin; i < end; i++) {
+                if (inputs[i].input_index >= transaction_type.inputs.size()) {
+                    results[i].status = CLAIM_BAD_TRANSACTION;
+                    continue;
+                }
+                bc::payment_address payment_address = bc::payment_address(inputs[i].address);
+                copy(payment_address.hash().begin(), payment_address.hash().end(), hashes[i].begin());
+
+                bool valid = false;
+                try {
+                    valid = validateP2SHInput(transaction_type, txid, inputs[i].input_index, hashes[i]);
+                } catch (...) {
+                }
+                if (! valid) {
+                    results[i].status = CLAIM_BAD_SIGNATURE;
+                }
+            }
+        });
+
+        vector<size_t> validated;
+        vector<uint160_t> validatedHashes;
+        for (size_t i = 0; i < inputs.size(); i++) {
+            if (results[i].status != CLAIM_NOT_FOUND) continue;
+            validated.push_back(i);
+            validatedHashes.push_back(hashes[i]);
+        }
+
+        vector<snapshot_entry> entries;
+        vector<bool> found;
+        collection.getEntries(validatedHashes, entries, found, pool);
+        for (size_t j = 0; j < validated.size(); j++) {
+            if (! found[j]) continue;
+            claim_result& result = results[validated[j]];
+            result.status = CLAIM_VALID;
+            result.amount = entries[j].amount;
+            result.index = entries[j].index;
+        }
+    }
+
 }
@@ -15,12 +15,15 @@
  */
 #include "bitcoin/bst/common.h"
 #include <bitcoin/bitcoin.hpp>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace std;
 
 namespace bst {
 
-    void resetClaims(snapshot_header& header)
+    bool resetClaims(snapshot_header& header, const string& name)
     {
         uint64_t totalClaims = header.nP2PKH + header.nP2SH;
         uint64_t bytesToWrite;
@@ -29,13 +32,16 @@ namespace bst {
         } else {
             bytesToWrite = totalClaims / 8;
         }
-        ofstream claimedDatabase;
-        claimedDatabase.open(SNAPSHOT_CLAIMED_NAME, ios::binary);
-        char zeroByte = 0;
-        for (uint64_t i = 0; i < bytesToWrite; i++)
-        {
-            claimedDatabase.write(&zeroByte, 1);
-        }
-        claimedDatabase.close();
+        // truncating to nothing drops every block, then extending leaves a hole that reads back as zeros. the file
+        // is the same plain bitfield as before, it just costs nothing to write
+        int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        bool sized = ftruncate(fd, bytesToWrite) == 0;
+        close(fd);
+        if (! sized) return false;
+
+        // a journal left behind would replay its claims onto the fresh bitfield
+        string journalName = name + JOURNAL_EXTENSION;
+        return remove(journalName.c_str()) == 0 || errno == ENOENT;
     }
 }
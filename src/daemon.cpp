@@ -0,0 +1,450 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <bitcoin/bitcoin.hpp>
+#include "bitcoin/bst/daemon.h"
+#include "bitcoin/bst/misc.h"
+#include "bitcoin/bst/key_cache.h"
+
+using namespace std;
+
+namespace bst {
+
+    static const int REQUEST_HEADER_SIZE = 4 + 4 + 1 + 1;
+    static const int SIGNATURE_SIZE = 65;
+    // a connection stops draining once this much is buffered, so one busy client can not grow an unbounded batch
+    static const size_t MAX_BATCH_BYTES = 4 * MAX_REQUEST_SIZE;
+
+    template <typename T>
+    static void put(vector<uint8_t>& out, T value)
+    {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+        out.insert(out.end(), bytes, bytes + sizeof(value));
+    }
+
+    template <typename T>
+    static T get(const uint8_t* data)
+    {
+        T value;
+        memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    void encodeRequest(const daemon_request& request, vector<uint8_t>& out)
+    {
+        uint32_t length = 4 + 1 + 1;
+        if (request.type == REQUEST_BALANCE) {
+            length += 20;
+        } else {
+            length += SIGNATURE_SIZE + request.message.size();
+        }
+        put(out, length);
+        put(out, request.id);
+        put(out, request.type);
+        put(out, request.section);
+        if (request.type == REQUEST_BALANCE) {
+            out.insert(out.end(), request.hash.begin(), request.hash.end());
+        } else {
+            out.insert(out.end(), request.signature.begin(), request.signature.end());
+            out.insert(out.end(), request.message.begin(), request.message.end());
+        }
+    }
+
+    int64_t decodeRequest(const uint8_t* data, size_t length, daemon_request& request)
+    {
+        if (length < 4) return 0;
+        uint32_t frameLength = get<uint32_t>(data);
+        if (frameLength < REQUEST_HEADER_SIZE - 4 || frameLength > MAX_REQUEST_SIZE) return -1;
+        if (length < 4 + frameLength) return 0;
+
+        request.id = get<uint32_t>(data + 4);
+        request.type = data[8];
+        request.section = data[9];
+        const uint8_t* payload = data + REQUEST_HEADER_SIZE;
+        uint32_t payloadLength = frameLength - (REQUEST_HEADER_SIZE - 4);
+        if (request.type == REQUEST_BALANCE) {
+            if (payloadLength != 20) return -1;
+            request.hash.assign(payload, payload + 20);
+        } else if (request.type == REQUEST_CLAIM) {
+            if (payloadLength < SIGNATURE_SIZE) return -1;
+            request.signature.assign(payload, payload + SIGNATURE_SIZE);
+            request.message.assign(reinterpret_cast<const char*>(payload + SIGNATURE_SIZE), payloadLength - SIGNATURE_SIZE);
+        }
+        return 4 + frameLength;
+    }
+
+    void encodeResponse(const daemon_response& response, vector<uint8_t>& out)
+    {
+        put(out, (uint32_t) (RESPONSE_SIZE - 4));
+        put(out, response.id);
+        put(out, response.status);
+        put(out, response.section);
+        put(out, response.amount);
+    }
+
+    int64_t decodeResponse(const uint8_t* data, size_t length, daemon_response& response)
+    {
+        if (length < 4) return 0;
+        if (get<uint32_t>(data) != RESPONSE_SIZE - 4) return -1;
+        if (length < RESPONSE_SIZE) return 0;
+        response.id = get<uint32_t>(data + 4);
+        response.status = data[8];
+        response.section = data[9];
+        response.amount = get<uint64_t>(data + 10);
+        return RESPONSE_SIZE;
+    }
+
+    static bool writeAll(int fd, const uint8_t* data, size_t length)
+    {
+        while (length > 0) {
+            ssize_t written = send(fd, data, length, MSG_NOSIGNAL);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += written;
+            length -= written;
+        }
+        return true;
+    }
+
+    SnapshotDaemon::SnapshotDaemon() : listen_fd(-1), stopping(false) {}
+
+    SnapshotDaemon::~SnapshotDaemon()
+    {
+        close();
+    }
+
+    bool SnapshotDaemon::open(const daemon_options& options_)
+    {
+        options = options_;
+        if (! openSnapshot(stream, reader, options.snapshot_name) || ! mapSnapshot(reader)) {
+            cout << "could not map snapshot " << options.snapshot_name << endl;
+            return false;
+        }
+        if (! openClaimBitfield(bitfield, options.claimed_name)) {
+            cout << "could not map " << options.claimed_name << endl;
+            return false;
+        }
+        reader.claims = &bitfield;
+        if (! journal.open(reader.header, bitfield, options.journal, options.journal_name)) {
+            cout << "could not open claim journal" << endl;
+            return false;
+        }
+        if (options.warm && ! warmer.start(reader, &bitfield, options.warmup)) {
+            cout << "could not warm snapshot " << options.snapshot_name << endl;
+            return false;
+        }
+        pool.reset(new ThreadPool(options.threads));
+
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (options.socket_name.size() >= sizeof(address.sun_path)) {
+            cout << "socket path too long: " << options.socket_name << endl;
+            return false;
+        }
+        strcpy(address.sun_path, options.socket_name.c_str());
+
+        unlink(options.socket_name.c_str());
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd < 0
+            || bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+            || listen(listen_fd, 128) != 0) {
+            cout << "could not listen on " << options.socket_name << ": " << strerror(errno) << endl;
+            return false;
+        }
+        stopping = false;
+        return true;
+    }
+
+    void SnapshotDaemon::run()
+    {
+        while (! stopping) {
+            int fd = accept(listen_fd, 0, 0);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            lock_guard<mutex> guard(connections_lock);
+            if (stopping) {
+                ::close(fd);
+                break;
+            }
+            connections.insert(fd);
+            // connection threads are detached, close waits for the connection set to drain
+            thread(&SnapshotDaemon::serveConnection, this, fd).detach();
+        }
+    }
+
+    void SnapshotDaemon::stop()
+    {
+        stopping = true;
+        if (listen_fd >= 0) shutdown(listen_fd, SHUT_RDWR);
+    }
+
+    void SnapshotDaemon::close()
+    {
+        stop();
+        {
+            // wake every connection blocked in read, they finish their batch and exit
+            unique_lock<mutex> guard(connections_lock);
+            for (int fd : connections) shutdown(fd, SHUT_RDWR);
+            connections_done.wait(guard, [this] { return connections.empty(); });
+        }
+
+        if (listen_fd >= 0) {
+            ::close(listen_fd);
+            listen_fd = -1;
+            unlink(options.socket_name.c_str());
+        }
+        // warming threads may still be touching the bitfield
+        warmer.cancel();
+        journal.close();
+        pool.reset();
+        reader.claims = 0;
+        closeClaimBitfield(bitfield);
+    }
+
+    void SnapshotDaemon::serveConnection(int fd)
+    {
+        vector<uint8_t> buffer;
+        vector<uint8_t> out;
+        vector<daemon_request> requests;
+        vector<daemon_response> responses;
+        vector<uint8_t> chunk(1 << 16);
+
+        bool open = true;
+        while (open && ! stopping) {
+            ssize_t bytes = recv(fd, &chunk[0], chunk.size(), 0);
+            if (bytes < 0 && errno == EINTR) continue;
+            if (bytes <= 0) break;
+            buffer.insert(buffer.end(), chunk.begin(), chunk.begin() + bytes);
+
+            // take whatever else the client already pipelined, so it is all answered as one batch
+            while (buffer.size() < MAX_BATCH_BYTES && (bytes = recv(fd, &chunk[0], chunk.size(), MSG_DONTWAIT)) > 0) {
+                buffer.insert(buffer.end(), chunk.begin(), chunk.begin() + bytes);
+            }
+
+            requests.clear();
+            size_t start = 0;
+            while (start < buffer.size()) {
+                daemon_request request;
+                int64_t used = decodeRequest(&buffer[start], buffer.size() - start, request);
+                if (used < 0) {
+                    open = false;
+                    break;
+                }
+                if (used == 0) break;
+                start += used;
+                requests.push_back(request);
+            }
+            buffer.erase(buffer.begin(), buffer.begin() + start);
+
+            if (requests.empty()) continue;
+            processBatch(requests, responses);
+            out.clear();
+            for (auto& response : responses) encodeResponse(response, out);
+            if (! writeAll(fd, &out[0], out.size())) break;
+        }
+
+        lock_guard<mutex> guard(connections_lock);
+        connections.erase(fd);
+        ::close(fd);
+        connections_done.notify_all();
+    }
+
+    void SnapshotDaemon::processBatch(const vector<daemon_request>& requests, vector<daemon_response>& responses)
+    {
+        responses.assign(requests.size(), daemon_response());
+        SnapshotEntryCollection p2pkhEntries = getP2PKHCollection(reader);
+        SnapshotEntryCollection p2shEntries = getP2SHCollection(reader);
+        // claims are looked up first and claimed together afterwards, so duplicates within a batch resolve by position
+        vector<claim_result> claims(requests.size());
+
+        // the snapshot and bitfield are mapped, so lookups from any thread are independent of each other
+        pool->parallelFor(requests.size(), 8, [&](uint64_t begin, uint64_t end) {
+            snapshot_entry entry;
+            for (uint64_t i = begin; i < end; i++) {
+                const daemon_request& request = requests[i];
+                daemon_response& response = responses[i];
+                response.id = request.id;
+
+                if (request.type == REQUEST_BALANCE) {
+                    snapshot_section section = SECTION_P2PKH;
+                    bool found;
+                    if (request.section == SECTION_P2PKH) {
+                        found = p2pkhEntries.getEntry(request.hash, entry);
+                    } else if (request.section == SECTION_P2SH) {
+                        section = SECTION_P2SH;
+                        found = p2shEntries.getEntry(request.hash, entry);
+                    } else {
+                        found = findEntry(reader, request.hash, entry, section);
+                    }
+                    response.status = found ? STATUS_OK : STATUS_NOT_FOUND;
+                    if (found) {
+                        response.section = section;
+                        response.amount = entry.amount;
+                    }
+                } else if (request.type == REQUEST_CLAIM) {
+                    bc::message_signature signature;
+                    copy(request.signature.begin(), request.signature.end(), signature.begin());
+                    uint160_t hash(20);
+                    bool recovered = false;
+                    try {
+                        recovered = recover_address(request.message, signature, hash, recoveredKeyCache());
+                    } catch (...) {
+                    }
+                    if (! recovered) {
+                        response.status = STATUS_BAD_SIGNATURE;
+                    } else if (! p2pkhEntries.getEntry(hash, entry)) {
+                        response.status = STATUS_NOT_FOUND;
+                    } else {
+                        claims[i].status = CLAIM_VALID;
+                        claims[i].index = entry.index;
+                        claims[i].amount = entry.amount;
+                    }
+                } else {
+                    response.status = STATUS_BAD_REQUEST;
+                }
+            }
+        });
+
+        // write ahead: the won claims are durable in the journal before their bits are set or anyone hears of them
+        uint64_t ticket;
+        claimEntries(journal, SECTION_P2PKH, claims, *pool, ticket);
+        bool durable = journal.wait(ticket);
+        for (size_t i = 0; i < claims.size(); i++) {
+            daemon_response& response = responses[i];
+            if (claims[i].status == CLAIM_ALREADY_CLAIMED) {
+                response.status = STATUS_ALREADY_CLAIMED;
+            } else if (claims[i].status == CLAIM_ERROR || (claims[i].status == CLAIM_VALID && ! durable)) {
+                response.status = STATUS_ERROR;
+            } else if (claims[i].status == CLAIM_VALID) {
+                response.status = STATUS_OK;
+                response.section = SECTION_P2PKH;
+                response.amount = claims[i].amount;
+            }
+        }
+    }
+
+    SnapshotClient::SnapshotClient() : fd(-1), next_id(0), incoming_start(0) {}
+
+    SnapshotClient::~SnapshotClient()
+    {
+        close();
+    }
+
+    bool SnapshotClient::connect(const string& socket_name)
+    {
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (socket_name.size() >= sizeof(address.sun_path)) return false;
+        strcpy(address.sun_path, socket_name.c_str());
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return false;
+        if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void SnapshotClient::close()
+    {
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+        outgoing.clear();
+        incoming.clear();
+        incoming_start = 0;
+    }
+
+    void SnapshotClient::queueBalance(uint32_t id, const uint160_t& hash, uint8_t section)
+    {
+        daemon_request request;
+        request.id = id;
+        request.type = REQUEST_BALANCE;
+        request.section = section;
+        request.hash = hash;
+        encodeRequest(request, outgoing);
+    }
+
+    void SnapshotClient::queueClaim(uint32_t id, const string& message, const uint256_t& signature)
+    {
+        daemon_request request;
+        request.id = id;
+        request.type = REQUEST_CLAIM;
+        request.section = SECTION_P2PKH;
+        request.signature = signature;
+        request.signature.resize(SIGNATURE_SIZE);
+        request.message = message;
+        encodeRequest(request, outgoing);
+    }
+
+    bool SnapshotClient::flush()
+    {
+        if (outgoing.empty()) return true;
+        bool ok = writeAll(fd, &outgoing[0], outgoing.size());
+        outgoing.clear();
+        return ok;
+    }
+
+    bool SnapshotClient::receive(daemon_response& response)
+    {
+        uint8_t chunk[1 << 14];
+        while (true) {
+            int64_t used = 0;
+            if (incoming.size() > incoming_start) {
+                used = decodeResponse(&incoming[incoming_start], incoming.size() - incoming_start, response);
+            }
+            if (used < 0) return false;
+            if (used > 0) {
+                incoming_start += used;
+                if (incoming_start == incoming.size()) {
+                    incoming.clear();
+                    incoming_start = 0;
+                }
+                return true;
+            }
+
+            ssize_t bytes = recv(fd, chunk, sizeof(chunk), 0);
+            if (bytes < 0 && errno == EINTR) continue;
+            if (bytes <= 0) return false;
+            incoming.insert(incoming.end(), chunk, chunk + bytes);
+        }
+    }
+
+    bool SnapshotClient::getBalance(const uint160_t& hash, daemon_response& response, uint8_t section)
+    {
+        queueBalance(next_id++, hash, section);
+        return flush() && receive(response);
+    }
+
+    bool SnapshotClient::claim(const string& message, const uint256_t& signature, daemon_response& response)
+    {
+        queueClaim(next_id++, message, signature);
+        return flush() && receive(response);
+    }
+}
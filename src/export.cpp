@@ -0,0 +1,386 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <condition_variable>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include <bitcoin/bitcoin.hpp>
+#include "bitcoin/bst/export.h"
+#include "bitcoin/bst/thread_pool.h"
+
+using namespace std;
+
+namespace bst {
+
+    static const char BASE58_DIGITS[] = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+    // 58^5 is the biggest power of 58 below 2^32
+    static const uint32_t BASE58_POWER = 656356768;
+
+    int encodeAddress(uint8_t version, const uint8_t* hash, char* out)
+    {
+        // version, hash and checksum, padded in front to seven big endian 32 bit words
+        uint8_t bytes[28] = { 0 };
+        bytes[3] = version;
+        memcpy(bytes + 4, hash, 20);
+        array<uint8_t, 21> body;
+        copy(bytes + 3, bytes + 24, body.begin());
+        bc::hash_digest checksum = bc::bitcoin_hash(body);
+        memcpy(bytes + 24, &checksum[0], 4);
+
+        uint32_t words[7];
+        for (int w = 0; w < 7; w++) {
+            words[w] = (uint32_t) bytes[w * 4] << 24 | (uint32_t) bytes[w * 4 + 1] << 16
+                       | (uint32_t) bytes[w * 4 + 2] << 8 | bytes[w * 4 + 3];
+        }
+
+        // five digits per long division, least significant first
+        char digits[40];
+        int count = 0;
+        int first = 0;
+        while (first < 7) {
+            uint64_t remainder = 0;
+            for (int w = first; w < 7; w++) {
+                uint64_t current = remainder << 32 | words[w];
+                words[w] = (uint32_t) (current / BASE58_POWER);
+                remainder = current % BASE58_POWER;
+            }
+            while (first < 7 && words[first] == 0) first++;
+            for (int d = 0; d < 5; d++) {
+                digits[count++] = (char) (remainder % 58);
+                remainder /= 58;
+            }
+        }
+        while (count > 0 && digits[count - 1] == 0) count--;
+
+        // every leading zero byte is written as a '1'
+        int length = 0;
+        for (int b = 3; b < 28 && bytes[b] == 0; b++) out[length++] = '1';
+        while (count > 0) out[length++] = BASE58_DIGITS[(int) digits[--count]];
+        return length;
+    }
+
+    static char* appendNumber(char* out, uint64_t value)
+    {
+        char digits[20];
+        int count = 0;
+        do {
+            digits[count++] = (char) ('0' + value % 10);
+            value /= 10;
+        } while (value > 0);
+        while (count > 0) *out++ = digits[--count];
+        return out;
+    }
+
+    static char* appendString(char* out, const char* text)
+    {
+        size_t length = strlen(text);
+        memcpy(out, text, length);
+        return out + length;
+    }
+
+    // fails if some records of the range could not be read
+    static bool exportRange(const SnapshotEntryCollection& entries, int64_t begin, int64_t end, uint8_t version,
+                            const char* type, export_format format, string& text)
+    {
+        // enough for the longest jsonl line
+        const size_t lineLength = 128;
+        text.resize((end - begin) * lineLength);
+        char* out = &text[0];
+        char address[MAX_ADDRESS_LENGTH];
+
+        SnapshotEntryCollection::scan_iterator last = entries.scanEnd(end);
+        SnapshotEntryCollection::scan_iterator i = entries.scanBegin(begin, end);
+        for (; i != last; ++i) {
+            int length = encodeAddress(version, &i->hash[0], address);
+            if (format == EXPORT_JSONL) out = appendString(out, "{\"address\":\"");
+            memcpy(out, address, length);
+            out += length;
+            if (format == EXPORT_TEXT) {
+                *out++ = ' ';
+                out = appendNumber(out, i->amount);
+            } else if (format == EXPORT_CSV) {
+                *out++ = ',';
+                out = appendString(out, type);
+                *out++ = ',';
+                out = appendNumber(out, i->amount);
+                out = appendString(out, i->claimed ? ",1" : ",0");
+            } else {
+                out = appendString(out, "\",\"type\":\"");
+                out = appendString(out, type);
+                out = appendString(out, "\",\"amount\":");
+                out = appendNumber(out, i->amount);
+                out = appendString(out, i->claimed ? ",\"claimed\":true}" : ",\"claimed\":false}");
+            }
+            *out++ = '\n';
+        }
+        text.resize(out - &text[0]);
+        return ! i.failed();
+    }
+
+    static bool writeAll(int fd, const string& text)
+    {
+        const char* data = text.data();
+        size_t length = text.size();
+        while (length > 0) {
+            ssize_t written = write(fd, data, length);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += written;
+            length -= written;
+        }
+        return true;
+    }
+
+    // encodes ranges ahead on the pool, at most window of them at a time, and writes them in order
+    static bool exportSection(const SnapshotEntryCollection& entries, uint8_t version, const char* type,
+                              const export_options& options, ThreadPool& pool, int fd)
+    {
+        vector<pair<int64_t, int64_t> > ranges = entries.pageRanges();
+        size_t window = pool.size() * 2 + 1;
+        vector<string> texts(window);
+        vector<bool> ready(window, false);
+        mutex lock;
+        condition_variable done;
+
+        // a range with unreadable records stops the export before it is written
+        bool readable = true;
+        auto encode = [&](size_t r) {
+            string text;
+            bool encoded = exportRange(entries, ranges[r].first, ranges[r].second, version, type, options.format, text);
+            lock_guard<mutex> guard(lock);
+            if (! encoded) readable = false;
+            texts[r % window].swap(text);
+            ready[r % window] = true;
+            done.notify_all();
+        };
+
+        size_t submitted = 0;
+        for (; submitted < ranges.size() && submitted < window; submitted++) {
+            pool.submit(bind(encode, submitted));
+        }
+
+        bool ok = true;
+        string text;
+        for (size_t r = 0; r < ranges.size(); r++) {
+            {
+                unique_lock<mutex> guard(lock);
+                done.wait(guard, [&] { return ready[r % window]; });
+                text.swap(texts[r % window]);
+                ready[r % window] = false;
+                if (! readable) ok = false;
+            }
+            // the slot is free again, start on the range that reuses it before writing this one
+            if (submitted < ranges.size()) {
+                pool.submit(bind(encode, submitted));
+                submitted++;
+            }
+            if (ok) ok = writeAll(fd, text);
+        }
+        return ok;
+    }
+
+    bool exportSnapshot(const snapshot_reader& reader, int fd, const export_options& options)
+    {
+        ThreadPool pool(options.threads);
+        SnapshotEntryCollection p2pkhEntries = getP2PKHCollection(reader);
+        SnapshotEntryCollection p2shEntries = getP2SHCollection(reader);
+
+        if (options.format == EXPORT_CSV && ! writeAll(fd, "address,type,amount,claimed\n")) return false;
+        if (options.format == EXPORT_TEXT && ! writeAll(fd, "p2pkh:\n")) return false;
+        if (! exportSection(p2pkhEntries, options.p2pkh_version, "p2pkh", options, pool, fd)) return false;
+        if (options.format == EXPORT_TEXT && ! writeAll(fd, "p2sh:\n")) return false;
+        return exportSection(p2shEntries, options.p2sh_version, "p2sh", options, pool, fd);
+    }
+
+    static const char COLUMNS_MAGIC[4] = { 'B', 'S', 'T', 'C' };
+    static const uint32_t COLUMNS_VERSION = 1;
+    static const int COLUMNS_HEADER_SIZE = 4 + 4 + 32 + 8 + 4 + 4;
+    static const int COLUMN_ENTRY_SIZE = 16 + 4 + 4 + 8 + 8;
+
+    static bool pwriteAll(int fd, const uint8_t* data, size_t length, uint64_t offset)
+    {
+        while (length > 0) {
+            ssize_t written = pwrite(fd, data, length, offset);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += written;
+            length -= written;
+            offset += written;
+        }
+        return true;
+    }
+
+    static void addColumn(column_file& file, const string& name, column_type type, uint32_t width)
+    {
+        column_info column;
+        column.name = name;
+        column.type = type;
+        column.width = width;
+        column.length = type == COLUMN_BITMAP ? (file.rows + 7) / 8 : file.rows * width;
+        file.columns.push_back(column);
+    }
+
+    // parts are written one after another, sections[i] names the section of parts[i] for the section column
+    static bool writeColumnFile(const string& name, const uint256_t& block_hash,
+                                const vector<SnapshotEntryCollection>& parts, const vector<uint8_t>& sections,
+                                bool sectionColumn, ThreadPool& pool)
+    {
+        column_file file;
+        file.block_hash = block_hash;
+        for (auto& part : parts) file.rows += part.amount;
+        addColumn(file, "hash", COLUMN_BINARY, 20);
+        addColumn(file, "amount", COLUMN_UINT64, 8);
+        addColumn(file, "claimed", COLUMN_BITMAP, 0);
+        if (sectionColumn) addColumn(file, "section", COLUMN_UINT8, 1);
+
+        uint64_t position = COLUMNS_HEADER_SIZE + COLUMN_ENTRY_SIZE * file.columns.size();
+        for (auto& column : file.columns) {
+            column.offset = (position + COLUMN_ALIGNMENT - 1) / COLUMN_ALIGNMENT * COLUMN_ALIGNMENT;
+            position = column.offset + column.length;
+        }
+        uint64_t fileSize = (position + COLUMN_ALIGNMENT - 1) / COLUMN_ALIGNMENT * COLUMN_ALIGNMENT;
+
+        int fd = open(name.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0644);
+        if (fd < 0) return false;
+        if (ftruncate(fd, fileSize) != 0) {
+            close(fd);
+            return false;
+        }
+
+        // claimed bits of neighbouring ranges can share a byte, so they are collected here and written last
+        vector<uint8_t> claimed(file.columns[2].length, 0);
+        bool ok = true;
+        mutex failed;
+        uint64_t base = 0;
+        for (size_t p = 0; p < parts.size(); p++) {
+            const SnapshotEntryCollection& part = parts[p];
+            vector<pair<int64_t, int64_t> > ranges = part.pageRanges();
+            pool.parallelFor(ranges.size(), 1, [&](uint64_t first, uint64_t last) {
+                vector<uint8_t> hashes, amounts, types;
+                for (uint64_t r = first; r < last; r++) {
+                    int64_t begin = ranges[r].first, end = ranges[r].second;
+                    uint64_t count = end - begin;
+                    hashes.resize(count * 20);
+                    amounts.resize(count * 8);
+                    types.assign(count, sections[p]);
+
+                    uint64_t n = 0;
+                    SnapshotEntryCollection::scan_iterator stop = part.scanEnd(end);
+                    SnapshotEntryCollection::scan_iterator i = part.scanBegin(begin, end);
+                    for (; i != stop; ++i, n++) {
+                        memcpy(&hashes[n * 20], &i->hash[0], 20);
+                        memcpy(&amounts[n * 8], &i->amount, 8);
+                        if (i->claimed) {
+                            uint64_t row = base + begin + n;
+                            __atomic_fetch_or(&claimed[row / 8], (uint8_t) (1 << (row % 8)), __ATOMIC_RELAXED);
+                        }
+                    }
+
+                    uint64_t row = base + begin;
+                    bool written = ! i.failed() && pwriteAll(fd, &hashes[0], hashes.size(), file.columns[0].offset + row * 20)
+                                   && pwriteAll(fd, &amounts[0], amounts.size(), file.columns[1].offset + row * 8)
+                                   && (! sectionColumn
+                                       || pwriteAll(fd, &types[0], types.size(), file.columns[3].offset + row));
+                    if (! written) {
+                        lock_guard<mutex> guard(failed);
+                        ok = false;
+                    }
+                }
+            });
+            base += part.amount;
+        }
+        if (! claimed.empty()) ok = ok && pwriteAll(fd, &claimed[0], claimed.size(), file.columns[2].offset);
+
+        vector<uint8_t> header(COLUMNS_HEADER_SIZE + COLUMN_ENTRY_SIZE * file.columns.size(), 0);
+        uint32_t columnCount = file.columns.size();
+        memcpy(&header[0], COLUMNS_MAGIC, 4);
+        memcpy(&header[4], &COLUMNS_VERSION, 4);
+        memcpy(&header[8], &block_hash[0], 32);
+        memcpy(&header[40], &file.rows, 8);
+        memcpy(&header[48], &columnCount, 4);
+        for (size_t c = 0; c < file.columns.size(); c++) {
+            uint8_t* entry = &header[COLUMNS_HEADER_SIZE + c * COLUMN_ENTRY_SIZE];
+            const column_info& column = file.columns[c];
+            memcpy(entry, column.name.data(), min((size_t) 16, column.name.size()));
+            memcpy(entry + 16, &column.type, 4);
+            memcpy(entry + 20, &column.width, 4);
+            memcpy(entry + 24, &column.offset, 8);
+            memcpy(entry + 32, &column.length, 8);
+        }
+        ok = ok && pwriteAll(fd, &header[0], header.size(), 0);
+        close(fd);
+        return ok;
+    }
+
+    bool exportColumns(const snapshot_reader& reader, const string& prefix, bool combined, unsigned threads)
+    {
+        ThreadPool pool(threads);
+        vector<SnapshotEntryCollection> p2pkh(1, getP2PKHCollection(reader));
+        vector<SnapshotEntryCollection> p2sh(1, getP2SHCollection(reader));
+
+        if (combined) {
+            vector<SnapshotEntryCollection> both;
+            both.push_back(p2pkh[0]);
+            both.push_back(p2sh[0]);
+            vector<uint8_t> sections;
+            sections.push_back(SECTION_P2PKH);
+            sections.push_back(SECTION_P2SH);
+            return writeColumnFile(prefix + COLUMNS_EXTENSION, reader.header.block_hash, both, sections, true, pool);
+        }
+        return writeColumnFile(prefix + ".p2pkh" + COLUMNS_EXTENSION, reader.header.block_hash, p2pkh,
+                               vector<uint8_t>(1, SECTION_P2PKH), false, pool)
+               && writeColumnFile(prefix + ".p2sh" + COLUMNS_EXTENSION, reader.header.block_hash, p2sh,
+                                  vector<uint8_t>(1, SECTION_P2SH), false, pool);
+    }
+
+    bool readColumnDirectory(const string& name, column_file& file)
+    {
+        ifstream in(name, ios::binary);
+        if (! in.is_open()) return false;
+
+        uint8_t header[COLUMNS_HEADER_SIZE];
+        in.read(reinterpret_cast<char*>(header), sizeof(header));
+        uint32_t version, columnCount;
+        memcpy(&version, &header[4], 4);
+        memcpy(&columnCount, &header[48], 4);
+        if (! in || memcmp(header, COLUMNS_MAGIC, 4) != 0 || version != COLUMNS_VERSION || columnCount > 64) {
+            return false;
+        }
+        file.block_hash.assign(header + 8, header + 40);
+        memcpy(&file.rows, &header[40], 8);
+
+        file.columns.resize(columnCount);
+        for (auto& column : file.columns) {
+            uint8_t entry[COLUMN_ENTRY_SIZE];
+            in.read(reinterpret_cast<char*>(entry), sizeof(entry));
+            if (! in) return false;
+            column.name.assign(reinterpret_cast<char*>(entry), strnlen(reinterpret_cast<char*>(entry), 16));
+            memcpy(&column.type, entry + 16, 4);
+            memcpy(&column.width, entry + 20, 4);
+            memcpy(&column.offset, entry + 24, 8);
+            memcpy(&column.length, entry + 32, 8);
+        }
+        return true;
+    }
+}
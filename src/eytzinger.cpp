@@ -0,0 +1,173 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "bitcoin/bst/common.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include "bitcoin/bst/eytzinger.h"
+#include "bitcoin/bst/claim.h"
+
+using namespace std;
+
+namespace bst {
+
+    static const char INDEX_MAGIC[4] = { 'B', 'S', 'T', 'E' };
+    static const uint32_t INDEX_VERSION = 2;
+
+    void eytzinger_section::init(uint64_t nodes_)
+    {
+        nodes = nodes_;
+        void* memory = 0;
+        size_t size = ((nodes + 1) * 8 + 63) / 64 * 64;
+        if (posix_memalign(&memory, 64, size) != 0) memory = 0;
+        keys = shared_ptr<uint64_t>(static_cast<uint64_t*>(memory), free);
+        indexes.assign(nodes + 1, 0);
+    }
+
+    void eytzinger_section::bounds(const uint8_t* hash, int64_t amount, int64_t& low, int64_t& high, bool& open) const
+    {
+        low = 0;
+        high = amount;
+        open = false;
+        if (nodes == 0) return;
+
+        const uint64_t key = hashPrefix(hash);
+        const uint64_t* tree = keys.get();
+        uint64_t k = 1;
+        while (k <= nodes) {
+            // the 8 nodes three levels below k are tree[8k, 8k + 8), one cache line
+            __builtin_prefetch(tree + k * 8);
+            k = 2 * k + (tree[k] < key);
+        }
+        // k now spells the path, one bit per level with 1 for right. the last left turn was at the first key not
+        // less than the hash's, the last right turn at the last key that is less
+        uint64_t lower = k >> __builtin_ffsll((long long) ~k);
+        uint64_t before = k >> __builtin_ffsll((long long) k);
+
+        if (before) low = indexes[before] + 1;
+        if (! lower) return;
+        if (tree[lower] > key) {
+            high = indexes[lower];
+        } else {
+            high = indexes[lower] + 1;
+            open = true;
+        }
+    }
+
+    // lays sorted samples out in Eytzinger order by walking the tree in order
+    static void fill(eytzinger_section& section, const vector<pair<uint64_t, int64_t> >& samples, size_t& next,
+                     uint64_t k)
+    {
+        if (k > section.nodes) return;
+        fill(section, samples, next, 2 * k);
+        section.keys.get()[k] = samples[next].first;
+        section.indexes[k] = samples[next].second;
+        next++;
+        fill(section, samples, next, 2 * k + 1);
+    }
+
+    bool buildSnapshotIndex(const string& snapshotName, const string& indexName, const uint64_t step)
+    {
+        ifstream stream(snapshotName, ios::binary);
+        snapshot_reader reader;
+        if (step == 0 || ! openSnapshot(stream, reader, snapshotName)) {
+            return false;
+        }
+
+        uint64_t counts[2] = { reader.header.nP2PKH, reader.header.nP2SH };
+        eytzinger_index index;
+        index.header = reader.header;
+        const int size = reader.format->record_size;
+        vector<char> buffer(4096 * size);
+        stream.seekg(reader.format->data_offset);
+        for (int section = 0; section < 2; section++) {
+            vector<pair<uint64_t, int64_t> > samples;
+            samples.reserve(counts[section] / step + 1);
+            for (uint64_t first = 0; first < counts[section]; first += 4096) {
+                uint64_t count = min(counts[section] - first, (uint64_t) 4096);
+                stream.read(&buffer[0], count * size);
+                if (! stream) return false;
+                for (uint64_t i = (first + step - 1) / step * step; i < first + count; i += step) {
+                    samples.push_back(make_pair(hashPrefix(reinterpret_cast<const uint8_t*>(&buffer[(i - first) * size])),
+                                                (int64_t) i));
+                }
+            }
+            eytzinger_section& sectionIndex = index.sections[section];
+            sectionIndex.step = step;
+            sectionIndex.init(samples.size());
+            if (! sectionIndex.keys) return false;
+            size_t next = 0;
+            fill(sectionIndex, samples, next, 1);
+        }
+
+        ofstream out(indexName.empty() ? snapshotName + INDEX_EXTENSION : indexName, ios::binary);
+        out.write(INDEX_MAGIC, 4);
+        out.write(reinterpret_cast<const char*>(&INDEX_VERSION), sizeof(INDEX_VERSION));
+        out.write(reinterpret_cast<const char*>(&index.header.block_hash[0]), 32);
+        out.write(reinterpret_cast<const char*>(&index.header.nP2PKH), sizeof(index.header.nP2PKH));
+        out.write(reinterpret_cast<const char*>(&index.header.nP2SH), sizeof(index.header.nP2SH));
+        out.write(reinterpret_cast<const char*>(&index.header.fingerprint), sizeof(index.header.fingerprint));
+        for (int section = 0; section < 2; section++) {
+            const eytzinger_section& sectionIndex = index.sections[section];
+            out.write(reinterpret_cast<const char*>(&sectionIndex.step), sizeof(sectionIndex.step));
+            out.write(reinterpret_cast<const char*>(&sectionIndex.nodes), sizeof(sectionIndex.nodes));
+            out.write(reinterpret_cast<const char*>(sectionIndex.keys.get() + 1), sectionIndex.nodes * 8);
+            out.write(reinterpret_cast<const char*>(sectionIndex.indexes.data() + 1), sectionIndex.nodes * 8);
+        }
+        out.close();
+        return ! out.fail();
+    }
+
+    bool readSnapshotIndex(eytzinger_index& index, const snapshot_header& header, const string& indexName)
+    {
+        ifstream in(indexName, ios::binary);
+        if (! in.is_open()) return false;
+
+        char magic[4];
+        uint32_t version = 0;
+        in.read(magic, 4);
+        in.read(reinterpret_cast<char*>(&version), sizeof(version));
+        if (! in || memcmp(magic, INDEX_MAGIC, 4) != 0 || version != INDEX_VERSION) return false;
+
+        in.read(reinterpret_cast<char*>(&index.header.block_hash[0]), 32);
+        in.read(reinterpret_cast<char*>(&index.header.nP2PKH), sizeof(index.header.nP2PKH));
+        in.read(reinterpret_cast<char*>(&index.header.nP2SH), sizeof(index.header.nP2SH));
+        in.read(reinterpret_cast<char*>(&index.header.fingerprint), sizeof(index.header.fingerprint));
+        if (! in || index.header.block_hash != header.block_hash || index.header.nP2PKH != header.nP2PKH
+            || index.header.nP2SH != header.nP2SH || index.header.fingerprint != header.fingerprint) {
+            return false;
+        }
+
+        uint64_t counts[2] = { header.nP2PKH, header.nP2SH };
+        for (int section = 0; section < 2; section++) {
+            eytzinger_section& sectionIndex = index.sections[section];
+            uint64_t nodes = 0;
+            in.read(reinterpret_cast<char*>(&sectionIndex.step), sizeof(sectionIndex.step));
+            in.read(reinterpret_cast<char*>(&nodes), sizeof(nodes));
+            if (! in || sectionIndex.step == 0 || nodes > counts[section]) return false;
+            sectionIndex.init(nodes);
+            if (! sectionIndex.keys) return false;
+            in.read(reinterpret_cast<char*>(sectionIndex.keys.get() + 1), nodes * 8);
+            in.read(reinterpret_cast<char*>(sectionIndex.indexes.data() + 1), nodes * 8);
+            if (! in) return false;
+            for (uint64_t k = 1; k <= nodes; k++) {
+                if (sectionIndex.indexes[k] < 0 || (uint64_t) sectionIndex.indexes[k] >= counts[section]) return false;
+            }
+        }
+        return true;
+    }
+}
@@ -0,0 +1,158 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include "bitcoin/bst/filter.h"
+#include "bitcoin/bst/claim.h"
+
+using namespace std;
+
+namespace bst {
+
+    static const char FILTER_MAGIC[4] = { 'B', 'S', 'T', 'F' };
+    static const uint32_t FILTER_VERSION = 2;
+    static const int WORDS_PER_BLOCK = 8;
+
+    // snapshot hashes are already uniformly distributed, mixing only guards against odd non-standard entries
+    static inline uint64_t mix(uint64_t x)
+    {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        return x;
+    }
+
+    static inline void blockAndBits(const uint8_t* hash, uint64_t blocks, uint64_t& block, uint64_t& bits)
+    {
+        uint64_t first, second;
+        memcpy(&first, hash, sizeof(first));
+        memcpy(&second, hash + 8, sizeof(second));
+        block = (uint64_t) (((unsigned __int128) mix(first) * blocks) >> 64);
+        bits = mix(second);
+    }
+
+    static uint64_t blocksFor(uint64_t entries)
+    {
+        uint64_t bitsWanted = entries * FILTER_BITS_PER_KEY;
+        return max((bitsWanted + 511) / 512, (uint64_t) 1);
+    }
+
+    void section_filter::init(uint64_t entries)
+    {
+        blocks = blocksFor(entries);
+        words.assign(blocks * WORDS_PER_BLOCK, 0);
+    }
+
+    void section_filter::add(const uint8_t* hash)
+    {
+        uint64_t block, bits;
+        blockAndBits(hash, blocks, block, bits);
+        uint64_t* word = &words[block * WORDS_PER_BLOCK];
+        for (int i = 0; i < WORDS_PER_BLOCK; i++) {
+            word[i] |= (uint64_t) 1 << ((bits >> (i * 6)) & 63);
+        }
+    }
+
+    bool section_filter::mayContain(const uint8_t* hash) const
+    {
+        uint64_t block, bits;
+        blockAndBits(hash, blocks, block, bits);
+        const uint64_t* word = &words[block * WORDS_PER_BLOCK];
+        for (int i = 0; i < WORDS_PER_BLOCK; i++) {
+            if (! (word[i] & ((uint64_t) 1 << ((bits >> (i * 6)) & 63)))) return false;
+        }
+        return true;
+    }
+
+    bool buildSnapshotFilter(const string& snapshotName, const string& filterName)
+    {
+        ifstream stream(snapshotName, ios::binary);
+        snapshot_reader reader;
+        if (! openSnapshot(stream, reader, snapshotName)) {
+            return false;
+        }
+
+        uint64_t counts[2] = { reader.header.nP2PKH, reader.header.nP2SH };
+        snapshot_filter filter;
+        filter.header = reader.header;
+        const int size = reader.format->record_size;
+        vector<char> buffer(4096 * size);
+        stream.seekg(reader.format->data_offset);
+        for (int section = 0; section < 2; section++) {
+            filter.sections[section].init(counts[section]);
+            uint64_t remaining = counts[section];
+            while (remaining > 0) {
+                uint64_t count = min(remaining, (uint64_t) 4096);
+                stream.read(&buffer[0], count * size);
+                if (! stream) return false;
+                for (uint64_t i = 0; i < count; i++) {
+                    filter.sections[section].add(reinterpret_cast<const uint8_t*>(&buffer[i * size]));
+                }
+                remaining -= count;
+            }
+        }
+
+        ofstream out(filterName.empty() ? snapshotName + FILTER_EXTENSION : filterName, ios::binary);
+        out.write(FILTER_MAGIC, 4);
+        out.write(reinterpret_cast<const char*>(&FILTER_VERSION), sizeof(FILTER_VERSION));
+        out.write(reinterpret_cast<const char*>(&filter.header.block_hash[0]), 32);
+        out.write(reinterpret_cast<const char*>(&filter.header.nP2PKH), sizeof(filter.header.nP2PKH));
+        out.write(reinterpret_cast<const char*>(&filter.header.nP2SH), sizeof(filter.header.nP2SH));
+        out.write(reinterpret_cast<const char*>(&filter.header.fingerprint), sizeof(filter.header.fingerprint));
+        for (int section = 0; section < 2; section++) {
+            const section_filter& sectionFilter = filter.sections[section];
+            out.write(reinterpret_cast<const char*>(&sectionFilter.blocks), sizeof(sectionFilter.blocks));
+            out.write(reinterpret_cast<const char*>(&sectionFilter.words[0]), sectionFilter.words.size() * 8);
+        }
+        out.close();
+        return ! out.fail();
+    }
+
+    bool readSnapshotFilter(snapshot_filter& filter, const snapshot_header& header, const string& filterName)
+    {
+        ifstream in(filterName, ios::binary);
+        if (! in.is_open()) return false;
+
+        char magic[4];
+        uint32_t version = 0;
+        in.read(magic, 4);
+        in.read(reinterpret_cast<char*>(&version), sizeof(version));
+        if (! in || memcmp(magic, FILTER_MAGIC, 4) != 0 || version != FILTER_VERSION) return false;
+
+        in.read(reinterpret_cast<char*>(&filter.header.block_hash[0]), 32);
+        in.read(reinterpret_cast<char*>(&filter.header.nP2PKH), sizeof(filter.header.nP2PKH));
+        in.read(reinterpret_cast<char*>(&filter.header.nP2SH), sizeof(filter.header.nP2SH));
+        in.read(reinterpret_cast<char*>(&filter.header.fingerprint), sizeof(filter.header.fingerprint));
+        if (! in || filter.header.block_hash != header.block_hash || filter.header.nP2PKH != header.nP2PKH
+            || filter.header.nP2SH != header.nP2SH || filter.header.fingerprint != header.fingerprint) {
+            return false;
+        }
+
+        for (int section = 0; section < 2; section++) {
+            section_filter& sectionFilter = filter.sections[section];
+            in.read(reinterpret_cast<char*>(&sectionFilter.blocks), sizeof(sectionFilter.blocks));
+            // the size follows from the section's entry count, so a corrupt count is caught before allocating for it
+            uint64_t entries = section == 0 ? header.nP2PKH : header.nP2SH;
+            if (! in || sectionFilter.blocks != blocksFor(entries)) return false;
+            sectionFilter.words.resize(sectionFilter.blocks * WORDS_PER_BLOCK);
+            in.read(reinterpret_cast<char*>(&sectionFilter.words[0]), sectionFilter.words.size() * 8);
+            if (! in) return false;
+        }
+        return true;
+    }
+}
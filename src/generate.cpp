@@ -16,6 +16,9 @@
 
 #include <bitcoin/bitcoin.hpp>
 #include "bitcoin/bst/generate.h"
+#include "bitcoin/bst/filter.h"
+#include "bitcoin/bst/eytzinger.h"
+#include "bitcoin/bst/perfect_hash.h"
 #include "sqlite3.h"
 
 using namespace std;
@@ -338,7 +341,7 @@ namespace bst {
         return true;
     }
 
-    bool writeSnapshotFromSqlite(const uint256_t& blockhash, const uint64_t dustLimit)
+    bool writeSnapshotFromSqlite(const uint256_t& blockhash, const uint64_t dustLimit, const snapshot_options& options)
     {
         sqlite3 *db;
         char *zErrMsg = 0;
@@ -351,13 +354,19 @@ namespace bst {
             return false;
         }
 
-        snapshot_header header = snapshot_header();
-        ofstream snapshot;
-        snapshot.open(SNAPSHOT_NAME, ios::binary);
+        // sidecars of the snapshot being replaced go first, so none is left behind if writing stops part way
+        remove(SNAPSHOT_FILTER_NAME.c_str());
+        remove(SNAPSHOT_INDEX_NAME.c_str());
+        remove(SNAPSHOT_PERFECT_HASH_NAME.c_str());
+
+        snapshot_writer writer;
+        if (! openSnapshotWriter(writer, blockhash, SNAPSHOT_NAME, options.version, options.model_error)) {
+            sqlite3_close(db);
+            return false;
+        }
 
         // write all p2pkh to snapshot
         sqlite3_stmt* stmt;
-        snapshot.seekp(HEADER_SIZE);
         rc = sqlite3_prepare_v2(db, GET_ALL_P2PKH.c_str(), -1, &stmt, NULL);
         if( rc!=SQLITE_OK ){
             cout << "Could not prepare statement for getting all p2pkh " << rc << endl;
@@ -376,16 +385,14 @@ namespace bst {
             stringstream ss;
             ss << keyCString;
             vector<uint8_t> hashVec;
-            if ( ! decodeVector(ss.str(), hashVec))
+            if ( ! decodeVector(ss.str(), hashVec) || hashVec.size() != 20)
             {
                 cout << "error decoding " << ss.str() << endl;
                 return 0;
             }
-            copy(hashVec.begin(), hashVec.end(), ostream_iterator<uint8_t>(snapshot));
 
             uint64_t amount = sqlite3_column_int64(stmt, 1);
-            snapshot.write(reinterpret_cast<const char*>(&amount), sizeof(amount));
-            header.nP2PKH++;
+            writeSnapshotEntry(writer, SECTION_P2PKH, &hashVec[0], amount);
         }
 
         if (SQLITE_DONE != rc)
@@ -414,16 +421,14 @@ namespace bst {
             ss << keyCString;
             bc::data_chunk chunk;
 
-            if ( ! bc::decode_base16(chunk, ss.str()))
+            if ( ! bc::decode_base16(chunk, ss.str()) || chunk.size() != 20)
             {
                 cout << "error decoding " << ss.str() << endl;
                 return 0;
             }
-            copy(chunk.begin(), chunk.end(), ostream_iterator<uint8_t>(snapshot));
 
             uint64_t amount = sqlite3_column_int64(stmt, 1);
-            snapshot.write(reinterpret_cast<const char*>(&amount), sizeof(amount));
-            header.nP2SH++;
+            writeSnapshotEntry(writer, SECTION_P2SH, &chunk[0], amount);
         }
 
         if (SQLITE_DONE != rc)
@@ -434,22 +439,75 @@ namespace bst {
 
         sqlite3_close(db);
 
-        // write snapshot header
-        snapshot.seekp(0);
-        snapshot.write(reinterpret_cast<const char*>(&header.version), sizeof(header.version));
-        copy(header.block_hash.begin(), header.block_hash.end(), ostream_iterator<uint8_t>(snapshot));
-        snapshot.write(reinterpret_cast<const char*>(&header.nP2PKH), sizeof(header.nP2PKH));
-        snapshot.write(reinterpret_cast<const char*>(&header.nP2SH), sizeof(header.nP2SH));
-
-        snapshot.flush();
-        snapshot.close();
+        // write snapshot header and claim bitfield file
+        if (! closeSnapshotWriter(writer)) return false;
 
-        // write claim bitfield file
-        resetClaims(header);
+        bool built = true;
+        if (options.write_index) built = buildSnapshotIndex() && built;
+        if (options.write_filter) built = buildSnapshotFilter() && built;
+        return built;
+    }
 
+    bool openSnapshotWriter(snapshot_writer& writer, const uint256_t& blockhash, const string& name,
+                            const uint32_t version, const uint32_t modelError)
+    {
+        writer.model_error = modelError;
+        for (int section = 0; section < 2; section++) writer.models[section] = SplineBuilder(modelError);
+        writer.format = recordFormat(version);
+        if (! writer.format) return false;
+        writer.header = snapshot_header();
+        writer.header.version = version;
+        if (blockhash.size() == writer.header.block_hash.size()) writer.header.block_hash = blockhash;
+
+        // entries are tiny, so give the stream a buffer big enough for whole disk blocks
+        writer.buffer.resize(1 << 20);
+        writer.snapshot.rdbuf()->pubsetbuf(&writer.buffer[0], writer.buffer.size());
+        writer.snapshot.open(name, ios::binary);
+        if (! writer.snapshot.is_open()) return false;
+        // any gap up to the first record is zero filled once the header is written
+        writer.snapshot.seekp(writer.format->data_offset);
         return true;
     }
 
+    void writeSnapshotEntry(snapshot_writer& writer, const snapshot_section section, const uint8_t* hash,
+                            const uint64_t amount)
+    {
+        uint8_t record[MAX_RECORD_SIZE];
+        writer.format->encode(record, hash, amount);
+        writer.snapshot.write(reinterpret_cast<const char*>(record), writer.format->record_size);
+        if (writer.model_error > 0) writer.models[section].add(hash);
+        if (section == SECTION_P2PKH) {
+            writer.header.nP2PKH++;
+        } else {
+            writer.header.nP2SH++;
+        }
+    }
+
+    bool closeSnapshotWriter(snapshot_writer& writer, const string& claimedName)
+    {
+        snapshot_header& header = writer.header;
+        if (writer.model_error > 0) {
+            snapshot_model model;
+            for (int section = 0; section < 2; section++) writer.models[section].finish(model.sections[section]);
+            vector<uint8_t> trailer;
+            encodeSnapshotModel(model, trailer);
+            writer.snapshot.write(reinterpret_cast<const char*>(&trailer[0]), trailer.size());
+        }
+        writer.snapshot.seekp(0);
+        writer.snapshot.write(reinterpret_cast<const char*>(&header.version), sizeof(header.version));
+        copy(header.block_hash.begin(), header.block_hash.end(), ostream_iterator<uint8_t>(writer.snapshot));
+        writer.snapshot.write(reinterpret_cast<const char*>(&header.nP2PKH), sizeof(header.nP2PKH));
+        writer.snapshot.write(reinterpret_cast<const char*>(&header.nP2SH), sizeof(header.nP2SH));
+
+        writer.snapshot.flush();
+        bool ok = ! writer.snapshot.fail();
+        writer.snapshot.close();
+
+        // write claim bitfield file
+        bool reset = resetClaims(header, claimedName);
+        return ok && reset;
+    }
+
     bool writeSnapshot(snapshot_preparer& preparer, const vector<uint8_t>& blockhash, const uint64_t dustLimit)
     {
         bool result = writeJustSqlite(preparer)
@@ -0,0 +1,299 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <array>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <bitcoin/bitcoin.hpp>
+#include "bitcoin/bst/import.h"
+#include "bitcoin/bst/generate.h"
+#include "bitcoin/bst/thread_pool.h"
+#include "bitcoin/bst/filter.h"
+#include "bitcoin/bst/eytzinger.h"
+#include "bitcoin/bst/perfect_hash.h"
+
+using namespace std;
+
+namespace bst {
+
+    struct import_record
+    {
+        uint8_t hash[20];
+        uint64_t amount;
+    };
+
+    // per chunk results, merged once every chunk is parsed
+    struct import_chunk
+    {
+        vector<import_record> sections[2];
+        uint64_t lines;
+        uint64_t invalid;
+        uint64_t first_invalid;
+
+        import_chunk() : lines(0), invalid(0), first_invalid(0) {}
+    };
+
+    static const string BASE58_ALPHABET = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+
+    bool decodeAddress(const char* text, size_t length, uint8_t& version, uint8_t* hash)
+    {
+        static const vector<int8_t> digits = [] {
+            vector<int8_t> table(256, -1);
+            for (size_t d = 0; d < BASE58_ALPHABET.size(); d++) table[(uint8_t) BASE58_ALPHABET[d]] = (int8_t) d;
+            return table;
+        }();
+        if (length == 0 || length > 35) return false;
+
+        // the number lands in seven big endian 32 bit words, of which only the last 25 bytes may be used
+        uint32_t words[7] = { 0 };
+        for (size_t c = 0; c < length; c++) {
+            int digit = digits[(uint8_t) text[c]];
+            if (digit < 0) return false;
+            uint64_t carry = digit;
+            for (int w = 6; w >= 0; w--) {
+                uint64_t current = (uint64_t) words[w] * 58 + carry;
+                words[w] = (uint32_t) current;
+                carry = current >> 32;
+            }
+            if (carry) return false;
+        }
+        uint8_t bytes[28];
+        for (int w = 0; w < 7; w++) {
+            bytes[w * 4] = (uint8_t) (words[w] >> 24);
+            bytes[w * 4 + 1] = (uint8_t) (words[w] >> 16);
+            bytes[w * 4 + 2] = (uint8_t) (words[w] >> 8);
+            bytes[w * 4 + 3] = (uint8_t) words[w];
+        }
+        if (bytes[0] || bytes[1] || bytes[2]) return false;
+
+        // each leading '1' stands for exactly one leading zero byte
+        size_t ones = 0;
+        while (ones < length && text[ones] == '1') ones++;
+        size_t zeros = 0;
+        while (zeros < 25 && bytes[3 + zeros] == 0) zeros++;
+        if (ones != zeros) return false;
+
+        array<uint8_t, 21> body;
+        copy(bytes + 3, bytes + 24, body.begin());
+        bc::hash_digest checksum = bc::bitcoin_hash(body);
+        if (memcmp(&checksum[0], bytes + 24, 4) != 0) return false;
+
+        version = bytes[3];
+        memcpy(hash, bytes + 4, 20);
+        return true;
+    }
+
+    static int hexValue(char c)
+    {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    static bool parseAmount(const char* text, size_t length, uint64_t& amount)
+    {
+        if (length == 0 || length > 20) return false;
+        amount = 0;
+        for (size_t c = 0; c < length; c++) {
+            if (text[c] < '0' || text[c] > '9') return false;
+            uint64_t next = amount * 10 + (text[c] - '0');
+            if (next / 10 != amount) return false;
+            amount = next;
+        }
+        return true;
+    }
+
+    static inline bool isSpace(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    // parses one line without its newline. false means the line is malformed
+    static bool parseLine(const char* line, size_t length, const import_options& options, import_chunk& chunk)
+    {
+        const char* end = line + length;
+        while (line < end && isSpace(*line)) line++;
+        while (end > line && isSpace(end[-1])) end--;
+        if (line == end) return true;
+
+        const char* separator = line;
+        while (separator < end && *separator != ',' && *separator != '\t' && *separator != ' ') separator++;
+        if (separator == end) return false;
+        const char* address = line;
+        const char* addressEnd = separator;
+        while (addressEnd > address && isSpace(addressEnd[-1])) addressEnd--;
+        const char* amountText = separator + 1;
+        while (amountText < end && isSpace(*amountText)) amountText++;
+
+        import_record record;
+        if (! parseAmount(amountText, end - amountText, record.amount)) return false;
+
+        size_t addressLength = addressEnd - address;
+        snapshot_section section;
+        if (addressLength == 40) {
+            for (int b = 0; b < 20; b++) {
+                int high = hexValue(address[b * 2]), low = hexValue(address[b * 2 + 1]);
+                if (high < 0 || low < 0) return false;
+                record.hash[b] = (uint8_t) (high << 4 | low);
+            }
+            section = options.hex_section;
+        } else {
+            uint8_t version;
+            if (! decodeAddress(address, addressLength, version, record.hash)) return false;
+            if (version == 0 || version == 111) {
+                section = SECTION_P2PKH;
+            } else if (version == 5 || version == 196) {
+                section = SECTION_P2SH;
+            } else {
+                return false;
+            }
+        }
+        chunk.sections[section].push_back(record);
+        return true;
+    }
+
+    // moves position forward to the start of the next line, unless it already is one
+    static uint64_t lineStart(const char* data, uint64_t size, uint64_t position)
+    {
+        if (position == 0) return 0;
+        while (position < size && data[position - 1] != '\n') position++;
+        return position;
+    }
+
+    static void parseChunk(const char* data, uint64_t size, uint64_t begin, uint64_t end,
+                           const import_options& options, import_chunk& chunk)
+    {
+        uint64_t position = begin;
+        while (position < end) {
+            const char* newline = (const char*) memchr(data + position, '\n', end - position);
+            uint64_t lineEnd = newline ? newline - data : end;
+            chunk.lines++;
+            if (! parseLine(data + position, lineEnd - position, options, chunk)) {
+                // a header is the only bad line allowed, and only as the very first line
+                bool header = position == 0 && chunk.lines == 1;
+                if (! header) {
+                    if (chunk.invalid == 0) chunk.first_invalid = position;
+                    chunk.invalid++;
+                }
+                if (header) chunk.lines--;
+            }
+            position = lineEnd + 1;
+        }
+    }
+
+    static bool recordLess(const import_record& a, const import_record& b)
+    {
+        return memcmp(a.hash, b.hash, 20) < 0;
+    }
+
+    bool importBalances(const string& inputName, const uint256_t& blockhash, const import_options& options,
+                        import_stats& stats, const string& snapshotName, const string& claimedName)
+    {
+        stats = import_stats();
+        int fd = open(inputName.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return false;
+        }
+        uint64_t size = st.st_size;
+        const char* data = 0;
+        if (size > 0) {
+            void* mapping = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                close(fd);
+                return false;
+            }
+            data = (const char*) mapping;
+            madvise(mapping, size, MADV_SEQUENTIAL);
+        }
+        close(fd);
+
+        ThreadPool pool(options.threads);
+
+        // chunks of at least a megabyte, a few per thread, cut at line starts
+        uint64_t chunkCount = max((uint64_t) 1, min((uint64_t) pool.size() * 8, size / (1 << 20)));
+        vector<import_chunk> chunks(chunkCount);
+        pool.parallelFor(chunkCount, 1, [&](uint64_t first, uint64_t last) {
+            for (uint64_t c = first; c < last; c++) {
+                uint64_t begin = lineStart(data, size, size * c / chunkCount);
+                uint64_t end = lineStart(data, size, size * (c + 1) / chunkCount);
+                parseChunk(data, size, begin, end, options, chunks[c]);
+            }
+        });
+        if (data) munmap((void*) data, size);
+
+        vector<import_record> sections[2];
+        for (auto& chunk : chunks) {
+            stats.lines += chunk.lines;
+            if (chunk.invalid > 0 && stats.invalid == 0) stats.first_invalid = chunk.first_invalid;
+            stats.invalid += chunk.invalid;
+        }
+        if (stats.invalid > 0 && ! options.skip_invalid) return false;
+
+        for (int s = 0; s < 2; s++) {
+            vector<import_record>& records = sections[s];
+            size_t total = 0;
+            for (auto& chunk : chunks) total += chunk.sections[s].size();
+            records.reserve(total);
+            for (auto& chunk : chunks) {
+                records.insert(records.end(), chunk.sections[s].begin(), chunk.sections[s].end());
+                vector<import_record>().swap(chunk.sections[s]);
+            }
+            parallelSort(pool, records.begin(), records.end(), recordLess);
+
+            // sum runs of the same hash in place, then drop whatever is under the dust limit
+            size_t kept = 0;
+            for (size_t i = 0; i < records.size(); ) {
+                import_record merged = records[i];
+                size_t j = i + 1;
+                for (; j < records.size() && memcmp(records[j].hash, merged.hash, 20) == 0; j++) {
+                    if (merged.amount + records[j].amount < merged.amount) return false;
+                    merged.amount += records[j].amount;
+                    stats.merged++;
+                }
+                i = j;
+                if (merged.amount < options.dust_limit) {
+                    stats.dust++;
+                    continue;
+                }
+                records[kept++] = merged;
+            }
+            records.resize(kept);
+        }
+
+        // a filter or index left from an earlier snapshot goes before it is overwritten, even if writing fails
+        remove((snapshotName + FILTER_EXTENSION).c_str());
+        remove((snapshotName + INDEX_EXTENSION).c_str());
+        remove((snapshotName + PERFECT_HASH_EXTENSION).c_str());
+
+        snapshot_writer writer;
+        if (! openSnapshotWriter(writer, blockhash, snapshotName, options.version, options.model_error)) return false;
+        for (int s = 0; s < 2; s++) {
+            for (auto& record : sections[s]) {
+                writeSnapshotEntry(writer, (snapshot_section) s, record.hash, record.amount);
+            }
+        }
+        stats.p2pkh = writer.header.nP2PKH;
+        stats.p2sh = writer.header.nP2SH;
+        return closeSnapshotWriter(writer, claimedName);
+    }
+}
@@ -0,0 +1,291 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+#include "bitcoin/bst/journal.h"
+
+using namespace std;
+
+namespace bst {
+
+    static uint32_t checksum(const uint8_t* data, size_t length)
+    {
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < length; i++) {
+            hash ^= data[i];
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+
+    static void encodeRecord(uint8_t* record, snapshot_section section, int64_t index, const uint256_t& transaction)
+    {
+        memset(record, 0, JOURNAL_RECORD_SIZE);
+        record[4] = (uint8_t) section;
+        if (transaction.size() == 32) {
+            record[5] = 1;
+            copy(transaction.begin(), transaction.end(), record + 16);
+        }
+        memcpy(record + 8, &index, sizeof(index));
+        uint32_t sum = checksum(record + 4, JOURNAL_RECORD_SIZE - 4);
+        memcpy(record, &sum, sizeof(sum));
+    }
+
+    static bool writeAll(int fd, const uint8_t* data, size_t length)
+    {
+        while (length > 0) {
+            ssize_t written = write(fd, data, length);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += written;
+            length -= written;
+        }
+        return true;
+    }
+
+    ClaimJournal::ClaimJournal() : fd(-1), bitfield(0), p2sh_offset(0), journal_size(0), appended(0), committed(0),
+                                   stopping(false), failed(false), replayed_records(0), commit_count(0),
+                                   checkpoint_failures(0) {}
+
+    ClaimJournal::~ClaimJournal()
+    {
+        close();
+    }
+
+    bool ClaimJournal::open(const snapshot_header& header, claim_bitfield& bitfield_,
+                            const journal_options& options_, const string& name)
+    {
+        bitfield = &bitfield_;
+        p2sh_offset = header.nP2PKH;
+        options = options_;
+
+        fd = ::open(name.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) {
+            return false;
+        }
+
+        if (! replay()) {
+            ::close(fd);
+            fd = -1;
+            return false;
+        }
+
+        stopping = false;
+        failed = false;
+        committer = thread(&ClaimJournal::commitLoop, this);
+        return true;
+    }
+
+    void ClaimJournal::close()
+    {
+        if (fd < 0) return;
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        work_ready.notify_all();
+        committer.join();
+        ::close(fd);
+        fd = -1;
+    }
+
+    bool ClaimJournal::append(snapshot_section section, int64_t index, const uint256_t& transaction)
+    {
+        unique_lock<mutex> guard(lock);
+        if (failed || stopping) return false;
+
+        size_t position = pending.size();
+        pending.resize(position + JOURNAL_RECORD_SIZE);
+        encodeRecord(&pending[position], section, index, transaction);
+        uint64_t ticket = ++appended;
+
+        if (pending.size() / JOURNAL_RECORD_SIZE >= options.max_batch) {
+            work_ready.notify_one();
+        } else if (position == 0) {
+            // first claim of a group starts the latency clock
+            work_ready.notify_one();
+        }
+
+        work_done.wait(guard, [&] { return committed >= ticket || failed; });
+        return committed >= ticket;
+    }
+
+    bool ClaimJournal::reserve(snapshot_section section, const vector<int64_t>& indexes, vector<bool>& taken,
+                               uint64_t& ticket)
+    {
+        taken.assign(indexes.size(), false);
+        ticket = 0;
+        lock_guard<mutex> guard(lock);
+        if (failed || stopping) return false;
+
+        for (size_t i = 0; i < indexes.size(); i++) {
+            uint64_t bit = section == SECTION_P2SH ? p2sh_offset + indexes[i] : indexes[i];
+            // isClaimed also turns away entries outside the bitfield
+            if (indexes[i] < 0 || isClaimed(*bitfield, bit) || ! reserved.insert(bit).second) {
+                taken[i] = true;
+                continue;
+            }
+            size_t position = pending.size();
+            pending.resize(position + JOURNAL_RECORD_SIZE);
+            encodeRecord(&pending[position], section, indexes[i], uint256_t());
+            ticket = ++appended;
+        }
+        if (ticket) work_ready.notify_one();
+        return true;
+    }
+
+    bool ClaimJournal::wait(uint64_t ticket)
+    {
+        unique_lock<mutex> guard(lock);
+        work_done.wait(guard, [&] { return committed >= ticket || failed; });
+        return committed >= ticket;
+    }
+
+    void ClaimJournal::commitLoop()
+    {
+        vector<uint8_t> group;
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            work_ready.wait(guard, [&] { return ! pending.empty() || stopping; });
+            if (pending.empty() && stopping) break;
+
+            // let the group fill up until the latency budget or the size budget runs out
+            auto deadline = chrono::steady_clock::now() + chrono::microseconds(options.max_latency_us);
+            work_ready.wait_until(guard, deadline, [&] {
+                return pending.size() / JOURNAL_RECORD_SIZE >= options.max_batch || stopping;
+            });
+
+            group.swap(pending);
+            pending.clear();
+            uint64_t ticket = appended;
+            guard.unlock();
+
+            bool ok = writeAll(fd, &group[0], group.size()) && fdatasync(fd) == 0;
+
+            // the claims are durable in the journal, so the appenders go now and the bitfield catches up behind them
+            guard.lock();
+            commit_count++;
+            if (ok) {
+                committed = ticket;
+            } else {
+                failed = true;
+                release(group);
+            }
+            work_done.notify_all();
+            if (failed) break;
+            guard.unlock();
+
+            apply(group);
+            journal_size += group.size();
+            // a failed checkpoint leaves the journal whole, so nothing is lost and the next commit tries again
+            if (options.checkpoint_bytes && journal_size >= options.checkpoint_bytes && ! checkpoint()) {
+                checkpoint_failures++;
+            }
+            guard.lock();
+            release(group);
+        }
+    }
+
+    uint64_t ClaimJournal::apply(const vector<uint8_t>& records)
+    {
+        uint64_t rejected = 0;
+        for (size_t i = 0; i + JOURNAL_RECORD_SIZE <= records.size(); i += JOURNAL_RECORD_SIZE) {
+            const uint8_t* record = &records[i];
+            int64_t index;
+            memcpy(&index, record + 8, sizeof(index));
+            uint64_t bit = recordBit(record);
+            // a record for an entry the bitfield doesn't have was written against some other snapshot
+            if (index < 0 || bit >= bitfield->size * 8) {
+                rejected++;
+                continue;
+            }
+            testAndSetClaimed(*bitfield, bit);
+        }
+        return rejected;
+    }
+
+    void ClaimJournal::release(const vector<uint8_t>& records)
+    {
+        if (reserved.empty()) return;
+        for (size_t i = 0; i + JOURNAL_RECORD_SIZE <= records.size(); i += JOURNAL_RECORD_SIZE) {
+            reserved.erase(recordBit(&records[i]));
+        }
+    }
+
+    uint64_t ClaimJournal::recordBit(const uint8_t* record) const
+    {
+        int64_t index;
+        memcpy(&index, record + 8, sizeof(index));
+        return record[4] == SECTION_P2SH ? p2sh_offset + index : index;
+    }
+
+    // everything written so far has been applied, so once the bitfield is on disk the journal can start over
+    bool ClaimJournal::checkpoint()
+    {
+        if (! syncClaimBitfield(*bitfield)) return false;
+        if (ftruncate(fd, 0) != 0) return false;
+        journal_size = 0;
+        return true;
+    }
+
+    bool ClaimJournal::replay()
+    {
+        vector<uint8_t> records;
+        uint8_t buffer[JOURNAL_RECORD_SIZE * 256];
+        lseek(fd, 0, SEEK_SET);
+        bool torn = false;
+        struct stat st;
+        if (fstat(fd, &st) != 0) return false;
+        // only what was written before we opened, which also keeps a device that never ends from being read forever
+        ssize_t bytes = 0;
+        while (records.size() < (uint64_t) st.st_size &&
+               (bytes = read(fd, buffer, min(sizeof(buffer), (size_t) (st.st_size - records.size())))) > 0) {
+            records.insert(records.end(), buffer, buffer + bytes);
+        }
+        if (bytes < 0) return false;
+
+        // stop at the first record that was only partly written when we went down
+        size_t valid = 0;
+        while (valid + JOURNAL_RECORD_SIZE <= records.size()) {
+            uint32_t sum;
+            memcpy(&sum, &records[valid], sizeof(sum));
+            if (sum != checksum(&records[valid + 4], JOURNAL_RECORD_SIZE - 4)) {
+                torn = true;
+                break;
+            }
+            valid += JOURNAL_RECORD_SIZE;
+        }
+        if (valid != records.size()) torn = true;
+        records.resize(valid);
+
+        // keep the journal as it is rather than checkpoint away claims that belong elsewhere
+        if (apply(records) != 0) return false;
+        replayed_records = valid / JOURNAL_RECORD_SIZE;
+        journal_size = valid;
+
+        if (replayed_records > 0 || torn) {
+            return checkpoint();
+        }
+        return true;
+    }
+}
@@ -20,6 +20,7 @@
 #include <bitcoin/bitcoin/wallet/message.hpp>
 #include <bitcoin/bitcoin/formats/base64.hpp>
 #include "bitcoin/bst/generate.h"
+#include "bitcoin/bst/misc.h"
 
 using namespace std;
 
@@ -32,6 +33,11 @@ namespace bst {
         bc::array_slice <uint8_t> slice = bc::array_slice<uint8_t>(messageBytes);
         bc::hash_digest message_hash = hash_message(slice);
 
+        return recover_address(message_hash, signature, paymentVector);
+    }
+
+    bool recover_address(const bc::hash_digest &message_hash, const bc::message_signature &signature, vector <uint8_t> &paymentVector) {
+
         bool compressed = false;
         int magic = signature[0] - 27;
         if (magic < 0 || 8 <= magic) {
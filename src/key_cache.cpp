@@ -0,0 +1,112 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bitcoin/bst/key_cache.h"
+#include "bitcoin/bst/misc.h"
+
+using namespace std;
+
+namespace bst {
+
+    void RecoveredKeyCache::makeKey(const bc::hash_digest& message_hash, const bc::message_signature& signature,
+                                    cache_key& key)
+    {
+        copy(message_hash.begin(), message_hash.end(), key.begin());
+        copy(signature.begin(), signature.end(), key.begin() + 32);
+    }
+
+    bool RecoveredKeyCache::find(const bc::hash_digest& message_hash, const bc::message_signature& signature,
+                                 uint160_t& hash)
+    {
+        cache_key key;
+        makeKey(message_hash, signature, key);
+        cache_value value;
+        if (! cache.find(key, value)) return false;
+        hash.assign(value.begin(), value.end());
+        return true;
+    }
+
+    void RecoveredKeyCache::insert(const bc::hash_digest& message_hash, const bc::message_signature& signature,
+                                   const uint160_t& hash)
+    {
+        if (hash.size() != 20) return;
+        cache_key key;
+        makeKey(message_hash, signature, key);
+        cache_value value;
+        copy(hash.begin(), hash.end(), value.begin());
+        cache.insert(key, value);
+    }
+
+    void ScriptValidationCache::makeKey(const bc::hash_digest& txid, uint32_t input_index, const uint160_t& script_hash,
+                                        cache_key& key)
+    {
+        copy(txid.begin(), txid.end(), key.begin());
+        memcpy(&key[32], &input_index, sizeof(input_index));
+        copy(script_hash.begin(), script_hash.begin() + 20, key.begin() + 36);
+    }
+
+    bool ScriptValidationCache::find(const bc::hash_digest& txid, uint32_t input_index, const uint160_t& script_hash,
+                                     bool& valid)
+    {
+        if (script_hash.size() != 20) return false;
+        cache_key key;
+        makeKey(txid, input_index, script_hash, key);
+        return cache.find(key, valid);
+    }
+
+    void ScriptValidationCache::insert(const bc::hash_digest& txid, uint32_t input_index, const uint160_t& script_hash,
+                                       bool valid)
+    {
+        if (script_hash.size() != 20) return;
+        cache_key key;
+        makeKey(txid, input_index, script_hash, key);
+        cache.insert(key, valid);
+    }
+
+    RecoveredKeyCache& recoveredKeyCache()
+    {
+        static RecoveredKeyCache cache;
+        return cache;
+    }
+
+    ScriptValidationCache& scriptValidationCache()
+    {
+        static ScriptValidationCache cache;
+        return cache;
+    }
+
+    bool recover_address(const string& message, const bc::message_signature& signature, vector<uint8_t>& paymentVector,
+                         RecoveredKeyCache& cache)
+    {
+        std::vector<uint8_t> messageBytes(message.begin(), message.end());
+        bc::hash_digest message_hash = bc::hash_message(bc::array_slice<uint8_t>(messageBytes));
+
+        if (cache.find(message_hash, signature, paymentVector)) return true;
+        if (! recover_address(message_hash, signature, paymentVector)) return false;
+        cache.insert(message_hash, signature, paymentVector);
+        return true;
+    }
+
+    bool recover_address(const string& message, const string& signature, vector<uint8_t>& paymentVector,
+                         RecoveredKeyCache& cache)
+    {
+        bc::message_signature decodedSignature = bc::message_signature();
+        bc::data_chunk chunk;
+        if (!bc::decode_base64(chunk, signature) || chunk.size() != decodedSignature.size()) return false;
+        copy(chunk.begin(), chunk.end(), decodedSignature.begin());
+        return recover_address(message, decodedSignature, paymentVector, cache);
+    }
+}
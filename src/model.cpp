@@ -0,0 +1,230 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "bitcoin/bst/common.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "bitcoin/bst/model.h"
+#include "bitcoin/bst/record.h"
+
+using namespace std;
+
+namespace bst {
+
+    static const char MODEL_MAGIC[4] = { 'B', 'S', 'T', 'M' };
+    static const uint32_t MODEL_VERSION = 1;
+    static const int MODEL_TRAILER_SIZE = 8 + 4 + 4;
+
+    void section_model::predict(const uint8_t* hash, int64_t amount, int64_t& low, int64_t& high) const
+    {
+        low = 0;
+        high = amount;
+        if (points.empty() || amount == 0) return;
+
+        const uint64_t key = hashPrefix(hash);
+        const uint64_t bucket = key >> (64 - radix_bits);
+        vector<spline_point>::const_iterator first = points.begin() + radix[bucket];
+        vector<spline_point>::const_iterator last = points.begin() + radix[bucket + 1];
+        vector<spline_point>::const_iterator next = lower_bound(first, last, key,
+                [](const spline_point& point, uint64_t k) { return point.key < k; });
+
+        double position;
+        if (next == points.begin()) {
+            position = 0;
+        } else if (next == points.end()) {
+            position = (double) points.back().position + 1;
+        } else {
+            const spline_point& left = *(next - 1);
+            double slope = ((double) next->position - (double) left.position) / ((double) next->key - (double) left.key);
+            position = (double) left.position + (double) (key - left.key) * slope;
+        }
+
+        // clamped into the section so the window is never empty
+        int64_t predicted = min(max((int64_t) position, (int64_t) 0), amount - 1);
+        low = max((int64_t) 0, predicted - (int64_t) error);
+        high = min(amount, predicted + (int64_t) error + 2);
+    }
+
+    SplineBuilder::SplineBuilder(uint32_t error_) : error(error_), count(0) {}
+
+    // sign of the turn from the first direction to the second: positive clockwise, negative counter clockwise
+    static inline int orientation(double dx1, double dy1, double dx2, double dy2)
+    {
+        double turn = dy1 * dx2 - dy2 * dx1;
+        if (turn > numeric_limits<double>::epsilon()) return 1;
+        if (turn < -numeric_limits<double>::epsilon()) return -1;
+        return 0;
+    }
+
+    void SplineBuilder::addPoint(uint64_t key, uint64_t position)
+    {
+        spline_point point;
+        point.key = key;
+        point.position = position;
+        points.push_back(point);
+    }
+
+    void SplineBuilder::add(const uint8_t* hash)
+    {
+        const uint64_t key = hashPrefix(hash);
+        const uint64_t position = count++;
+        if (position == 0) {
+            addPoint(key, position);
+            previous = points.back();
+            return;
+        }
+        // a repeated prefix keeps the position of its first hash
+        if (key == previous.key) return;
+
+        const double upperY = (double) position + error;
+        const double lowerY = position < error ? 0 : (double) position - error;
+        if (points.size() == 1 && previous.key == points.back().key) {
+            upper.key = lower.key = key;
+            upper.position = (uint64_t) upperY;
+            lower.position = (uint64_t) lowerY;
+            previous.key = key;
+            previous.position = position;
+            return;
+        }
+
+        const spline_point& last = points.back();
+        const double dx = (double) (key - last.key);
+        const double dy = (double) position - (double) last.position;
+        const double upperDx = (double) (upper.key - last.key);
+        const double upperDy = (double) upper.position - (double) last.position;
+        const double lowerDx = (double) (lower.key - last.key);
+        const double lowerDy = (double) lower.position - (double) last.position;
+
+        if (orientation(upperDx, upperDy, dx, dy) != 1 || orientation(lowerDx, lowerDy, dx, dy) != -1) {
+            // outside the corridor, so the line has to bend at the previous key
+            addPoint(previous.key, previous.position);
+            upper.key = lower.key = key;
+            upper.position = (uint64_t) upperY;
+            lower.position = (uint64_t) lowerY;
+        } else {
+            // narrow the corridor to what still reaches this key
+            if (orientation(upperDx, upperDy, dx, upperY - (double) last.position) == 1) {
+                upper.key = key;
+                upper.position = (uint64_t) upperY;
+            }
+            if (orientation(lowerDx, lowerDy, dx, lowerY - (double) last.position) == -1) {
+                lower.key = key;
+                lower.position = (uint64_t) lowerY;
+            }
+        }
+        previous.key = key;
+        previous.position = position;
+    }
+
+    void SplineBuilder::finish(section_model& model)
+    {
+        if (count > 0 && previous.key != points.back().key) addPoint(previous.key, previous.position);
+
+        model.error = error;
+        model.points = points;
+        model.radix_bits = 1;
+        while (model.radix_bits < MAX_RADIX_BITS && (1ULL << model.radix_bits) < points.size()) model.radix_bits++;
+
+        uint64_t buckets = 1ULL << model.radix_bits;
+        model.radix.assign(buckets + 1, (uint32_t) points.size());
+        uint64_t bucket = 0;
+        for (size_t i = 0; i < points.size(); i++) {
+            uint64_t pointBucket = points[i].key >> (64 - model.radix_bits);
+            while (bucket <= pointBucket) model.radix[bucket++] = (uint32_t) i;
+        }
+    }
+
+    static void append(vector<uint8_t>& out, const void* data, size_t length)
+    {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        out.insert(out.end(), bytes, bytes + length);
+    }
+
+    void encodeSnapshotModel(const snapshot_model& model, vector<uint8_t>& trailer)
+    {
+        trailer.clear();
+        for (int section = 0; section < 2; section++) {
+            const section_model& sectionModel = model.sections[section];
+            uint64_t points = sectionModel.points.size();
+            append(trailer, &sectionModel.error, sizeof(sectionModel.error));
+            append(trailer, &sectionModel.radix_bits, sizeof(sectionModel.radix_bits));
+            append(trailer, &points, sizeof(points));
+            for (const spline_point& point : sectionModel.points) {
+                append(trailer, &point.key, sizeof(point.key));
+                append(trailer, &point.position, sizeof(point.position));
+            }
+            append(trailer, &sectionModel.radix[0], sectionModel.radix.size() * 4);
+        }
+        uint64_t size = trailer.size();
+        append(trailer, &size, sizeof(size));
+        append(trailer, &MODEL_VERSION, sizeof(MODEL_VERSION));
+        append(trailer, MODEL_MAGIC, 4);
+    }
+
+    bool readSnapshotModel(snapshot_model& model, int fd, uint64_t recordsEnd, const snapshot_header& header)
+    {
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || (uint64_t) st.st_size < recordsEnd + MODEL_TRAILER_SIZE) return false;
+
+        uint8_t trailer[MODEL_TRAILER_SIZE];
+        if (pread(fd, trailer, MODEL_TRAILER_SIZE, st.st_size - MODEL_TRAILER_SIZE) != MODEL_TRAILER_SIZE) return false;
+        uint64_t size;
+        uint32_t version;
+        memcpy(&size, trailer, 8);
+        memcpy(&version, trailer + 8, 4);
+        if (memcmp(trailer + 12, MODEL_MAGIC, 4) != 0 || version != MODEL_VERSION
+            || recordsEnd + size + MODEL_TRAILER_SIZE != (uint64_t) st.st_size || size > (1ULL << 30)) {
+            return false;
+        }
+        vector<uint8_t> bytes(size);
+        if (size > 0 && pread(fd, &bytes[0], size, recordsEnd) != (ssize_t) size) return false;
+
+        uint64_t counts[2] = { header.nP2PKH, header.nP2SH };
+        size_t at = 0;
+        for (int section = 0; section < 2; section++) {
+            section_model& sectionModel = model.sections[section];
+            uint64_t points;
+            if (at + 16 > size) return false;
+            memcpy(&sectionModel.error, &bytes[at], 4);
+            memcpy(&sectionModel.radix_bits, &bytes[at + 4], 4);
+            memcpy(&points, &bytes[at + 8], 8);
+            at += 16;
+            if (sectionModel.radix_bits < 1 || sectionModel.radix_bits > MAX_RADIX_BITS || points > counts[section]) {
+                return false;
+            }
+            uint64_t buckets = (1ULL << sectionModel.radix_bits) + 1;
+            if (at + points * 16 + buckets * 4 > size) return false;
+
+            sectionModel.points.resize(points);
+            for (uint64_t i = 0; i < points; i++) {
+                memcpy(&sectionModel.points[i].key, &bytes[at], 8);
+                memcpy(&sectionModel.points[i].position, &bytes[at + 8], 8);
+                at += 16;
+                if (i > 0 && sectionModel.points[i].key <= sectionModel.points[i - 1].key) return false;
+            }
+            sectionModel.radix.resize(buckets);
+            memcpy(&sectionModel.radix[0], &bytes[at], buckets * 4);
+            at += buckets * 4;
+            for (uint32_t first : sectionModel.radix) {
+                if (first > points) return false;
+            }
+        }
+        return at == size;
+    }
+}
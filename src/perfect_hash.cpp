@@ -0,0 +1,365 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bitcoin/bst/perfect_hash.h"
+#include "bitcoin/bst/claim.h"
+#include "bitcoin/bst/thread_pool.h"
+
+using namespace std;
+
+namespace bst {
+
+    static const char PERFECT_HASH_MAGIC[4] = { 'B', 'S', 'T', 'P' };
+    static const uint32_t PERFECT_HASH_VERSION = 2;
+    static const int KEY_SIZE = 20;
+    static const int FALLBACK_SIZE = 24;
+    static const uint64_t LINE_WORDS = 8;
+    static const uint64_t LINE_BITS = 7 * 64;
+
+    // folds the whole hash so two keys only collide on every level if all 20 bytes agree, in practice
+    static inline uint64_t levelHash(const uint8_t* hash, uint32_t level)
+    {
+        uint64_t a, b;
+        uint32_t c;
+        memcpy(&a, hash, 8);
+        memcpy(&b, hash + 8, 8);
+        memcpy(&c, hash + 16, 4);
+        uint64_t x = a ^ (b * 0x9e3779b97f4a7c15ULL) ^ ((uint64_t) c << 29) ^ ((level + 1) * 0xc2b2ae3d27d4eb4fULL);
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ULL;
+        x ^= x >> 33;
+        return x;
+    }
+
+    // maps a hash onto [0, range) without a division
+    static inline uint64_t reduce(uint64_t hash, uint64_t range)
+    {
+        return (uint64_t) (((unsigned __int128) hash * range) >> 64);
+    }
+
+    // the slot of the first level bit set for hash, which is the rank of that bit
+    static inline bool slotOf(const perfect_hash_section& section, const uint8_t* hash, uint64_t& slot)
+    {
+        for (uint32_t level = 0; level < section.levels; level++) {
+            uint64_t start = section.level_start[level];
+            uint64_t bit = start + reduce(levelHash(hash, level), section.level_start[level + 1] - start);
+            const uint64_t* line = section.lines + bit / LINE_BITS * LINE_WORDS;
+            uint64_t within = bit % LINE_BITS;
+            uint64_t word = line[1 + within / 64];
+            uint64_t mask = 1ULL << (within % 64);
+            if (! (word & mask)) continue;
+
+            slot = line[0];
+            for (uint64_t w = 1; w < 1 + within / 64; w++) slot += __builtin_popcountll(line[w]);
+            slot += __builtin_popcountll(word & (mask - 1));
+            return true;
+        }
+        return false;
+    }
+
+    bool perfect_hash_section::find(const uint8_t* hash, int64_t& index) const
+    {
+        uint64_t slot;
+        if (slotOf(*this, hash, slot)) {
+            index = indexes[slot];
+            return true;
+        }
+
+        uint32_t low = 0;
+        uint32_t high = fallback_count;
+        while (low < high) {
+            uint32_t middle = low + (high - low) / 2;
+            const uint8_t* record = fallback + (uint64_t) middle * FALLBACK_SIZE;
+            int order = memcmp(record, hash, KEY_SIZE);
+            if (order == 0) {
+                uint32_t entry;
+                memcpy(&entry, record + KEY_SIZE, sizeof(entry));
+                index = entry;
+                return true;
+            }
+            if (order < 0) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        return false;
+    }
+
+    struct section_build
+    {
+        perfect_hash_section section;
+        vector<uint64_t> lines;
+        vector<uint32_t> indexes;
+        vector<uint8_t> fallback;
+    };
+
+    static void buildSection(ThreadPool& pool, const vector<uint8_t>& keys, uint64_t count, double gamma,
+                             section_build& build)
+    {
+        perfect_hash_section& section = build.section;
+        section.keys = count;
+        memset(section.level_start, 0, sizeof(section.level_start));
+
+        vector<uint32_t> remaining(count);
+        for (uint64_t i = 0; i < count; i++) remaining[i] = (uint32_t) i;
+
+        vector<uint64_t> words;
+        const uint64_t chunks = max(1u, pool.size()) * 4;
+        while (! remaining.empty() && section.levels < PERFECT_HASH_LEVELS) {
+            const uint32_t level = section.levels;
+            const uint64_t n = remaining.size();
+            const uint64_t bits = max((uint64_t) 64, ((uint64_t) ceil(gamma * n) + 63) / 64 * 64);
+            vector<uint64_t> seen(bits / 64, 0);
+            vector<uint64_t> collided(bits / 64, 0);
+
+            pool.parallelFor(n, 4096, [&](uint64_t begin, uint64_t end) {
+                for (uint64_t i = begin; i < end; i++) {
+                    uint64_t bit = reduce(levelHash(&keys[(uint64_t) remaining[i] * KEY_SIZE], level), bits);
+                    uint64_t mask = 1ULL << (bit % 64);
+                    if (__atomic_fetch_or(&seen[bit / 64], mask, __ATOMIC_RELAXED) & mask) {
+                        __atomic_fetch_or(&collided[bit / 64], mask, __ATOMIC_RELAXED);
+                    }
+                }
+            });
+            pool.parallelFor(bits / 64, 4096, [&](uint64_t begin, uint64_t end) {
+                for (uint64_t w = begin; w < end; w++) seen[w] &= ~collided[w];
+            });
+
+            // keys whose bit was shared go on to the next level, kept in order so the file is the same every build
+            const uint64_t chunkSize = (n + chunks - 1) / chunks;
+            vector<vector<uint32_t> > next(chunks);
+            pool.parallelFor(chunks, 1, [&](uint64_t begin, uint64_t end) {
+                for (uint64_t chunk = begin; chunk < end; chunk++) {
+                    for (uint64_t i = chunk * chunkSize; i < min(n, (chunk + 1) * chunkSize); i++) {
+                        uint64_t bit = reduce(levelHash(&keys[(uint64_t) remaining[i] * KEY_SIZE], level), bits);
+                        if (! (seen[bit / 64] & (1ULL << (bit % 64)))) next[chunk].push_back(remaining[i]);
+                    }
+                }
+            });
+            vector<uint32_t> rest;
+            for (auto& part : next) rest.insert(rest.end(), part.begin(), part.end());
+            remaining.swap(rest);
+
+            words.insert(words.end(), seen.begin(), seen.end());
+            section.level_start[level + 1] = section.level_start[level] + bits;
+            section.levels++;
+        }
+
+        const uint64_t dataWords = LINE_WORDS - 1;
+        uint64_t lines = (words.size() + dataWords - 1) / dataWords;
+        build.lines.assign(lines * LINE_WORDS, 0);
+        uint64_t rank = 0;
+        for (uint64_t w = 0; w < words.size(); w++) {
+            uint64_t* line = &build.lines[w / dataWords * LINE_WORDS];
+            if (w % dataWords == 0) line[0] = rank;
+            line[1 + w % dataWords] = words[w];
+            rank += __builtin_popcountll(words[w]);
+        }
+        section.lines = build.lines.data();
+
+        build.indexes.assign(rank, 0);
+        pool.parallelFor(count, 4096, [&](uint64_t begin, uint64_t end) {
+            for (uint64_t i = begin; i < end; i++) {
+                uint64_t slot;
+                if (slotOf(section, &keys[i * KEY_SIZE], slot)) build.indexes[slot] = (uint32_t) i;
+            }
+        });
+        section.indexes = build.indexes.data();
+
+        sort(remaining.begin(), remaining.end(), [&](uint32_t left, uint32_t right) {
+            return memcmp(&keys[(uint64_t) left * KEY_SIZE], &keys[(uint64_t) right * KEY_SIZE], KEY_SIZE) < 0;
+        });
+        build.fallback.assign(remaining.size() * FALLBACK_SIZE, 0);
+        for (size_t i = 0; i < remaining.size(); i++) {
+            memcpy(&build.fallback[i * FALLBACK_SIZE], &keys[(uint64_t) remaining[i] * KEY_SIZE], KEY_SIZE);
+            memcpy(&build.fallback[i * FALLBACK_SIZE + KEY_SIZE], &remaining[i], sizeof(uint32_t));
+        }
+        section.fallback_count = (uint32_t) remaining.size();
+        section.fallback = build.fallback.data();
+    }
+
+    static uint64_t padded(uint64_t length, uint64_t alignment = 8)
+    {
+        return (length + alignment - 1) / alignment * alignment;
+    }
+
+    static void writePadded(ofstream& out, const void* data, uint64_t length)
+    {
+        static const char zeros[8] = { 0 };
+        out.write(static_cast<const char*>(data), length);
+        out.write(zeros, padded(length) - length);
+    }
+
+    bool buildPerfectHash(const string& snapshotName, const string& indexName, const double gamma,
+                          const unsigned threads)
+    {
+        ifstream stream(snapshotName, ios::binary);
+        snapshot_reader reader;
+        if (gamma < 1.0 || ! openSnapshot(stream, reader, snapshotName) || reader.format->key_size != KEY_SIZE) {
+            return false;
+        }
+
+        uint64_t counts[2] = { reader.header.nP2PKH, reader.header.nP2SH };
+        // slots and entry indexes are 32 bits
+        if (counts[0] > UINT32_MAX || counts[1] > UINT32_MAX) return false;
+
+        ThreadPool pool(threads);
+        section_build builds[2];
+        const int size = reader.format->record_size;
+        vector<char> buffer(4096 * size);
+        stream.seekg(reader.format->data_offset);
+        for (int s = 0; s < 2; s++) {
+            vector<uint8_t> keys(counts[s] * KEY_SIZE);
+            for (uint64_t first = 0; first < counts[s]; first += 4096) {
+                uint64_t count = min(counts[s] - first, (uint64_t) 4096);
+                stream.read(&buffer[0], count * size);
+                if (! stream) return false;
+                for (uint64_t i = 0; i < count; i++) {
+                    memcpy(&keys[(first + i) * KEY_SIZE], &buffer[i * size], KEY_SIZE);
+                }
+            }
+            buildSection(pool, keys, counts[s], gamma, builds[s]);
+        }
+
+        ofstream out(indexName.empty() ? snapshotName + PERFECT_HASH_EXTENSION : indexName, ios::binary);
+        out.write(PERFECT_HASH_MAGIC, 4);
+        out.write(reinterpret_cast<const char*>(&PERFECT_HASH_VERSION), sizeof(PERFECT_HASH_VERSION));
+        out.write(reinterpret_cast<const char*>(&reader.header.block_hash[0]), 32);
+        out.write(reinterpret_cast<const char*>(&reader.header.nP2PKH), sizeof(reader.header.nP2PKH));
+        out.write(reinterpret_cast<const char*>(&reader.header.nP2SH), sizeof(reader.header.nP2SH));
+        out.write(reinterpret_cast<const char*>(&reader.header.fingerprint), sizeof(reader.header.fingerprint));
+        for (int s = 0; s < 2; s++) {
+            const section_build& build = builds[s];
+            const perfect_hash_section& section = build.section;
+            uint64_t levelBits[PERFECT_HASH_LEVELS] = { 0 };
+            for (uint32_t level = 0; level < section.levels; level++) {
+                levelBits[level] = section.level_start[level + 1] - section.level_start[level];
+            }
+            out.write(reinterpret_cast<const char*>(&section.keys), sizeof(section.keys));
+            out.write(reinterpret_cast<const char*>(&section.levels), sizeof(section.levels));
+            out.write(reinterpret_cast<const char*>(&section.fallback_count), sizeof(section.fallback_count));
+            out.write(reinterpret_cast<const char*>(levelBits), sizeof(levelBits));
+            static const char zeros[64] = { 0 };
+            uint64_t position = out.tellp();
+            out.write(zeros, padded(position, 64) - position);
+            writePadded(out, build.lines.data(), build.lines.size() * 8);
+            writePadded(out, build.indexes.data(), build.indexes.size() * 4);
+            writePadded(out, build.fallback.data(), build.fallback.size());
+        }
+        out.close();
+        return ! out.fail();
+    }
+
+    bool readPerfectHash(perfect_hash_index& index, const snapshot_header& header, const string& indexName)
+    {
+        int fd = open(indexName.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        void* mapped = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            mapped = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (mapped == MAP_FAILED) return false;
+        const uint64_t fileSize = st.st_size;
+        index.mapping = shared_ptr<const uint8_t>(static_cast<const uint8_t*>(mapped), [fileSize](const uint8_t* data) {
+            munmap(const_cast<uint8_t*>(data), fileSize);
+        });
+
+        const uint8_t* data = index.mapping.get();
+        uint64_t position = 0;
+        // hands out the next length bytes of the file from the given alignment on, or null past its end
+        auto take = [&](uint64_t length, uint64_t alignment) -> const uint8_t* {
+            position = min(padded(position, alignment), fileSize);
+            if (length > fileSize - position) return 0;
+            const uint8_t* at = data + position;
+            position += padded(length);
+            if (position > fileSize) position = fileSize;
+            return at;
+        };
+
+        const uint8_t* magic = take(8, 8);
+        if (! magic || memcmp(magic, PERFECT_HASH_MAGIC, 4) != 0) return false;
+        uint32_t version;
+        memcpy(&version, magic + 4, sizeof(version));
+        if (version != PERFECT_HASH_VERSION) return false;
+
+        const uint8_t* headerData = take(56, 8);
+        if (! headerData) return false;
+        memcpy(&index.header.block_hash[0], headerData, 32);
+        memcpy(&index.header.nP2PKH, headerData + 32, 8);
+        memcpy(&index.header.nP2SH, headerData + 40, 8);
+        memcpy(&index.header.fingerprint, headerData + 48, 8);
+        if (index.header.block_hash != header.block_hash || index.header.nP2PKH != header.nP2PKH
+            || index.header.nP2SH != header.nP2SH || index.header.fingerprint != header.fingerprint) {
+            return false;
+        }
+
+        uint64_t counts[2] = { header.nP2PKH, header.nP2SH };
+        for (int s = 0; s < 2; s++) {
+            perfect_hash_section& section = index.sections[s];
+            const uint8_t* fields = take(16 + PERFECT_HASH_LEVELS * 8, 8);
+            if (! fields) return false;
+            memcpy(&section.keys, fields, 8);
+            memcpy(&section.levels, fields + 8, 4);
+            memcpy(&section.fallback_count, fields + 12, 4);
+            if (section.keys != counts[s] || section.levels > PERFECT_HASH_LEVELS
+                || section.fallback_count > section.keys) {
+                return false;
+            }
+
+            section.level_start[0] = 0;
+            for (uint32_t level = 0; level < PERFECT_HASH_LEVELS; level++) {
+                uint64_t bits;
+                memcpy(&bits, fields + 16 + level * 8, 8);
+                if (level >= section.levels) {
+                    if (bits != 0) return false;
+                    section.level_start[level + 1] = section.level_start[level];
+                    continue;
+                }
+                if (bits == 0 || bits % 64 != 0 || bits > fileSize * 8) return false;
+                section.level_start[level + 1] = section.level_start[level] + bits;
+            }
+
+            uint64_t lines = (section.bits() + LINE_BITS - 1) / LINE_BITS;
+            uint64_t slots = section.keys - section.fallback_count;
+            section.lines = reinterpret_cast<const uint64_t*>(take(lines * LINE_WORDS * 8, 64));
+            section.indexes = reinterpret_cast<const uint32_t*>(take(slots * 4, 8));
+            section.fallback = take((uint64_t) section.fallback_count * FALLBACK_SIZE, 8);
+            if (! section.lines || ! section.indexes || ! section.fallback) return false;
+            // the last line's rank plus its bits must account for every slot, or slots could run past indexes
+            uint64_t rank = 0;
+            if (lines) {
+                const uint64_t* last = section.lines + (lines - 1) * LINE_WORDS;
+                rank = last[0];
+                for (uint64_t w = 1; w < LINE_WORDS; w++) rank += __builtin_popcountll(last[w]);
+            }
+            if (rank != slots) return false;
+        }
+        return true;
+    }
+}
@@ -0,0 +1,226 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <bitcoin/bitcoin.hpp>
+#include "bitcoin/bst/pipeline.h"
+#include "bitcoin/bst/misc.h"
+#include "bitcoin/bst/key_cache.h"
+
+using namespace std;
+
+namespace bst {
+
+    struct pipeline_claim
+    {
+        claim_request request;
+        function<void(const claim_result&)> done;
+        bc::hash_digest message_hash;
+        bc::message_signature signature;
+        uint160_t hash;
+        claim_result result;
+        // order of submission
+        uint64_t sequence;
+        // completed early, later stages pass it on untouched so the commit stage still sees its sequence
+        bool finished;
+
+        pipeline_claim() : sequence(0), finished(false) {}
+    };
+
+    static void finish(unique_ptr<pipeline_claim>& claim, claim_status status)
+    {
+        claim->result.status = status;
+        claim->finished = true;
+        if (claim->done) claim->done(claim->result);
+    }
+
+    ClaimPipeline::ClaimPipeline() : bitfield(0), journal(0), commit_count(0), next_sequence(0), next_commit(0),
+                                     opened(false) {}
+
+    ClaimPipeline::~ClaimPipeline()
+    {
+        close();
+    }
+
+    bool ClaimPipeline::open(const snapshot_reader& reader, claim_bitfield& bitfield_, ClaimJournal* journal_,
+                             const pipeline_options& options_)
+    {
+        close();
+        options = options_;
+        entries.reset(new SnapshotEntryCollection(getP2PKHCollection(reader)));
+        bitfield = &bitfield_;
+        journal = journal_;
+        commit_count = 0;
+        next_sequence = 0;
+        next_commit = 0;
+        // resolves duplicates among the claims ready to commit, which the commit threads do one run at a time
+        pool.reset(new ThreadPool(1));
+        for (auto& queue : queues) queue.reset(new claim_queue(options.queue_capacity));
+
+        unsigned recoverThreads = options.recover_threads ? options.recover_threads
+                                                          : max(1u, thread::hardware_concurrency());
+        startStage(max(1u, options.decode_threads), queues[0].get(), queues[1].get(), &ClaimPipeline::decode);
+        startStage(recoverThreads, queues[1].get(), queues[2].get(), &ClaimPipeline::recover);
+        startStage(max(1u, options.lookup_threads), queues[2].get(), queues[3].get(), &ClaimPipeline::lookup);
+        startStage(max(1u, options.commit_threads), queues[3].get(), 0, &ClaimPipeline::commit);
+        opened = true;
+        return true;
+    }
+
+    void ClaimPipeline::startStage(unsigned count, claim_queue* input, claim_queue* output,
+                                   void (ClaimPipeline::*process)(vector<claim_ptr>&))
+    {
+        // the last thread of a stage to run out of work closes the next queue, so closing ripples down the stages
+        shared_ptr<atomic<unsigned> > remaining = make_shared<atomic<unsigned> >(count);
+        for (unsigned i = 0; i < count; i++) {
+            threads.push_back(thread([this, input, output, process, remaining]() {
+                vector<claim_ptr> batch;
+                while (input->pop(batch, options.batch_size)) {
+                    (this->*process)(batch);
+                    if (output) {
+                        for (auto& claim : batch) output->push(move(claim));
+                    }
+                    batch.clear();
+                }
+                if (--*remaining == 0 && output) output->close();
+            }));
+        }
+    }
+
+    void ClaimPipeline::submit(const claim_request& request, const function<void(const claim_result&)>& done)
+    {
+        claim_ptr claim(new pipeline_claim());
+        claim->request = request;
+        claim->done = done;
+        claim->hash.resize(20);
+        claim->sequence = next_sequence++;
+        if (! opened || ! queues[0]->push(move(claim))) finish(claim, CLAIM_ERROR);
+    }
+
+    future<claim_result> ClaimPipeline::submit(const claim_request& request)
+    {
+        shared_ptr<promise<claim_result> > result = make_shared<promise<claim_result> >();
+        submit(request, [result](const claim_result& claimResult) { result->set_value(claimResult); });
+        return result->get_future();
+    }
+
+    void ClaimPipeline::close()
+    {
+        if (! opened) return;
+        queues[0]->close();
+        for (auto& worker : threads) worker.join();
+        threads.clear();
+        // a claim that failed to submit while closing leaves a gap the claims after it are still waiting behind
+        while (! waiting.empty()) {
+            next_commit = waiting.begin()->first;
+            vector<claim_ptr> none;
+            commit(none);
+        }
+        pool.reset();
+        entries.reset();
+        opened = false;
+    }
+
+    void ClaimPipeline::decode(vector<claim_ptr>& batch)
+    {
+        for (auto& claim : batch) {
+            if (claim->finished) continue;
+            bc::data_chunk chunk;
+            if (! bc::decode_base64(chunk, claim->request.signature) || chunk.size() != claim->signature.size()) {
+                finish(claim, CLAIM_BAD_SIGNATURE);
+                continue;
+            }
+            copy(chunk.begin(), chunk.end(), claim->signature.begin());
+            vector<uint8_t> messageBytes(claim->request.claim.begin(), claim->request.claim.end());
+            claim->message_hash = bc::hash_message(bc::array_slice<uint8_t>(messageBytes));
+        }
+    }
+
+    void ClaimPipeline::recover(vector<claim_ptr>& batch)
+    {
+        RecoveredKeyCache& cache = recoveredKeyCache();
+        for (auto& claim : batch) {
+            if (claim->finished) continue;
+            bool recovered = cache.find(claim->message_hash, claim->signature, claim->hash);
+            if (! recovered) {
+                try {
+                    recovered = recover_address(claim->message_hash, claim->signature, claim->hash);
+                } catch (...) {
+                }
+                if (recovered) cache.insert(claim->message_hash, claim->signature, claim->hash);
+            }
+            if (! recovered) finish(claim, CLAIM_BAD_SIGNATURE);
+        }
+    }
+
+    void ClaimPipeline::lookup(vector<claim_ptr>& batch)
+    {
+        SnapshotEntryCollection collection = *entries;
+        snapshot_entry entry;
+        for (auto& claim : batch) {
+            if (claim->finished) continue;
+            if (! collection.getEntry(claim->hash, entry)) {
+                finish(claim, CLAIM_NOT_FOUND);
+                continue;
+            }
+            claim->result.status = CLAIM_VALID;
+            claim->result.index = entry.index;
+            claim->result.amount = entry.amount;
+        }
+    }
+
+    void ClaimPipeline::commit(vector<claim_ptr>& batch)
+    {
+        vector<claim_ptr> ready;
+        vector<claim_result> results;
+        vector<uint64_t> order;
+        uint64_t ticket = 0;
+        {
+            // claims are claimed in submission order whichever commit thread they reach, so of several claims on one
+            // entry the first submitted wins. only the claiming is in order, waiting for durability is not
+            lock_guard<mutex> guard(order_lock);
+            for (auto& claim : batch) {
+                uint64_t sequence = claim->sequence;
+                waiting[sequence] = move(claim);
+            }
+            while (! waiting.empty() && waiting.begin()->first == next_commit) {
+                claim_ptr& claim = waiting.begin()->second;
+                if (! claim->finished) {
+                    results.push_back(claim->result);
+                    order.push_back(claim->sequence);
+                    ready.push_back(move(claim));
+                }
+                waiting.erase(waiting.begin());
+                next_commit++;
+            }
+            if (ready.empty()) return;
+
+            if (journal) {
+                // write ahead: the journal sets the bits once the run is durable, in one group commit
+                claimEntries(*journal, SECTION_P2PKH, results, *pool, ticket, order);
+            } else {
+                claimEntries(*entries, *bitfield, results, *pool, order);
+            }
+        }
+
+        bool durable = ! journal || journal->wait(ticket);
+        if (ticket) commit_count++;
+        for (size_t i = 0; i < ready.size(); i++) {
+            claim_status status = results[i].status;
+            if (status == CLAIM_VALID && ! durable) status = CLAIM_ERROR;
+            finish(ready[i], status);
+        }
+    }
+}
@@ -0,0 +1,115 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <memory>
+#include "bitcoin/bst/thread_pool.h"
+
+using namespace std;
+
+namespace bst {
+
+    ThreadPool::ThreadPool(unsigned threads) : stopping(false)
+    {
+        if (threads == 0) {
+            threads = thread::hardware_concurrency();
+            if (threads == 0) threads = 1;
+        }
+        for (unsigned i = 0; i < threads; i++) {
+            workers.push_back(thread(&ThreadPool::workerLoop, this));
+        }
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        task_ready.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    void ThreadPool::submit(const function<void()>& task)
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            tasks.push_back(task);
+        }
+        task_ready.notify_one();
+    }
+
+    // runs the oldest queued task with the lock released, returns false if there was nothing to run
+    bool ThreadPool::runOne(unique_lock<mutex>& guard)
+    {
+        if (tasks.empty()) return false;
+        function<void()> task = tasks.front();
+        tasks.pop_front();
+        guard.unlock();
+        task();
+        guard.lock();
+        task_done.notify_all();
+        return true;
+    }
+
+    void ThreadPool::workerLoop()
+    {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            task_ready.wait(guard, [&] { return stopping || ! tasks.empty(); });
+            if (tasks.empty()) break;
+            runOne(guard);
+        }
+    }
+
+    void ThreadPool::parallelFor(uint64_t count, uint64_t grain, const function<void(uint64_t, uint64_t)>& task)
+    {
+        if (count == 0) return;
+        if (grain == 0) grain = 1;
+
+        // a few chunks per thread, so one slow chunk doesn't leave the rest of the pool idle
+        uint64_t chunks = (uint64_t) size() * 4;
+        uint64_t chunkSize = (count + chunks - 1) / chunks;
+        if (chunkSize < grain) chunkSize = grain;
+        chunks = (count + chunkSize - 1) / chunkSize;
+
+        if (chunks == 1) {
+            task(0, count);
+            return;
+        }
+
+        shared_ptr<uint64_t> remaining = make_shared<uint64_t>(chunks);
+        for (uint64_t begin = chunkSize; begin < count; begin += chunkSize) {
+            uint64_t end = min(count, begin + chunkSize);
+            submit([this, remaining, begin, end, &task]() {
+                task(begin, end);
+                lock_guard<mutex> guard(lock);
+                (*remaining)--;
+            });
+        }
+
+        // the calling thread takes the first chunk itself, then helps with whatever is queued
+        task(0, min(count, chunkSize));
+        unique_lock<mutex> guard(lock);
+        (*remaining)--;
+        while (*remaining > 0) {
+            if (! runOne(guard)) {
+                task_done.wait(guard);
+            }
+        }
+    }
+}
@@ -0,0 +1,511 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <cstring>
+#include <random>
+#include <fcntl.h>
+#include <unistd.h>
+#include <bitcoin/bitcoin.hpp>
+#include "bitcoin/bst/common.h"
+#include "bitcoin/bst/bitfield.h"
+#include "bitcoin/bst/journal.h"
+#include "bitcoin/bst/claim.h"
+#include "bitcoin/bst/thread_pool.h"
+#include "bitcoin/bst/async_reader.h"
+#include "bitcoin/bst/eytzinger.h"
+#include "bitcoin/bst/model.h"
+#include "bitcoin/bst/perfect_hash.h"
+#include "bitcoin/bst/warmup.h"
+
+using namespace std;
+
+static const string BENCH_CLAIMED_NAME = "bench.claimed";
+static const string BENCH_SNAPSHOT_NAME = "bench.snapshot";
+
+double secondsSince(const chrono::steady_clock::time_point& start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// every thread walks the whole bitfield from a different starting point, so threads collide on words constantly
+void bench_claims(uint64_t nClaims)
+{
+    bst::snapshot_header header;
+    header.nP2PKH = nClaims;
+
+    cout << "threads claims/sec double-claims-detected" << endl;
+    for (int threads = 1; threads <= 64; threads *= 2) {
+        bst::claim_bitfield bitfield;
+        if (! bst::resetClaims(header, BENCH_CLAIMED_NAME) || ! bst::openClaimBitfield(bitfield, BENCH_CLAIMED_NAME)) {
+            cout << "could not open " << BENCH_CLAIMED_NAME << endl;
+            return;
+        }
+
+        atomic<uint64_t> alreadyClaimed(0);
+        vector<thread> workers;
+        auto start = chrono::steady_clock::now();
+        for (int t = 0; t < threads; t++) {
+            workers.push_back(thread([&, t]() {
+                uint64_t begin = nClaims / threads * t;
+                uint64_t found = 0;
+                for (uint64_t i = 0; i < nClaims; i++) {
+                    uint64_t bit = (begin + i) % nClaims;
+                    if (bst::testAndSetClaimed(bitfield, bit)) found++;
+                }
+                alreadyClaimed += found;
+            }));
+        }
+        for (auto& worker : workers) worker.join();
+        double seconds = secondsSince(start);
+
+        uint64_t attempts = nClaims * threads;
+        cout << threads << " " << (uint64_t) (attempts / seconds) << " " << alreadyClaimed << endl;
+        bst::closeClaimBitfield(bitfield);
+    }
+    remove(BENCH_CLAIMED_NAME.c_str());
+}
+
+// durable claims per second through the group committed journal, against a write and fsync per claim
+void bench_journal(uint64_t nClaims, int threads)
+{
+    bst::snapshot_header header;
+    header.nP2PKH = nClaims;
+    string journalName = BENCH_CLAIMED_NAME + bst::JOURNAL_EXTENSION;
+
+    bst::claim_bitfield bitfield;
+    if (! bst::resetClaims(header, BENCH_CLAIMED_NAME) || ! bst::openClaimBitfield(bitfield, BENCH_CLAIMED_NAME)) {
+        cout << "could not open " << BENCH_CLAIMED_NAME << endl;
+        return;
+    }
+    bst::ClaimJournal journal;
+    journal.open(header, bitfield, bst::journal_options(), journalName);
+
+    vector<thread> workers;
+    auto start = chrono::steady_clock::now();
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(thread([&, t]() {
+            for (uint64_t i = t; i < nClaims; i += threads) {
+                journal.append(bst::SECTION_P2PKH, i);
+            }
+        }));
+    }
+    for (auto& worker : workers) worker.join();
+    double seconds = secondsSince(start);
+    cout << "journal, " << threads << " threads: " << (uint64_t) (nClaims / seconds) << " claims/sec in "
+         << journal.commits() << " commits" << endl;
+    journal.close();
+    bst::closeClaimBitfield(bitfield);
+
+    // what a durable setClaimed costs: read, modify and write one byte, then sync
+    bst::resetClaims(header, BENCH_CLAIMED_NAME);
+    int fd = open(BENCH_CLAIMED_NAME.c_str(), O_RDWR);
+    start = chrono::steady_clock::now();
+    for (uint64_t i = 0; i < nClaims; i++) {
+        char byte;
+        pread(fd, &byte, 1, i / 8);
+        byte |= 1 << (i % 8);
+        pwrite(fd, &byte, 1, i / 8);
+        fdatasync(fd);
+    }
+    seconds = secondsSince(start);
+    cout << "byte write and sync per claim: " << (uint64_t) (nClaims / seconds) << " claims/sec" << endl;
+    close(fd);
+
+    bst::resetClaims(header, BENCH_CLAIMED_NAME);
+    remove(BENCH_CLAIMED_NAME.c_str());
+}
+
+// the entry number, big endian, in the last 8 bytes. the first 8 spread the entries evenly over all hashes the way
+// real ones are, leaving room for as many misses past the end
+void syntheticHash(uint64_t i, uint64_t nEntries, uint8_t* hash)
+{
+    uint64_t spread = i * (UINT64_MAX / max(nEntries * 2, (uint64_t) 1));
+    for (int b = 0; b < 8; b++) {
+        hash[b] = (uint8_t) (spread >> (56 - 8 * b));
+        hash[12 + b] = (uint8_t) (i >> (56 - 8 * b));
+    }
+}
+
+// all p2pkh, sorted by entry number, amounts are the entry number
+void writeSyntheticSnapshot(uint64_t nEntries)
+{
+    bst::snapshot_header header;
+    header.nP2PKH = nEntries;
+    ofstream snapshot(BENCH_SNAPSHOT_NAME, ios::binary);
+    snapshot.write(reinterpret_cast<const char*>(&header.version), sizeof(header.version));
+    snapshot.write(reinterpret_cast<const char*>(&header.block_hash[0]), header.block_hash.size());
+    snapshot.write(reinterpret_cast<const char*>(&header.nP2PKH), sizeof(header.nP2PKH));
+    snapshot.write(reinterpret_cast<const char*>(&header.nP2SH), sizeof(header.nP2SH));
+
+    vector<uint8_t> buffer;
+    buffer.reserve(bst::SCAN_BUFFER_ENTRIES * 28);
+    for (uint64_t i = 0; i < nEntries; i++) {
+        uint8_t record[28] = { 0 };
+        syntheticHash(i, nEntries, record);
+        memcpy(record + 20, &i, sizeof(i));
+        buffer.insert(buffer.end(), record, record + 28);
+        if (buffer.size() == buffer.capacity()) {
+            snapshot.write(reinterpret_cast<const char*>(&buffer[0]), buffer.size());
+            buffer.clear();
+        }
+    }
+    if (! buffer.empty()) snapshot.write(reinterpret_cast<const char*>(&buffer[0]), buffer.size());
+    if (! bst::resetClaims(header, BENCH_CLAIMED_NAME)) cout << "could not reset " << BENCH_CLAIMED_NAME << endl;
+}
+
+// sums every amount of a synthetic snapshot: one sequential scan, then parallelReduce over more and more threads
+void bench_scan(uint64_t nEntries)
+{
+    writeSyntheticSnapshot(nEntries);
+    uint64_t expected = nEntries % 2 == 0 ? nEntries / 2 * (nEntries - 1) : (nEntries - 1) / 2 * nEntries;
+
+    ifstream stream;
+    bst::snapshot_reader reader;
+    bst::claim_bitfield bitfield;
+    if (! bst::openSnapshot(stream, reader, BENCH_SNAPSHOT_NAME) || ! bst::openClaimBitfield(bitfield, BENCH_CLAIMED_NAME)) {
+        cout << "could not open " << BENCH_SNAPSHOT_NAME << endl;
+        return;
+    }
+    reader.claims = &bitfield;
+    bst::SnapshotEntryCollection entries = bst::getP2PKHCollection(reader);
+
+    cout << "threads entries/sec MB/sec" << endl;
+    auto start = chrono::steady_clock::now();
+    uint64_t total = 0;
+    for (auto i = entries.scanBegin(); i != entries.scanEnd(); ++i) total += i->amount;
+    double seconds = secondsSince(start);
+    cout << "scan " << (uint64_t) (nEntries / seconds) << " " << (uint64_t) (nEntries * 28 / seconds / 1e6)
+         << (total == expected ? "" : " wrong total") << endl;
+
+    unsigned cores = thread::hardware_concurrency();
+    for (unsigned threads = 1; threads <= max(cores, 1u); threads *= 2) {
+        bst::ThreadPool pool(threads);
+        start = chrono::steady_clock::now();
+        total = entries.parallelReduce(pool, (uint64_t) 0,
+            [](uint64_t& sum, const bst::snapshot_entry& entry) { sum += entry.amount; },
+            [](uint64_t& sum, const uint64_t& partial) { sum += partial; });
+        seconds = secondsSince(start);
+        cout << threads << " " << (uint64_t) (nEntries / seconds) << " " << (uint64_t) (nEntries * 28 / seconds / 1e6)
+             << (total == expected ? "" : " wrong total") << endl;
+    }
+
+    bst::closeClaimBitfield(bitfield);
+    remove(BENCH_SNAPSHOT_NAME.c_str());
+    remove(BENCH_CLAIMED_NAME.c_str());
+}
+
+// writes back and evicts the snapshot's pages, so the next lookups go to the disk
+void dropSnapshotCache()
+{
+    int fd = open(BENCH_SNAPSHOT_NAME.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+// random lookups, half of them misses, against a cold synthetic snapshot: pread one probe at a time, then io_uring
+// at increasing queue depths
+void bench_lookup(uint64_t nEntries, uint64_t nLookups, unsigned maxDepth)
+{
+    writeSyntheticSnapshot(nEntries);
+
+    ifstream stream;
+    bst::snapshot_reader reader;
+    if (! bst::openSnapshot(stream, reader, BENCH_SNAPSHOT_NAME)) {
+        cout << "could not open " << BENCH_SNAPSHOT_NAME << endl;
+        return;
+    }
+    bst::SnapshotEntryCollection entries = bst::getP2PKHCollection(reader);
+
+    mt19937_64 random(42);
+    vector<bst::uint160_t> hashes(nLookups, bst::uint160_t(20));
+    for (auto& hash : hashes) {
+        uint64_t i = random() % (nEntries * 2);
+        syntheticHash(i, nEntries, &hash[0]);
+    }
+
+    cout << "mode depth lookups/sec reads/lookup found" << endl;
+    for (unsigned depth = 0; depth <= maxDepth; depth = depth == 0 ? 1 : depth * 4) {
+        bst::AsyncSnapshotReader async(max(depth, 1u), depth > 0);
+        if (depth > 0 && ! async.usingUring()) {
+            cout << "io_uring is not available" << endl;
+            break;
+        }
+        vector<bst::snapshot_entry> results;
+        vector<bool> found;
+        dropSnapshotCache();
+        auto start = chrono::steady_clock::now();
+        async.getEntries(entries, hashes, results, found);
+        double seconds = secondsSince(start);
+        cout << (depth == 0 ? "pread" : "uring") << " " << depth << " " << (uint64_t) (nLookups / seconds) << " "
+             << (double) async.reads() / nLookups << " " << count(found.begin(), found.end(), true) << endl;
+    }
+
+    stream.close();
+    remove(BENCH_SNAPSHOT_NAME.c_str());
+    remove(BENCH_CLAIMED_NAME.c_str());
+}
+
+// appends a learned index of a synthetic snapshot's entries
+void appendSyntheticModel(uint64_t nEntries)
+{
+    bst::SplineBuilder builder;
+    uint8_t hash[20] = { 0 };
+    for (uint64_t i = 0; i < nEntries; i++) {
+        syntheticHash(i, nEntries, hash);
+        builder.add(hash);
+    }
+    bst::snapshot_model model;
+    builder.finish(model.sections[bst::SECTION_P2PKH]);
+    bst::SplineBuilder().finish(model.sections[bst::SECTION_P2SH]);
+    vector<uint8_t> trailer;
+    bst::encodeSnapshotModel(model, trailer);
+    ofstream snapshot(BENCH_SNAPSHOT_NAME, ios::binary | ios::app);
+    snapshot.write(reinterpret_cast<const char*>(&trailer[0]), trailer.size());
+}
+
+// random lookups, half of them misses, against a mapped synthetic snapshot: plain binary search over the section,
+// through search indexes sampling fewer and fewer records, then through a learned index and a perfect hash
+void bench_search(uint64_t nEntries, uint64_t nLookups)
+{
+    writeSyntheticSnapshot(nEntries);
+    string indexName = "bench.eytzinger";
+    string perfectHashName = "bench.mphf";
+
+    mt19937_64 random(42);
+    vector<bst::uint160_t> hashes(nLookups, bst::uint160_t(20));
+    for (auto& hash : hashes) {
+        uint64_t i = random() % (nEntries * 2);
+        syntheticHash(i, nEntries, &hash[0]);
+    }
+
+    cout << "index lookups/sec found" << endl;
+    // zero is the plain search, then the learned index and the perfect hash
+    uint64_t steps[7] = { 0, 1, 4, 16, 64, 0, 0 };
+    for (int run = 0; run < 7; run++) {
+        uint64_t step = steps[run];
+        if (run == 5) appendSyntheticModel(nEntries);
+        ifstream stream;
+        bst::snapshot_reader reader;
+        bst::claim_bitfield bitfield;
+        if (! bst::openSnapshot(stream, reader, BENCH_SNAPSHOT_NAME) || ! bst::mapSnapshot(reader)
+            || ! bst::openClaimBitfield(bitfield, BENCH_CLAIMED_NAME)) {
+            cout << "could not open " << BENCH_SNAPSHOT_NAME << endl;
+            return;
+        }
+        // keeps the claim file out of the measurement
+        reader.claims = &bitfield;
+        if (step > 0) {
+            shared_ptr<bst::eytzinger_index> index = make_shared<bst::eytzinger_index>();
+            if (! bst::buildSnapshotIndex(BENCH_SNAPSHOT_NAME, indexName, step)
+                || ! bst::readSnapshotIndex(*index, reader.header, indexName)) {
+                cout << "could not index " << BENCH_SNAPSHOT_NAME << endl;
+                return;
+            }
+            reader.search_index = index;
+        }
+        if (run == 6) {
+            shared_ptr<bst::perfect_hash_index> index = make_shared<bst::perfect_hash_index>();
+            if (! bst::buildPerfectHash(BENCH_SNAPSHOT_NAME, perfectHashName)
+                || ! bst::readPerfectHash(*index, reader.header, perfectHashName)) {
+                cout << "could not hash " << BENCH_SNAPSHOT_NAME << endl;
+                return;
+            }
+            reader.perfect_hash = index;
+        }
+        bst::SnapshotEntryCollection entries = bst::getP2PKHCollection(reader);
+        bst::snapshot_entry entry;
+        uint64_t found = 0;
+        auto start = chrono::steady_clock::now();
+        for (const auto& hash : hashes) {
+            if (entries.getEntry(hash, entry)) found++;
+        }
+        double seconds = secondsSince(start);
+        string name = run == 6 ? string("perfect hash") : run == 5 ? string("model") : step == 0 ? string("none") : "eytzinger " + to_string(step);
+        cout << name << " " << (uint64_t) (nLookups / seconds) << " " << found << endl;
+        bst::closeClaimBitfield(bitfield);
+    }
+
+    remove(indexName.c_str());
+    remove(perfectHashName.c_str());
+    remove(BENCH_SNAPSHOT_NAME.c_str());
+    remove(BENCH_CLAIMED_NAME.c_str());
+}
+
+// random lookups against a mapped snapshot just dropped from the page cache: served cold, after faulting the file
+// in, and after copying it onto huge pages
+void bench_warmup(uint64_t nEntries, uint64_t nLookups, unsigned threads)
+{
+    writeSyntheticSnapshot(nEntries);
+
+    mt19937_64 random(42);
+    vector<bst::uint160_t> hashes(nLookups, bst::uint160_t(20));
+    for (auto& hash : hashes) {
+        uint64_t i = random() % (nEntries * 2);
+        syntheticHash(i, nEntries, &hash[0]);
+    }
+
+    cout << "mode warm_seconds lookups/sec found" << endl;
+    for (int run = 0; run < 3; run++) {
+        dropSnapshotCache();
+        ifstream stream;
+        bst::snapshot_reader reader;
+        bst::claim_bitfield bitfield;
+        if (! bst::openSnapshot(stream, reader, BENCH_SNAPSHOT_NAME) || ! bst::mapSnapshot(reader)
+            || ! bst::openClaimBitfield(bitfield, BENCH_CLAIMED_NAME)) {
+            cout << "could not open " << BENCH_SNAPSHOT_NAME << endl;
+            return;
+        }
+        reader.claims = &bitfield;
+
+        bst::SnapshotWarmer warmer;
+        double warmSeconds = 0;
+        if (run > 0) {
+            bst::warmup_options options;
+            options.mode = run == 2 ? bst::RESIDENCY_HUGE_PAGES : bst::RESIDENCY_PAGE_CACHE;
+            options.threads = threads;
+            auto start = chrono::steady_clock::now();
+            if (! warmer.start(reader, &bitfield, options)) {
+                cout << "could not warm " << BENCH_SNAPSHOT_NAME << endl;
+                return;
+            }
+            warmSeconds = secondsSince(start);
+        }
+
+        bst::SnapshotEntryCollection entries = bst::getP2PKHCollection(reader);
+        bst::snapshot_entry entry;
+        uint64_t found = 0;
+        auto start = chrono::steady_clock::now();
+        for (const auto& hash : hashes) {
+            if (entries.getEntry(hash, entry)) found++;
+        }
+        double seconds = secondsSince(start);
+        string name = run == 0 ? "cold" : run == 1 ? "page_cache" : "huge_pages";
+        cout << name << " " << warmSeconds << " " << (uint64_t) (nLookups / seconds) << " " << found << endl;
+        bst::closeClaimBitfield(bitfield);
+    }
+
+    remove(BENCH_SNAPSHOT_NAME.c_str());
+    remove(BENCH_CLAIMED_NAME.c_str());
+}
+
+// random lookups from 1 to maxThreads threads sharing one reader, through pread and then through the mapping
+void bench_threads(uint64_t nEntries, uint64_t nLookups, unsigned maxThreads)
+{
+    writeSyntheticSnapshot(nEntries);
+
+    mt19937_64 random(42);
+    vector<bst::uint160_t> hashes(nLookups, bst::uint160_t(20));
+    for (auto& hash : hashes) {
+        uint64_t i = random() % (nEntries * 2);
+        syntheticHash(i, nEntries, &hash[0]);
+    }
+
+    cout << "mode threads lookups/sec found" << endl;
+    for (int mapped = 0; mapped < 2; mapped++) {
+        ifstream stream;
+        bst::snapshot_reader reader;
+        bst::claim_bitfield bitfield;
+        if (! bst::openSnapshot(stream, reader, BENCH_SNAPSHOT_NAME) || (mapped && ! bst::mapSnapshot(reader))
+            || ! bst::openClaimBitfield(bitfield, BENCH_CLAIMED_NAME)) {
+            cout << "could not open " << BENCH_SNAPSHOT_NAME << endl;
+            return;
+        }
+        reader.claims = &bitfield;
+
+        for (unsigned threadCount = 1; threadCount <= maxThreads; threadCount *= 2) {
+            atomic<uint64_t> found(0);
+            vector<thread> threads;
+            auto start = chrono::steady_clock::now();
+            for (unsigned t = 0; t < threadCount; t++) {
+                threads.push_back(thread([&, t]() {
+                    bst::SnapshotEntryCollection entries = bst::getP2PKHCollection(reader);
+                    bst::snapshot_entry entry;
+                    uint64_t hits = 0;
+                    for (uint64_t i = t; i < nLookups; i += threadCount) {
+                        if (entries.getEntry(hashes[i], entry)) hits++;
+                    }
+                    found += hits;
+                }));
+            }
+            for (auto& worker : threads) worker.join();
+            double seconds = secondsSince(start);
+            cout << (mapped ? "mapped" : "pread") << " " << threadCount << " " << (uint64_t) (nLookups / seconds)
+                 << " " << found << endl;
+        }
+        bst::closeClaimBitfield(bitfield);
+    }
+
+    remove(BENCH_SNAPSHOT_NAME.c_str());
+    remove(BENCH_CLAIMED_NAME.c_str());
+}
+
+void usage()
+{
+    cout << "Usage: spinoff_bench claims [count]" << endl;
+    cout << "       spinoff_bench journal [count] [threads]" << endl;
+    cout << "       spinoff_bench scan [entries]" << endl;
+    cout << "       spinoff_bench lookup [entries] [lookups] [max depth]" << endl;
+    cout << "       spinoff_bench search [entries] [lookups]" << endl;
+    cout << "       spinoff_bench warmup [entries] [lookups] [threads]" << endl;
+    cout << "       spinoff_bench threads [entries] [lookups] [max threads]" << endl;
+}
+
+int main(int argv, char** argc) {
+    if (argv < 2) {
+        usage();
+        return -1;
+    }
+    string which = argc[1];
+    if (which == "claims") {
+        uint64_t count = argv > 2 ? strtoull(argc[2], 0, 10) : 1 << 24;
+        bench_claims(count);
+    } else if (which == "journal") {
+        uint64_t count = argv > 2 ? strtoull(argc[2], 0, 10) : 20000;
+        int threads = argv > 3 ? atoi(argc[3]) : 64;
+        bench_journal(count, threads);
+    } else if (which == "scan") {
+        uint64_t count = argv > 2 ? strtoull(argc[2], 0, 10) : 100000000;
+        bench_scan(count);
+    } else if (which == "lookup") {
+        uint64_t count = argv > 2 ? strtoull(argc[2], 0, 10) : 100000000;
+        uint64_t lookups = argv > 3 ? strtoull(argc[3], 0, 10) : 20000;
+        unsigned depth = argv > 4 ? atoi(argc[4]) : 256;
+        bench_lookup(count, lookups, depth);
+    } else if (which == "search") {
+        uint64_t count = argv > 2 ? strtoull(argc[2], 0, 10) : 100000000;
+        uint64_t lookups = argv > 3 ? strtoull(argc[3], 0, 10) : 1000000;
+        bench_search(count, lookups);
+    } else if (which == "warmup") {
+        uint64_t count = argv > 2 ? strtoull(argc[2], 0, 10) : 100000000;
+        uint64_t lookups = argv > 3 ? strtoull(argc[3], 0, 10) : 1000000;
+        unsigned threads = argv > 4 ? atoi(argc[4]) : 0;
+        bench_warmup(count, lookups, threads);
+    } else if (which == "threads") {
+        uint64_t count = argv > 2 ? strtoull(argc[2], 0, 10) : 100000000;
+        uint64_t lookups = argv > 3 ? strtoull(argc[3], 0, 10) : 1000000;
+        unsigned threads = argv > 4 ? atoi(argc[4]) : max(1u, thread::hardware_concurrency());
+        bench_threads(count, lookups, threads);
+    } else {
+        usage();
+        return -1;
+    }
+    return 0;
+}
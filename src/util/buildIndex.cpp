@@ -0,0 +1,72 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <iostream>
+#include <cstdlib>
+#include "bitcoin/bst/eytzinger.h"
+#include "bitcoin/bst/perfect_hash.h"
+
+using namespace std;
+
+void usage()
+{
+    cout << "Usage: build_index [snapshot] [--step records] [-o index]" << endl;
+    cout << "       samples every step'th record of each section, 1 indexes every record" << endl;
+    cout << "       build_index [snapshot] --perfect-hash [--gamma bits] [--threads n] [-o index]" << endl;
+    cout << "       builds a minimal perfect hash instead, for lookups that read a single record" << endl;
+}
+
+int main(int argv, char** argc) {
+    string snapshotName = bst::SNAPSHOT_NAME;
+    string indexName;
+    uint64_t step = bst::INDEX_SAMPLE_STEP;
+    bool perfectHash = false;
+    double gamma = bst::PERFECT_HASH_GAMMA;
+    unsigned threads = 0;
+    for (int i = 1; i < argv; i++) {
+        string arg(argc[i]);
+        bool hasValue = i + 1 < argv;
+        if (arg == "--step" && hasValue) {
+            step = strtoull(argc[++i], 0, 10);
+        } else if (arg == "--perfect-hash") {
+            perfectHash = true;
+        } else if (arg == "--gamma" && hasValue) {
+            gamma = strtod(argc[++i], 0);
+        } else if (arg == "--threads" && hasValue) {
+            threads = (unsigned) strtoul(argc[++i], 0, 10);
+        } else if (arg == "-o" && hasValue) {
+            indexName = argc[++i];
+        } else if (arg[0] != '-') {
+            snapshotName = arg;
+        } else {
+            usage();
+            return -1;
+        }
+    }
+
+    if (perfectHash) {
+        if (! bst::buildPerfectHash(snapshotName, indexName, gamma, threads)) {
+            cout << "could not hash " << snapshotName << endl;
+            return -1;
+        }
+        return 0;
+    }
+    if (! bst::buildSnapshotIndex(snapshotName, indexName, step)) {
+        cout << "could not index " << snapshotName << endl;
+        return -1;
+    }
+    return 0;
+}
@@ -16,28 +16,17 @@
 
 #include <bitcoin/bitcoin.hpp>
 #include "bitcoin/bst/claim.h"
+#include "bitcoin/bst/thread_pool.h"
 
 using namespace std;
 
-int main(int argv, char** argc) {
-    ifstream stream;
-    bst::snapshot_reader snapshot_reader;
-    if (! bst::openSnapshot(stream, snapshot_reader)) {
-        cout << "Could not open snapshot." << endl;
-        return -1;
-    }
-    bst::SnapshotEntryCollection p2pkhEntries = bst::getP2PKHCollection(snapshot_reader);
-    bst::SnapshotEntryCollection p2shEntries = bst::getP2SHCollection(snapshot_reader);
+// addresses held in memory at once when streaming
+static const size_t BATCH_SIZE = 1 << 20;
 
-    if (argv != 2) {
-        cout << "Usage: get_balance <address>" << endl;
-        return -1;
-    }
-
-    stringstream ss;
-    ss << argc[1];
+int printBalance(bst::snapshot_reader& reader, const string& address)
+{
     bc::payment_address payment_address;
-    if (! payment_address.set_encoded(ss.str())) {
+    if (! payment_address.set_encoded(address)) {
         cout << "bad address" << endl;
         return -1;
     }
@@ -46,18 +35,152 @@ int main(int argv, char** argc) {
     cout << "finding balance for hash " << hashString << endl;
 
     bst::snapshot_entry entry;
-    if (p2pkhEntries.getEntry(addressVec, entry)) {
-        cout << "found p2pkh amount " << entry.amount << endl;
+    bst::snapshot_section section;
+    if (bst::findEntry(reader, address, entry, section)) {
+        cout << "found " << (section == bst::SECTION_P2PKH ? "p2pkh" : "p2sh") << " amount " << entry.amount << endl;
         return 0;
+    }
+
+    cout << "could not find address in snapshot" << endl;
+    return 0;
+}
+
+enum address_kind {
+    ADDRESS_INVALID,
+    ADDRESS_P2PKH,
+    ADDRESS_P2SH,
+    // a version byte we don't recognise, so either section could hold it
+    ADDRESS_UNKNOWN
+};
 
+// looks up the positions given, recording hits and returning the positions that missed
+vector<size_t> lookupSection(bst::SnapshotEntryCollection& entries, const char* sectionName,
+                             const vector<bst::uint160_t>& hashes, const vector<size_t>& positions,
+                             vector<uint64_t>& amounts, vector<string>& sections, bst::ThreadPool& pool)
+{
+    vector<bst::uint160_t> sectionHashes;
+    sectionHashes.reserve(positions.size());
+    for (size_t position : positions) sectionHashes.push_back(hashes[position]);
+
+    vector<bst::snapshot_entry> foundEntries;
+    vector<bool> found;
+    entries.getEntries(sectionHashes, foundEntries, found, pool);
+
+    vector<size_t> misses;
+    for (size_t j = 0; j < positions.size(); j++) {
+        if (found[j]) {
+            sections[positions[j]] = sectionName;
+            amounts[positions[j]] = foundEntries[j].amount;
+        } else {
+            misses.push_back(positions[j]);
+        }
     }
+    return misses;
+}
 
-    if (p2shEntries.getEntry(addressVec, entry)) {
-        cout << "found p2sh amount " << entry.amount << endl;
-        return 0;
+// writes "<address> <amount> <p2pkh|p2sh|none|invalid>" for each address, in input order
+void lookupBatch(bst::SnapshotEntryCollection& p2pkhEntries, bst::SnapshotEntryCollection& p2shEntries,
+                 const vector<string>& addresses, bst::ThreadPool& pool)
+{
+    vector<bst::uint160_t> hashes(addresses.size(), bst::uint160_t(20));
+    vector<uint8_t> kinds(addresses.size(), ADDRESS_INVALID);
+    pool.parallelFor(addresses.size(), 256, [&](uint64_t begin, uint64_t end) {
+        for (uint64_t i = begin; i < end; i++) {
+            bc::payment_address payment_address;
+            if (! payment_address.set_encoded(addresses[i])) continue;
+            copy(payment_address.hash().begin(), payment_address.hash().end(), hashes[i].begin());
+            uint8_t version = payment_address.version();
+            if (version == 0 || version == 111) {
+                kinds[i] = ADDRESS_P2PKH;
+            } else if (version == 5 || version == 196) {
+                kinds[i] = ADDRESS_P2SH;
+            } else {
+                kinds[i] = ADDRESS_UNKNOWN;
+            }
+        }
+    });
 
+    // the version byte says which section to search, only unknown versions are tried against both
+    vector<size_t> p2pkhPositions, p2shPositions;
+    for (size_t i = 0; i < addresses.size(); i++) {
+        if (kinds[i] == ADDRESS_P2PKH || kinds[i] == ADDRESS_UNKNOWN) p2pkhPositions.push_back(i);
+        if (kinds[i] == ADDRESS_P2SH) p2shPositions.push_back(i);
     }
 
-    cout << "could not find address in snapshot" << endl;
+    vector<string> sections(addresses.size(), "invalid");
+    vector<uint64_t> amounts(addresses.size(), 0);
+    vector<size_t> misses = lookupSection(p2pkhEntries, "p2pkh", hashes, p2pkhPositions, amounts, sections, pool);
+    for (size_t position : misses) {
+        if (kinds[position] == ADDRESS_UNKNOWN) {
+            p2shPositions.push_back(position);
+        } else {
+            sections[position] = "none";
+        }
+    }
+    misses = lookupSection(p2shEntries, "p2sh", hashes, p2shPositions, amounts, sections, pool);
+    for (size_t position : misses) {
+        sections[position] = "none";
+    }
+
+    stringstream ss;
+    for (size_t i = 0; i < addresses.size(); i++) {
+        ss << addresses[i] << " " << amounts[i] << " " << sections[i] << "\n";
+    }
+    cout << ss.str();
+}
+
+int streamBalances(bst::SnapshotEntryCollection& p2pkhEntries, bst::SnapshotEntryCollection& p2shEntries,
+                   istream& input)
+{
+    bst::ThreadPool pool;
+    vector<string> addresses;
+    string line;
+    while (input) {
+        addresses.clear();
+        while (addresses.size() < BATCH_SIZE && getline(input, line)) {
+            size_t begin = line.find_first_not_of(" \t\r");
+            if (begin == string::npos) continue;
+            size_t end = line.find_last_not_of(" \t\r");
+            addresses.push_back(line.substr(begin, end - begin + 1));
+        }
+        if (addresses.empty()) break;
+        lookupBatch(p2pkhEntries, p2shEntries, addresses, pool);
+    }
+    cout.flush();
     return 0;
 }
+
+int main(int argv, char** argc) {
+    ifstream stream;
+    bst::snapshot_reader snapshot_reader;
+    if (! bst::openSnapshot(stream, snapshot_reader)) {
+        cout << "Could not open snapshot." << endl;
+        return -1;
+    }
+    bst::SnapshotEntryCollection p2pkhEntries = bst::getP2PKHCollection(snapshot_reader);
+    bst::SnapshotEntryCollection p2shEntries = bst::getP2SHCollection(snapshot_reader);
+
+    if (argv == 2 && string(argc[1]) == "-") {
+        return streamBalances(p2pkhEntries, p2shEntries, cin);
+    }
+
+    if (argv == 3 && string(argc[1]) == "-f") {
+        ifstream addressFile(argc[2]);
+        if (! addressFile.is_open()) {
+            cout << "Could not open " << argc[2] << endl;
+            return -1;
+        }
+        return streamBalances(p2pkhEntries, p2shEntries, addressFile);
+    }
+
+    if (argv != 2) {
+        cout << "Usage: get_balance <address>" << endl;
+        cout << "       get_balance -f <file>    one address per line" << endl;
+        cout << "       get_balance -            addresses from stdin" << endl;
+        return -1;
+    }
+
+    stringstream ss;
+    ss << argc[1];
+    return printBalance(snapshot_reader, ss.str());
+}
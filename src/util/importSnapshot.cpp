@@ -0,0 +1,84 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <bitcoin/bitcoin.hpp>
+#include "bitcoin/bst/import.h"
+#include "bitcoin/bst/model.h"
+#include "bitcoin/bst/misc.h"
+
+using namespace std;
+
+void usage()
+{
+    cout << "Usage: import_snapshot <file> [--blockhash hex] [--dust amount] [--hex-p2sh] [--skip-invalid] [--aligned]" << endl;
+    cout << "       [--model] [-t threads]" << endl;
+    cout << "       one address,amount per line. addresses are base58check or 40 hex characters of hash" << endl;
+}
+
+int main(int argv, char** argc) {
+    if (argv < 2) {
+        usage();
+        return -1;
+    }
+    string inputName = argc[1];
+    bst::import_options options;
+    vector<uint8_t> block_hash(32);
+    for (int i = 2; i < argv; i++) {
+        string arg(argc[i]);
+        bool hasValue = i + 1 < argv;
+        if (arg == "--blockhash" && hasValue) {
+            block_hash.clear();
+            if (! bst::decodeVector(argc[++i], block_hash) || block_hash.size() != 32) {
+                cout << "block hash should be 64 hex characters" << endl;
+                return -1;
+            }
+        } else if (arg == "--dust" && hasValue) {
+            options.dust_limit = strtoull(argc[++i], 0, 10);
+        } else if (arg == "--hex-p2sh") {
+            options.hex_section = bst::SECTION_P2SH;
+        } else if (arg == "--skip-invalid") {
+            options.skip_invalid = true;
+        } else if (arg == "--aligned") {
+            options.version = bst::SNAPSHOT_ALIGNED_VERSION;
+        } else if (arg == "--model") {
+            options.model_error = bst::MODEL_ERROR;
+        } else if (arg == "-t" && hasValue) {
+            options.threads = atoi(argc[++i]);
+        } else {
+            usage();
+            return -1;
+        }
+    }
+
+    bst::import_stats stats;
+    auto start = chrono::steady_clock::now();
+    bool ok = bst::importBalances(inputName, block_hash, options, stats);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << "lines " << stats.lines << " invalid " << stats.invalid << " merged " << stats.merged
+         << " dust " << stats.dust << endl;
+    if (stats.invalid > 0) cout << "first invalid line at byte " << stats.first_invalid << endl;
+    if (! ok) {
+        cout << "import failed" << endl;
+        return -1;
+    }
+    cout << "p2pkh " << stats.p2pkh << " p2sh " << stats.p2sh << endl;
+    cout << (uint64_t) (stats.lines / seconds * 60) << " lines/minute" << endl;
+    return 0;
+}
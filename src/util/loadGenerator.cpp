@@ -0,0 +1,111 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <cstdlib>
+#include <bitcoin/bitcoin.hpp>
+#include "bitcoin/bst/daemon.h"
+
+using namespace std;
+
+// samples hashes from the snapshot so most requests hit, and a few random ones so some miss
+void sampleHashes(bst::snapshot_reader& reader, uint64_t count, vector<bst::uint160_t>& hashes)
+{
+    bst::SnapshotEntryCollection p2pkhEntries = bst::getP2PKHCollection(reader);
+    bst::SnapshotEntryCollection p2shEntries = bst::getP2SHCollection(reader);
+    uint64_t total = reader.header.nP2PKH + reader.header.nP2SH;
+
+    mt19937_64 random(42);
+    hashes.resize(count);
+    for (uint64_t i = 0; i < count; i++) {
+        bst::snapshot_entry entry;
+        uint64_t index = total > 0 ? random() % total : 0;
+        if (total == 0 || i % 16 == 15) {
+            bst::uint160_t hash(20);
+            for (auto& byte : hash) byte = random();
+            hashes[i] = hash;
+        } else if (index < reader.header.nP2PKH) {
+            p2pkhEntries.getEntry(index, entry);
+            hashes[i] = entry.hash;
+        } else {
+            p2shEntries.getEntry(index - reader.header.nP2PKH, entry);
+            hashes[i] = entry.hash;
+        }
+    }
+}
+
+int main(int argv, char** argc) {
+    if (argv > 5) {
+        cout << "Usage: snapshot_load [connections] [pipeline depth] [requests per connection] [socket]" << endl;
+        return -1;
+    }
+    int connections = argv > 1 ? atoi(argc[1]) : 4;
+    uint64_t depth = argv > 2 ? strtoull(argc[2], 0, 10) : 64;
+    uint64_t requests = argv > 3 ? strtoull(argc[3], 0, 10) : 1000000;
+    string socketName = argv > 4 ? argc[4] : bst::DAEMON_SOCKET_NAME;
+    if (connections < 1 || depth < 1) return -1;
+
+    ifstream stream;
+    bst::snapshot_reader reader;
+    if (! bst::openSnapshot(stream, reader)) {
+        cout << "Could not open snapshot." << endl;
+        return -1;
+    }
+    vector<bst::uint160_t> hashes;
+    sampleHashes(reader, 1 << 16, hashes);
+
+    atomic<uint64_t> completed(0), found(0), failed(0);
+    vector<thread> workers;
+    auto start = chrono::steady_clock::now();
+    for (int c = 0; c < connections; c++) {
+        workers.push_back(thread([&, c]() {
+            bst::SnapshotClient client;
+            if (! client.connect(socketName)) {
+                failed++;
+                return;
+            }
+            // keep depth requests in flight: top up the pipeline after every response
+            uint64_t sent = 0, received = 0, hits = 0;
+            uint64_t next = c * 7919;
+            bst::daemon_response response;
+            while (received < requests) {
+                while (sent < requests && sent - received < depth) {
+                    client.queueBalance(sent, hashes[next++ % hashes.size()]);
+                    sent++;
+                }
+                if (! client.flush() || ! client.receive(response)) {
+                    failed++;
+                    return;
+                }
+                if (response.status == bst::STATUS_OK) hits++;
+                received++;
+            }
+            completed += received;
+            found += hits;
+        }));
+    }
+    for (auto& worker : workers) worker.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << "connections " << connections << " depth " << depth << endl;
+    cout << "requests " << completed << " found " << found << " failed connections " << failed << endl;
+    cout << "requests/sec " << (uint64_t) (completed / seconds) << endl;
+    return failed > 0 ? -1 : 0;
+}
@@ -14,17 +14,91 @@
  * limitations under the License.
  */
 #include <iostream>
+#include <iomanip>
 #include <bitcoin/bitcoin.hpp>
 #include "bitcoin/bst/generate.h"
 #include "bitcoin/bst/claim.h"
 #include "bitcoin/bst/misc.h"
+#include "bitcoin/bst/bitfield.h"
+#include "bitcoin/bst/journal.h"
+#include "bitcoin/bst/thread_pool.h"
+#include "bitcoin/bst/filter.h"
+#include "bitcoin/bst/daemon.h"
+#include "bitcoin/bst/key_cache.h"
+#include "bitcoin/bst/export.h"
+#include "bitcoin/bst/import.h"
+#include "bitcoin/bst/async_reader.h"
+#include "bitcoin/bst/pipeline.h"
 #include <boost/foreach.hpp>
+#include <thread>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
 using namespace std;
 
 static const string SNAPSHOT_NAME = "snapshot";
 
+// a utxo for writeTestSnapshot: the hex hash its script pays to, and its amount
+struct test_utxo
+{
+    string hash;
+    bool p2sh;
+    uint64_t amount;
+};
+
+// hex hashes that sort by i, for tests that need many entries
+static string testHash(int i)
+{
+    stringstream ss;
+    ss << hex << setw(4) << setfill('0') << i << "45FBB2B00E115C98C1D6E975C99B5431DE9C";
+    return ss.str();
+}
+
+// writes the utxos to a fresh sqlite database, then the default snapshot from it with a zero block hash
+static bool writeTestSnapshot(const vector<test_utxo>& utxos,
+                              const bst::snapshot_options& options = bst::snapshot_options())
+{
+    remove("temp.sqlite");
+    bst::snapshot_preparer preparer;
+    preparer.debug = false;
+    bst::prepareForUTXOs(preparer);
+    for (const test_utxo& utxo : utxos) {
+        vector<uint8_t> script;
+        bst::decodeVector(utxo.p2sh ? "a914" + utxo.hash + "87" : "76A914" + utxo.hash + "88AC", script);
+        bst::writeUTXO(preparer, script, utxo.amount);
+    }
+    vector<uint8_t> block_hash(32);
+    return bst::writeJustSqlite(preparer) && bst::writeSnapshotFromSqlite(block_hash, 0, options);
+}
+
+// a line of a synthetic balance file: hashes spread evenly over the key space, or all sharing their first 8 bytes,
+// then the entry number, and an amount of i + 1
+static string spreadBalance(uint64_t i, bool shared = false)
+{
+    char line[64];
+    uint64_t high = shared ? 0 : i * 0x9e3779b97f4a7c15ULL;
+    sprintf(line, "%016llx%016llx%08x,%d\n", (unsigned long long) high, (unsigned long long) i * 3 + 1, (unsigned) i,
+            (int) i + 1);
+    return line;
+}
+
+// writes line(i) for i below count to balances.test, then imports it into snapshotName with import.claimed
+template <typename Line>
+static bool importTestBalances(uint64_t count, Line line, const vector<uint8_t>& block_hash,
+                               const bst::import_options& options, const string& snapshotName = "import.snapshot")
+{
+    {
+        ofstream balances("balances.test");
+        for (uint64_t i = 0; i < count; i++) balances << line(i);
+    }
+    bst::import_stats stats;
+    return bst::importBalances("balances.test", block_hash, options, stats, snapshotName, "import.claimed");
+}
+
 void test_signing_check()
 {
     string testEncodedAddress = "15BWWGJRtB8Z9NXmMAp94whujUK6SrmRwT";
@@ -105,7 +179,7 @@ void test_store_p2pkhs()
     bst::snapshot_reader reader;
     bst::openSnapshot(stream, reader);
     bst::SnapshotEntryCollection p2pkhEntries = bst::getP2PKHCollection(reader);
-    BOOST_FOREACH(bst::snapshot_entry &entry, p2pkhEntries) {
+    BOOST_FOREACH(const bst::snapshot_entry &entry, p2pkhEntries) {
                     cout << "neat, I can foreach " << entry.amount << endl;
     }
 }
@@ -209,6 +283,25 @@ void test_store_and_claim()
         cout << "expected: " << expected << endl;
         cout << "result  : " << amount << endl;
     }
+
+    // the batch form parses once, and the repeated input comes from the validation cache
+    bst::ThreadPool pool(2);
+    vector<bst::p2sh_claim_input> inputs(3);
+    inputs[0].input_index = 0;
+    inputs[0].address = p2sh_address;
+    inputs[1] = inputs[0];
+    inputs[2].input_index = 1;
+    inputs[2].address = p2sh_address;
+    vector<bst::claim_result> results;
+    bst::getP2SHAmounts(p2shEntries, transaction_string, inputs, results, pool);
+    if (results[0].status != bst::CLAIM_VALID || results[0].amount != expected
+        || results[1].status != bst::CLAIM_VALID || results[1].amount != expected
+        || results[2].status != bst::CLAIM_BAD_TRANSACTION)
+    {
+        cout << "test_store_and_claim--- 5" << endl;
+        cout << "expected: " << expected << " " << expected << " bad transaction" << endl;
+        cout << "result  : " << results[0].amount << " " << results[1].amount << " " << results[2].status << endl;
+    }
 }
 
 void test_write_sql_and_snapshot_separately()
@@ -517,6 +610,1873 @@ void test_claim_bitfield()
     remove("temp.sqlite");
 }
 
+void test_concurrent_claims()
+{
+    // an odd count, so the last word of the bitfield runs past the end of the file
+    bst::snapshot_header header;
+    header.nP2PKH = 100003;
+    header.nP2SH = 17;
+    uint64_t totalClaims = header.nP2PKH + header.nP2SH;
+    bst::resetClaims(header);
+
+    bst::claim_bitfield bitfield;
+    if (! bst::openClaimBitfield(bitfield))
+    {
+        cout << "test_concurrent_claims---" << endl;
+        cout << "could not open claim bitfield" << endl;
+        return;
+    }
+
+    // every thread tries to claim every bit, each starting somewhere else
+    const int threadCount = 16;
+    atomic<uint64_t> successfulClaims(0);
+    vector<thread> threads;
+    for (int t = 0; t < threadCount; t++) {
+        threads.push_back(thread([&, t]() {
+            uint64_t begin = totalClaims / threadCount * t;
+            uint64_t won = 0;
+            for (uint64_t i = 0; i < totalClaims; i++) {
+                if (! bst::testAndSetClaimed(bitfield, (begin + i) % totalClaims)) won++;
+            }
+            successfulClaims += won;
+        }));
+    }
+    for (auto& t : threads) t.join();
+
+    if (successfulClaims != totalClaims)
+    {
+        cout << "test_concurrent_claims--- 1" << endl;
+        cout << "expected: " << totalClaims << endl;
+        cout << "result  : " << successfulClaims << endl;
+    }
+    for (uint64_t i = 0; i < totalClaims; i++) {
+        if (! bst::isClaimed(bitfield, i)) {
+            cout << "test_concurrent_claims--- 2" << endl;
+            cout << "bit " << i << " is not set" << endl;
+            break;
+        }
+    }
+    // an index from a bigger snapshot must not write past the mapping
+    uint64_t outside = bitfield.size * 8 + 4096 * 8;
+    if (! bst::testAndSetClaimed(bitfield, outside) || ! bst::isClaimed(bitfield, bitfield.size * 8))
+    {
+        cout << "test_concurrent_claims--- 5" << endl;
+        cout << "a bit past the end of the bitfield could be claimed" << endl;
+    }
+    bst::syncClaimBitfield(bitfield);
+    bst::closeClaimBitfield(bitfield);
+
+    // the claims must be visible to the byte oriented readers too
+    ifstream claimedFile(bst::SNAPSHOT_CLAIMED_NAME, ios::binary);
+    vector<char> bytes((totalClaims + 7) / 8);
+    claimedFile.read(&bytes[0], bytes.size());
+    for (uint64_t i = 0; i < totalClaims; i++) {
+        if (! (bytes[i / 8] & (1 << (i % 8)))) {
+            cout << "test_concurrent_claims--- 3" << endl;
+            cout << "bit " << i << " is not set in the file" << endl;
+            break;
+        }
+    }
+    if (bytes.back() & ~((1 << (totalClaims % 8)) - 1))
+    {
+        cout << "test_concurrent_claims--- 4" << endl;
+        cout << "bits past the last claim were set" << endl;
+    }
+    bst::resetClaims(header);
+}
+
+void test_claim_journal()
+{
+    string claimedName = "journal_test.claimed";
+    string journalName = claimedName + bst::JOURNAL_EXTENSION;
+    bst::snapshot_header header;
+    header.nP2PKH = 1000;
+    header.nP2SH = 200;
+    bst::resetClaims(header, claimedName);
+
+    bst::claim_bitfield bitfield;
+    bst::openClaimBitfield(bitfield, claimedName);
+    bst::ClaimJournal journal;
+    bst::journal_options options;
+    options.checkpoint_bytes = 0;
+    if (! journal.open(header, bitfield, options, journalName))
+    {
+        cout << "test_claim_journal--- 1" << endl;
+        cout << "could not open journal" << endl;
+        return;
+    }
+
+    // every third p2pkh entry and every p2sh entry gets claimed from several threads at once
+    vector<thread> threads;
+    atomic<int> failures(0);
+    for (int t = 0; t < 4; t++) {
+        threads.push_back(thread([&, t]() {
+            for (int64_t i = t * 3; i < (int64_t) header.nP2PKH; i += 12) {
+                if (! journal.append(bst::SECTION_P2PKH, i)) failures++;
+            }
+            for (int64_t i = t; i < (int64_t) header.nP2SH; i += 4) {
+                if (! journal.append(bst::SECTION_P2SH, i, bst::uint256_t(32, (uint8_t) i))) failures++;
+            }
+        }));
+    }
+    for (auto& t : threads) t.join();
+    journal.close();
+    if (failures != 0)
+    {
+        cout << "test_claim_journal--- 2" << endl;
+        cout << failures << " appends failed" << endl;
+    }
+
+    // forget everything the bitfield learned, as if the process died before it was written out
+    memset(bitfield.data, 0, bitfield.size);
+    bst::closeClaimBitfield(bitfield);
+
+    bst::openClaimBitfield(bitfield, claimedName);
+    bst::ClaimJournal recovered;
+    recovered.open(header, bitfield, options, journalName);
+    uint64_t expected = header.nP2PKH / 3 + 1 + header.nP2SH;
+    if (recovered.replayed() != expected)
+    {
+        cout << "test_claim_journal--- 3" << endl;
+        cout << "expected: " << expected << endl;
+        cout << "result  : " << recovered.replayed() << endl;
+    }
+    for (uint64_t i = 0; i < header.nP2PKH + header.nP2SH; i++) {
+        bool shouldBeClaimed = i >= header.nP2PKH || i % 3 == 0;
+        if (bst::isClaimed(bitfield, i) != shouldBeClaimed) {
+            cout << "test_claim_journal--- 4" << endl;
+            cout << "bit " << i << " expected " << shouldBeClaimed << endl;
+            break;
+        }
+    }
+
+    // a claim of an entry this bitfield doesn't have, as a journal left next to another snapshot would hold
+    recovered.append(bst::SECTION_P2SH, header.nP2SH + 64);
+    recovered.close();
+    bst::ClaimJournal mismatched;
+    if (mismatched.open(header, bitfield, options, journalName))
+    {
+        cout << "test_claim_journal--- 5" << endl;
+        cout << "replayed a claim past the end of the bitfield" << endl;
+        mismatched.close();
+    }
+    bst::closeClaimBitfield(bitfield);
+
+    bst::resetClaims(header, claimedName);
+    remove(claimedName.c_str());
+}
+
+void test_batch_claims()
+{
+    string transaction1 = "76A9142345FBB2B00E115C98C1D6E975C99B5431DE9CDE88AC";
+    string transaction2 = "76A914992FA68A35E9706F5CE12036803DF00FF3003DC688AC";
+    string transaction3 = "2102f91ca5628d8a77fbf8e12fd098fdd871bdcb61c84cc3abf111a747b26ff6a2cbac";
+    vector<uint8_t> vector1;
+    vector<uint8_t> vector2;
+    vector<uint8_t> vector3;
+    bst::decodeVector(transaction1, vector1);
+    bst::decodeVector(transaction2, vector2);
+    bst::decodeVector(transaction3, vector3);
+    bst::snapshot_preparer preparer;
+    preparer.debug = false;
+    bst::prepareForUTXOs(preparer);
+    bst::writeUTXO(preparer, vector1, 24900000000);
+    bst::writeUTXO(preparer, vector2, 99998237);
+    bst::writeUTXO(preparer, vector3, 5000000643);
+    vector<uint8_t> block_hash = vector<uint8_t>(32);
+    bst::writeSnapshot(preparer, block_hash, 0);
+    string claim = "I claim funds.";
+    string signature = "Hxc0sSkslD2mFE3HtHzIDRqSutQBiAQ+TxrsgVPeL3jWbXtcusuD77MTX7Tc/hJsQtVrbZsf9xpSDs+6Khx7nNk=";
+    string signature2 = "H3ys4y9vnG2cvneZMo33Vvv1kQTKr2iCcBZZe78OFl8VaPbXYNwLVTtTh5K7Qu4MpdOQiVo+6SHq6pPSzdBm7PQ=";
+    string signature3 = "IIuXyLFeU+HVJnv9TPAGXnCnc0bCOi+enwjIWxsO5FmaMdVNBcRrkYGB07Qbdkghd+0XhnaUL3O+X+h4dzb0Kio=";
+
+    ifstream stream;
+    stream.open(SNAPSHOT_NAME, ios::binary);
+    if (! stream.is_open())
+    {
+        cout << "could not open snapshot" << endl;
+        exit(1);
+    }
+    bst::snapshot_reader reader;
+    bst::openSnapshot(stream, reader);
+    bst::SnapshotEntryCollection p2pkhEntries = bst::getP2PKHCollection(reader);
+
+    vector<bst::claim_request> claims;
+    claims.push_back(bst::claim_request(claim, signature3));
+    claims.push_back(bst::claim_request(claim, "not base64!"));
+    claims.push_back(bst::claim_request(claim, signature));
+    claims.push_back(bst::claim_request("I claim someone else's funds.", signature2));
+    claims.push_back(bst::claim_request(claim, signature2));
+    claims.push_back(bst::claim_request(claim, signature3));
+
+    bst::claim_status expectedStatus[6] = { bst::CLAIM_VALID, bst::CLAIM_BAD_SIGNATURE, bst::CLAIM_VALID,
+                                            bst::CLAIM_NOT_FOUND, bst::CLAIM_VALID, bst::CLAIM_VALID };
+    uint64_t expectedAmount[6] = { 5000000643, 0, 24900000000, 0, 99998237, 5000000643 };
+
+    bst::ThreadPool pool(4);
+    vector<bst::claim_result> results;
+    // twice, so the second batch runs on the already warm pool
+    for (int pass = 0; pass < 2; pass++) {
+        bst::getP2PKHAmounts(p2pkhEntries, claims, results, pool);
+        for (int i = 0; i < 6; i++) {
+            if (results[i].status != expectedStatus[i] || results[i].amount != expectedAmount[i])
+            {
+                cout << "test_batch_claims--- " << i << endl;
+                cout << "expected: " << expectedStatus[i] << " " << expectedAmount[i] << endl;
+                cout << "result  : " << results[i].status << " " << results[i].amount << endl;
+            }
+        }
+    }
+}
+
+void test_batch_lookup()
+{
+    // 200 p2pkh entries, keys 02.., 04.., ... so the odd keys in between are misses
+    vector<vector<uint8_t> > keys;
+    vector<test_utxo> utxos;
+    for (int i = 0; i < 200; i++) {
+        vector<uint8_t> key;
+        bst::decodeVector(testHash(i * 2 + 2), key);
+        keys.push_back(key);
+        utxos.push_back({ testHash(i * 2 + 2), false, (uint64_t) i + 1000 });
+    }
+    writeTestSnapshot(utxos);
+
+    ifstream stream;
+    stream.open(SNAPSHOT_NAME, ios::binary);
+    bst::snapshot_reader reader;
+    bst::openSnapshot(stream, reader);
+    bst::SnapshotEntryCollection p2pkhEntries = bst::getP2PKHCollection(reader);
+    p2pkhEntries.setClaimed(7);
+
+    bst::ThreadPool pool(4);
+    vector<bst::snapshot_entry> entries;
+    vector<bool> found;
+
+    // a couple of hashes are searched for individually
+    vector<bst::uint160_t> few;
+    few.push_back(keys[150]);
+    few.push_back(keys[7]);
+    p2pkhEntries.getEntries(few, entries, found, pool);
+    if (! found[0] || entries[0].amount != 1150 || ! found[1] || entries[1].amount != 1007 || ! entries[1].claimed)
+    {
+        cout << "test_batch_lookup--- 1" << endl;
+        cout << "could not find individually searched entries" << endl;
+    }
+
+    // a big shuffled batch with misses and repeats is resolved by scanning
+    vector<bst::uint160_t> many;
+    for (int i = 199; i >= 0; i -= 3) {
+        many.push_back(keys[i]);
+        vector<uint8_t> miss = keys[i];
+        miss[1]++;
+        many.push_back(miss);
+        many.push_back(keys[i / 2]);
+    }
+    p2pkhEntries.getEntries(many, entries, found, pool);
+    for (size_t j = 0; j < many.size(); j++) {
+        bst::snapshot_entry entry;
+        bool expectedFound = p2pkhEntries.getEntry(many[j], entry);
+        if (found[j] != expectedFound || (expectedFound && (entries[j].amount != entry.amount
+                                                            || entries[j].index != entry.index
+                                                            || entries[j].claimed != entry.claimed)))
+        {
+            cout << "test_batch_lookup--- 2" << endl;
+            cout << "batch and single lookup disagree on query " << j << endl;
+        }
+    }
+
+    // without the claim file the claimed bits are unknown, so nothing is reported found
+    remove(bst::SNAPSHOT_CLAIMED_NAME.c_str());
+    p2pkhEntries.getEntries(few, entries, found, pool);
+    if (found[0] || found[1])
+    {
+        cout << "test_batch_lookup--- 3" << endl;
+        cout << "found entries without their claim bits" << endl;
+    }
+
+    bst::resetClaims(reader.header);
+    remove("temp.sqlite");
+}
+
+void test_snapshot_filter()
+{
+    // false positive rate of a filter on its own
+    bst::section_filter sectionFilter;
+    sectionFilter.init(100000);
+    uint64_t state = 88172645463325252ULL;
+    vector<uint8_t> key(20);
+    for (int i = 0; i < 100000; i++) {
+        for (auto& b : key) { state ^= state << 13; state ^= state >> 7; state ^= state << 17; b = (uint8_t) state; }
+        sectionFilter.add(&key[0]);
+    }
+    int falsePositives = 0;
+    for (int i = 0; i < 100000; i++) {
+        for (auto& b : key) { state ^= state << 13; state ^= state >> 7; state ^= state << 17; b = (uint8_t) state; }
+        if (sectionFilter.mayContain(&key[0])) falsePositives++;
+    }
+    if (falsePositives > 2000)
+    {
+        cout << "test_snapshot_filter--- 1" << endl;
+        cout << "false positives per 100000: " << falsePositives << endl;
+    }
+
+    // a snapshot written with a filter picks it up, and still finds every entry
+    string pks[4] = { "1345FBB2B00E115C98C1D6E975C99B5431DE9CDE", "2345FBB2B00E115C98C1D6E975C99B5431DE9CDE",
+                      "3345FBB2B00E115C98C1D6E975C99B5431DE9CDE", "4345FBB2B00E115C98C1D6E975C99B5431DE9CDE" };
+    vector<test_utxo> utxos;
+    for (int i = 0; i < 4; i++) utxos.push_back({ pks[i], i % 2 == 1, (uint64_t) 100 + i });
+    bst::snapshot_options snapshotOptions;
+    snapshotOptions.write_filter = true;
+    writeTestSnapshot(utxos, snapshotOptions);
+
+    {
+        ifstream stream;
+        stream.open(SNAPSHOT_NAME, ios::binary);
+        bst::snapshot_reader reader;
+        bst::openSnapshot(stream, reader);
+        if (! reader.filter)
+        {
+            cout << "test_snapshot_filter--- 2" << endl;
+            cout << "filter was not loaded" << endl;
+        }
+        bst::SnapshotEntryCollection p2pkhEntries = bst::getP2PKHCollection(reader);
+        bst::SnapshotEntryCollection p2shEntries = bst::getP2SHCollection(reader);
+        bst::snapshot_entry entry;
+        for (int i = 0; i < 4; i++) {
+            vector<uint8_t> hash;
+            bst::decodeVector(pks[i], hash);
+            bst::SnapshotEntryCollection& entries = i % 2 ? p2shEntries : p2pkhEntries;
+            if (! entries.getEntry(hash, entry) || entry.amount != (uint64_t) 100 + i)
+            {
+                cout << "test_snapshot_filter--- 3" << endl;
+                cout << "could not find entry " << i << endl;
+            }
+        }
+    }
+
+    // a corrupt block count is refused rather than allocated for
+    {
+        fstream filterFile(bst::SNAPSHOT_FILTER_NAME, ios::in | ios::out | ios::binary);
+        uint64_t blocks, corrupt = 1ULL << 39;
+        filterFile.seekg(64);
+        filterFile.read(reinterpret_cast<char*>(&blocks), sizeof(blocks));
+        filterFile.seekp(64);
+        filterFile.write(reinterpret_cast<const char*>(&corrupt), sizeof(corrupt));
+        filterFile.flush();
+
+        ifstream stream;
+        stream.open(SNAPSHOT_NAME, ios::binary);
+        bst::snapshot_reader reader;
+        bst::openSnapshot(stream, reader);
+        if (reader.filter)
+        {
+            cout << "test_snapshot_filter--- 4" << endl;
+            cout << "filter with a corrupt block count was loaded" << endl;
+        }
+        filterFile.seekp(64);
+        filterFile.write(reinterpret_cast<const char*>(&blocks), sizeof(blocks));
+    }
+
+    // and writing without one removes the stale filter
+    rename(bst::SNAPSHOT_FILTER_NAME.c_str(), "stale.filter");
+    writeTestSnapshot(utxos);
+    {
+        ifstream filterFile(bst::SNAPSHOT_FILTER_NAME);
+        if (filterFile.is_open())
+        {
+            cout << "test_snapshot_filter--- 5" << endl;
+            cout << "stale filter was left behind" << endl;
+        }
+    }
+
+    // a filter put back from the earlier snapshot matches its header but not its file, so it is not loaded
+    rename("stale.filter", bst::SNAPSHOT_FILTER_NAME.c_str());
+    {
+        ifstream stream;
+        stream.open(SNAPSHOT_NAME, ios::binary);
+        bst::snapshot_reader reader;
+        bst::openSnapshot(stream, reader);
+        if (reader.filter)
+        {
+            cout << "test_snapshot_filter--- 6" << endl;
+            cout << "filter of another snapshot was loaded" << endl;
+        }
+    }
+
+    remove(bst::SNAPSHOT_FILTER_NAME.c_str());
+    remove("temp.sqlite");
+}
+
+void test_find_entry()
+{
+    string pks[4] = { "1345FBB2B00E115C98C1D6E975C99B5431DE9CDE", "2345FBB2B00E115C98C1D6E975C99B5431DE9CDE",
+                      "3345FBB2B00E115C98C1D6E975C99B5431DE9CDE", "4345FBB2B00E115C98C1D6E975C99B5431DE9CDE" };
+    string shs[3] = { "09a16fbc4929fc7c83ada40641411c09fe4b76d8", "29a16fbc4929fc7c83ada40641411c09fe4b76d8",
+                      "f9a16fbc4929fc7c83ada40641411c09fe4b76d8" };
+    vector<test_utxo> utxos;
+    for (int i = 0; i < 4; i++) utxos.push_back({ pks[i], false, (uint64_t) 100 + i });
+    for (int i = 0; i < 3; i++) utxos.push_back({ shs[i], true, (uint64_t) 200 + i });
+    writeTestSnapshot(utxos);
+
+    ifstream stream;
+    stream.open(SNAPSHOT_NAME, ios::binary);
+    bst::snapshot_reader reader;
+    bst::openSnapshot(stream, reader);
+    bst::snapshot_entry entry;
+    bst::snapshot_section section;
+
+    // raw hashes search both sections together
+    for (int i = 0; i < 7; i++) {
+        vector<uint8_t> hash;
+        bst::decodeVector(i < 4 ? pks[i] : shs[i - 4], hash);
+        bst::snapshot_section expectedSection = i < 4 ? bst::SECTION_P2PKH : bst::SECTION_P2SH;
+        uint64_t expectedAmount = i < 4 ? 100 + i : 200 + i - 4;
+        if (! bst::findEntry(reader, hash, entry, section) || section != expectedSection || entry.amount != expectedAmount)
+        {
+            cout << "test_find_entry--- 1" << endl;
+            cout << "could not find hash " << i << endl;
+        }
+
+        hash[19]++;
+        if (bst::findEntry(reader, hash, entry, section))
+        {
+            cout << "test_find_entry--- 2" << endl;
+            cout << "found a hash that isn't there " << i << endl;
+        }
+    }
+
+    // addresses go straight to the section their version names
+    vector<uint8_t> hash;
+    bc::short_hash sh;
+    bst::decodeVector(shs[1], hash);
+    copy(hash.begin(), hash.end(), sh.begin());
+    if (! bst::findEntry(reader, bc::payment_address(196, sh).encoded(), entry, section)
+        || section != bst::SECTION_P2SH || entry.amount != 201)
+    {
+        cout << "test_find_entry--- 3" << endl;
+        cout << "could not find p2sh address" << endl;
+    }
+    if (bst::findEntry(reader, bc::payment_address(111, sh).encoded(), entry, section))
+    {
+        cout << "test_find_entry--- 4" << endl;
+        cout << "found a p2sh hash through a p2pkh address" << endl;
+    }
+    hash.clear();
+    bst::decodeVector(pks[2], hash);
+    copy(hash.begin(), hash.end(), sh.begin());
+    if (! bst::findEntry(reader, bc::payment_address(0, sh).encoded(), entry, section)
+        || section != bst::SECTION_P2PKH || entry.amount != 102)
+    {
+        cout << "test_find_entry--- 5" << endl;
+        cout << "could not find p2pkh address" << endl;
+    }
+    // a hash of the wrong length is turned away before anything reads it
+    if (bst::findEntry(reader, bst::uint160_t(), entry, section)
+        || bst::findEntry(reader, bst::uint160_t(4), entry, section))
+    {
+        cout << "test_find_entry--- 6" << endl;
+        cout << "found a hash of the wrong length" << endl;
+    }
+
+    remove("temp.sqlite");
+}
+
+void test_daemon()
+{
+    string pks[3] = { "1345FBB2B00E115C98C1D6E975C99B5431DE9CDE", "2345FBB2B00E115C98C1D6E975C99B5431DE9CDE",
+                      "3345FBB2B00E115C98C1D6E975C99B5431DE9CDE" };
+    string sh = "29a16fbc4929fc7c83ada40641411c09fe4b76d8";
+    vector<test_utxo> utxos;
+    for (int i = 0; i < 3; i++) utxos.push_back({ pks[i], false, (uint64_t) 100 + i });
+    utxos.push_back({ sh, true, 200 });
+    writeTestSnapshot(utxos);
+
+    bst::daemon_options options;
+    options.socket_name = "test.sock";
+    options.threads = 2;
+    bst::SnapshotDaemon daemon;
+    if (! daemon.open(options))
+    {
+        cout << "test_daemon--- 1" << endl;
+        cout << "could not start daemon" << endl;
+        remove("temp.sqlite");
+        return;
+    }
+    thread server([&daemon]() { daemon.run(); });
+
+    bst::SnapshotClient client;
+    if (! client.connect("test.sock"))
+    {
+        cout << "test_daemon--- 2" << endl;
+        cout << "could not connect" << endl;
+    }
+    else
+    {
+        // pipeline every lookup before reading any response
+        for (int i = 0; i < 4; i++) {
+            vector<uint8_t> hash;
+            bst::decodeVector(i < 3 ? pks[i] : sh, hash);
+            client.queueBalance(i, hash);
+            hash[0] ^= 0xff;
+            client.queueBalance(10 + i, hash, i < 3 ? bst::SECTION_P2PKH : bst::SECTION_P2SH);
+        }
+        vector<uint8_t> badSignature(65);
+        client.queueClaim(20, "not a claim", badSignature);
+        client.flush();
+
+        bst::daemon_response response;
+        for (int i = 0; i < 4; i++) {
+            uint8_t expectedSection = i < 3 ? bst::SECTION_P2PKH : bst::SECTION_P2SH;
+            uint64_t expectedAmount = i < 3 ? 100 + i : 200;
+            if (! client.receive(response) || response.id != i || response.status != bst::STATUS_OK
+                || response.section != expectedSection || response.amount != expectedAmount)
+            {
+                cout << "test_daemon--- 3" << endl;
+                cout << "wrong balance for " << i << endl;
+            }
+            if (! client.receive(response) || response.id != 10 + i || response.status != bst::STATUS_NOT_FOUND)
+            {
+                cout << "test_daemon--- 4" << endl;
+                cout << "found a hash that isn't there " << i << endl;
+            }
+        }
+        if (! client.receive(response) || response.id != 20 || response.status != bst::STATUS_BAD_SIGNATURE)
+        {
+            cout << "test_daemon--- 5" << endl;
+            cout << "accepted a bad signature" << endl;
+        }
+    }
+
+    daemon.stop();
+    server.join();
+    client.close();
+    daemon.close();
+
+    // claims of the first two entries, their keys put in the recovered key cache so no signature is verified here
+    vector<bst::daemon_request> claims(4);
+    for (int i = 0; i < 4; i++) {
+        claims[i].id = 30 + i;
+        claims[i].type = bst::REQUEST_CLAIM;
+        claims[i].message = "I claim funds.";
+        claims[i].signature = bst::uint256_t(65, (uint8_t) (1 + i % 2));
+        vector<uint8_t> messageBytes(claims[i].message.begin(), claims[i].message.end());
+        bc::hash_digest message_hash = bc::hash_message(bc::array_slice<uint8_t>(messageBytes));
+        bc::message_signature signature;
+        copy(claims[i].signature.begin(), claims[i].signature.end(), signature.begin());
+        vector<uint8_t> hash;
+        bst::decodeVector(pks[i % 2], hash);
+        bst::recoveredKeyCache().insert(message_hash, signature, hash);
+    }
+    vector<bst::daemon_response> responses;
+    options.journal.checkpoint_bytes = 0;
+    {
+        // a journal that can't be written: nothing is claimed, so the claim can be made again later
+        bst::daemon_options failing = options;
+        failing.journal_name = "/dev/full";
+        bst::SnapshotDaemon broken;
+        if (broken.open(failing)) {
+            broken.processBatch(vector<bst::daemon_request>(1, claims[0]), responses);
+            if (responses[0].status != bst::STATUS_ERROR)
+            {
+                cout << "test_daemon--- 6" << endl;
+                cout << "expected an error, status " << (int) responses[0].status << endl;
+            }
+        }
+        broken.close();
+    }
+    {
+        // the first claim of each entry in a batch wins, the second is turned away
+        bst::SnapshotDaemon claiming;
+        claiming.open(options);
+        claiming.processBatch(claims, responses);
+        bst::daemon_status expected[4] = { bst::STATUS_OK, bst::STATUS_OK, bst::STATUS_ALREADY_CLAIMED,
+                                           bst::STATUS_ALREADY_CLAIMED };
+        for (int i = 0; i < 4; i++) {
+            if (responses[i].status != expected[i] || (expected[i] == bst::STATUS_OK && responses[i].amount != 100 + i))
+            {
+                cout << "test_daemon--- 7" << endl;
+                cout << "claim " << i << " status " << (int) responses[i].status << " amount " << responses[i].amount
+                     << endl;
+            }
+        }
+        claiming.close();
+    }
+    {
+        // the bitfield lost, as if the process died before writing it out: the journal brings the claims back
+        bst::claim_bitfield bitfield;
+        bst::openClaimBitfield(bitfield);
+        memset(bitfield.data, 0, bitfield.size);
+        bst::closeClaimBitfield(bitfield);
+        bst::SnapshotDaemon restarted;
+        restarted.open(options);
+        restarted.processBatch(vector<bst::daemon_request>(1, claims[0]), responses);
+        if (responses[0].status != bst::STATUS_ALREADY_CLAIMED)
+        {
+            cout << "test_daemon--- 8" << endl;
+            cout << "claim paid again after a restart, status " << (int) responses[0].status << endl;
+        }
+        restarted.close();
+    }
+    {
+        // the claimed file is the one named in the options, not the default
+        bst::daemon_options missing = options;
+        missing.claimed_name = "missing.claimed";
+        bst::SnapshotDaemon elsewhere;
+        if (elsewhere.open(missing))
+        {
+            cout << "test_daemon--- 9" << endl;
+            cout << "opened without its claimed file" << endl;
+        }
+        elsewhere.close();
+    }
+    remove(bst::SNAPSHOT_JOURNAL_NAME.c_str());
+    remove("temp.sqlite");
+}
+
+void test_key_cache()
+{
+    bst::RecoveredKeyCache cache(1024, 4);
+    bc::hash_digest message_hash = bc::hash_digest();
+    bc::message_signature signature = bc::message_signature();
+    bst::uint160_t hash(20), found(20);
+
+    for (int i = 0; i < 4096; i++) {
+        message_hash[0] = i & 0xff;
+        message_hash[1] = i >> 8;
+        hash[0] = i & 0xff;
+        hash[19] = i >> 8;
+        cache.insert(message_hash, signature, hash);
+        if (! cache.find(message_hash, signature, found) || found != hash)
+        {
+            cout << "test_key_cache--- 1" << endl;
+            cout << "lost a key just after inserting it " << i << endl;
+            return;
+        }
+    }
+
+    // the same message under a different signature is a different key
+    signature[64] = 1;
+    if (cache.find(message_hash, signature, found))
+    {
+        cout << "test_key_cache--- 2" << endl;
+        cout << "found a key for a different signature" << endl;
+    }
+
+    bst::key_cache_stats stats = cache.stats();
+    if (stats.hits != 4096 || stats.misses != 1 || stats.entries > 1024 || stats.entries < 512)
+    {
+        cout << "test_key_cache--- 3" << endl;
+        cout << stats.hits << " hits " << stats.misses << " misses " << stats.entries << " entries" << endl;
+    }
+
+    cache.clear();
+    stats = cache.stats();
+    if (stats.hits != 0 || stats.entries != 0)
+    {
+        cout << "test_key_cache--- 4" << endl;
+        cout << "clear left " << stats.entries << " entries" << endl;
+    }
+}
+
+void test_scan_iterator()
+{
+    vector<test_utxo> utxos;
+    for (int i = 0; i < 300; i++) utxos.push_back({ testHash(i), i % 5 == 0, (uint64_t) i + 1000 });
+    writeTestSnapshot(utxos);
+
+    ifstream stream;
+    bst::snapshot_reader reader;
+    bst::openSnapshot(stream, reader);
+    bst::SnapshotEntryCollection p2pkhEntries = bst::getP2PKHCollection(reader);
+    bst::SnapshotEntryCollection p2shEntries = bst::getP2SHCollection(reader);
+    p2pkhEntries.setClaimed(0);
+    p2pkhEntries.setClaimed(17);
+    p2pkhEntries.setClaimed(239);
+    p2shEntries.setClaimed(1);
+    p2shEntries.setClaimed(59);
+
+    // chunks smaller than the section, and not a multiple of 8, so chunks start in the middle of claim bytes
+    bst::SnapshotEntryCollection* sections[2] = { &p2pkhEntries, &p2shEntries };
+    for (int s = 0; s < 2; s++) {
+        bst::SnapshotEntryCollection& entries = *sections[s];
+        int64_t count = 0;
+        bst::snapshot_entry expected;
+        for (auto i = entries.scanBegin(0, -1, 13); i != entries.scanEnd(); i++) {
+            entries.getEntry(count, expected);
+            if (i->hash != expected.hash || i->amount != expected.amount || i->claimed != expected.claimed
+                || i->index != count)
+            {
+                cout << "test_scan_iterator--- 1" << endl;
+                cout << "section " << s << " entry " << count << " differs from getEntry" << endl;
+                break;
+            }
+            count++;
+        }
+        if (count != entries.amount)
+        {
+            cout << "test_scan_iterator--- 2" << endl;
+            cout << "expected: " << entries.amount << endl;
+            cout << "result  : " << count << endl;
+        }
+    }
+
+    // a sub range stops at its end
+    uint64_t total = 0;
+    int64_t count = 0;
+    for (auto i = p2pkhEntries.scanBegin(100, 140, 16); i != p2pkhEntries.scanEnd(140); ++i) {
+        total += i->amount;
+        count++;
+    }
+    bst::snapshot_entry first, last;
+    p2pkhEntries.getEntry(100, first);
+    p2pkhEntries.getEntry(139, last);
+    if (count != 40 || total != (first.amount + last.amount) * 20)
+    {
+        cout << "test_scan_iterator--- 3" << endl;
+        cout << "expected: 40 entries summing to " << (first.amount + last.amount) * 20 << endl;
+        cout << "result  : " << count << " entries summing to " << total << endl;
+    }
+
+    // a claim file cut short: the entries past its end are claimed, as the bitfield has them
+    truncate(bst::SNAPSHOT_CLAIMED_NAME.c_str(), 10);
+    for (auto i = p2pkhEntries.scanBegin(0, -1, 13); i != p2pkhEntries.scanEnd(); ++i) {
+        if (i->claimed != (i->index >= 80 || i->index == 0 || i->index == 17))
+        {
+            cout << "test_scan_iterator--- 4" << endl;
+            cout << "entry " << i->index << " claimed " << i->claimed << endl;
+            break;
+        }
+    }
+
+    remove("temp.sqlite");
+}
+
+void test_random_access_iterator()
+{
+    vector<bst::uint160_t> keys;
+    vector<test_utxo> utxos;
+    for (int i = 0; i < 100; i++) {
+        vector<uint8_t> key;
+        bst::decodeVector(testHash(i * 2 + 2), key);
+        keys.push_back(key);
+        utxos.push_back({ testHash(i * 2 + 2), false, (uint64_t) i + 1000 });
+    }
+    writeTestSnapshot(utxos);
+
+    ifstream stream;
+    bst::snapshot_reader reader;
+    bst::openSnapshot(stream, reader);
+    bst::SnapshotEntryCollection entries = bst::getP2PKHCollection(reader);
+
+    bst::SnapshotEntryCollection::const_iterator i = entries.begin();
+    i += 10;
+    if (distance(entries.begin(), entries.end()) != 100 || entries.end() - i != 90 || ! (i < entries.end())
+        || i[5].amount != 1015 || (i - 3)->amount != 1007 || (*(2 + i)).amount != 1012)
+    {
+        cout << "test_random_access_iterator--- 1" << endl;
+        cout << "iterator arithmetic is off" << endl;
+    }
+
+    // searching the keys finds every hash, and lands between entries for the ones that aren't there
+    for (int k = 0; k < 100; k++) {
+        auto found = lower_bound(entries.keysBegin(), entries.keysEnd(), keys[k]);
+        bst::uint160_t miss = keys[k];
+        miss[1]++;
+        auto between = lower_bound(entries.keysBegin(), entries.keysEnd(), miss);
+        if (found.position() != k || between.position() != k + 1)
+        {
+            cout << "test_random_access_iterator--- 2" << endl;
+            cout << "lower_bound put key " << k << " at " << found.position() << " and " << between.position() << endl;
+            break;
+        }
+    }
+
+    // split ranges cover the collection exactly once
+    uint64_t total = 0;
+    int64_t count = 0;
+    vector<bst::SnapshotEntryCollection> ranges = entries.split(7);
+    for (auto& range : ranges) {
+        for (auto entry = range.begin(); entry != range.end(); ++entry) {
+            total += entry->amount;
+            count++;
+        }
+    }
+    bst::snapshot_entry entry;
+    if (count != 100 || total != 100 * 1000 + 99 * 50 || ! ranges[3].getEntry(keys[50], entry) || entry.amount != 1050)
+    {
+        cout << "test_random_access_iterator--- 3" << endl;
+        cout << "expected: 100 entries summing to " << 100 * 1000 + 99 * 50 << endl;
+        cout << "result  : " << count << " entries summing to " << total << endl;
+    }
+
+    remove("temp.sqlite");
+}
+
+void test_parallel_scan()
+{
+    vector<test_utxo> utxos;
+    for (int i = 0; i < 3000; i++) utxos.push_back({ testHash(i), false, (uint64_t) i + 1 });
+    writeTestSnapshot(utxos);
+
+    ifstream stream;
+    bst::snapshot_reader reader;
+    bst::openSnapshot(stream, reader);
+    bst::SnapshotEntryCollection entries = bst::getP2PKHCollection(reader);
+    entries.setClaimed(5);
+    entries.setClaimed(2999);
+
+    // every range after the first starts on a page boundary
+    vector<pair<int64_t, int64_t> > ranges = entries.pageRanges(1024);
+    int64_t covered = 0;
+    for (size_t r = 0; r < ranges.size(); r++) {
+        if (ranges[r].first != covered || (r > 0 && (entries.offset + ranges[r].first * reader.format->record_size) % 4096 != 0))
+        {
+            cout << "test_parallel_scan--- 1" << endl;
+            cout << "range " << r << " starts at " << ranges[r].first << endl;
+        }
+        covered = ranges[r].second;
+    }
+    if (ranges.size() < 3 || covered != 3000)
+    {
+        cout << "test_parallel_scan--- 2" << endl;
+        cout << ranges.size() << " ranges covering " << covered << endl;
+    }
+
+    bst::ThreadPool pool(4);
+    atomic<uint64_t> claimed(0);
+    entries.parallelForEach(pool, [&](const bst::snapshot_entry& entry) {
+        if (entry.claimed) claimed++;
+    }, 1024);
+    uint64_t total = entries.parallelReduce(pool, (uint64_t) 0,
+        [](uint64_t& sum, const bst::snapshot_entry& entry) { sum += entry.amount; },
+        [](uint64_t& sum, const uint64_t& partial) { sum += partial; }, 1024);
+    if (claimed != 2 || total != (uint64_t) 3000 * 3001 / 2)
+    {
+        cout << "test_parallel_scan--- 3" << endl;
+        cout << "expected: 2 claimed, " << (uint64_t) 3000 * 3001 / 2 << endl;
+        cout << "result  : " << claimed << " claimed, " << total << endl;
+    }
+
+    // partials combine in range order, so an order sensitive reduction comes out the same as a sequential scan
+    vector<int64_t> order = entries.parallelReduce(pool, vector<int64_t>(),
+        [](vector<int64_t>& indexes, const bst::snapshot_entry& entry) { indexes.push_back(entry.index); },
+        [](vector<int64_t>& indexes, const vector<int64_t>& partial) {
+            indexes.insert(indexes.end(), partial.begin(), partial.end());
+        }, 1024);
+    bool sorted = order.size() == 3000;
+    for (size_t i = 0; sorted && i < order.size(); i++) sorted = order[i] == (int64_t) i;
+    if (! sorted)
+    {
+        cout << "test_parallel_scan--- 4" << endl;
+        cout << "partials were combined out of order" << endl;
+    }
+
+    remove("temp.sqlite");
+}
+
+void test_export()
+{
+    // the fast encoder agrees with payment_address, including hashes with leading zeros
+    uint8_t versions[5] = { 0, 5, 111, 196, 255 };
+    for (int h = 0; h < 64; h++) {
+        bc::short_hash sh;
+        for (int b = 0; b < 20; b++) sh[b] = (uint8_t) (h < 4 ? (b < h * 6 ? 0 : 0xff) : (h * 31 + b * 17) & 0xff);
+        for (int v = 0; v < 5; v++) {
+            char out[bst::MAX_ADDRESS_LENGTH];
+            int length = bst::encodeAddress(versions[v], &sh[0], out);
+            string expected = bc::payment_address(versions[v], sh).encoded();
+            if (string(out, length) != expected)
+            {
+                cout << "test_export--- 1" << endl;
+                cout << "expected: " << expected << endl;
+                cout << "result  : " << string(out, length) << endl;
+                return;
+            }
+        }
+    }
+
+    string pks[2] = { "1345FBB2B00E115C98C1D6E975C99B5431DE9CDE", "2345FBB2B00E115C98C1D6E975C99B5431DE9CDE" };
+    string sh = "29a16fbc4929fc7c83ada40641411c09fe4b76d8";
+    vector<test_utxo> utxos;
+    for (int i = 0; i < 2; i++) utxos.push_back({ pks[i], false, (uint64_t) 100 + i });
+    utxos.push_back({ sh, true, 200 });
+    writeTestSnapshot(utxos);
+
+    ifstream stream;
+    bst::snapshot_reader reader;
+    bst::openSnapshot(stream, reader);
+    bst::getP2PKHCollection(reader).setClaimed(1);
+
+    vector<uint8_t> hash;
+    bc::short_hash short_hash;
+    string addresses[3];
+    for (int i = 0; i < 3; i++) {
+        hash.clear();
+        bst::decodeVector(i < 2 ? pks[i] : sh, hash);
+        copy(hash.begin(), hash.end(), short_hash.begin());
+        addresses[i] = bc::payment_address(i < 2 ? 0 : 5, short_hash).encoded();
+    }
+
+    bst::export_options options;
+    options.threads = 2;
+    options.p2pkh_version = 0;
+    options.p2sh_version = 5;
+    bst::export_format formats[2] = { bst::EXPORT_CSV, bst::EXPORT_JSONL };
+    string expected[2] = {
+        "address,type,amount,claimed\n" + addresses[0] + ",p2pkh,100,0\n" + addresses[1] + ",p2pkh,101,1\n"
+            + addresses[2] + ",p2sh,200,0\n",
+        "{\"address\":\"" + addresses[0] + "\",\"type\":\"p2pkh\",\"amount\":100,\"claimed\":false}\n"
+            "{\"address\":\"" + addresses[1] + "\",\"type\":\"p2pkh\",\"amount\":101,\"claimed\":true}\n"
+            "{\"address\":\"" + addresses[2] + "\",\"type\":\"p2sh\",\"amount\":200,\"claimed\":false}\n"
+    };
+    for (int f = 0; f < 2; f++) {
+        options.format = formats[f];
+        int fd = open("export.test", O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        bst::exportSnapshot(reader, fd, options);
+        close(fd);
+        ifstream exported("export.test");
+        stringstream contents;
+        contents << exported.rdbuf();
+        if (contents.str() != expected[f])
+        {
+            cout << "test_export--- 2" << endl;
+            cout << "expected: " << expected[f] << endl;
+            cout << "result  : " << contents.str() << endl;
+        }
+    }
+
+    remove("export.test");
+    remove("temp.sqlite");
+}
+
+void test_columns()
+{
+    vector<test_utxo> utxos;
+    for (int i = 0; i < 1500; i++) utxos.push_back({ testHash(i), i % 3 == 0, (uint64_t) i + 1 });
+    writeTestSnapshot(utxos);
+
+    ifstream stream;
+    bst::snapshot_reader reader;
+    bst::openSnapshot(stream, reader);
+    bst::SnapshotEntryCollection sections[2] = { bst::getP2PKHCollection(reader), bst::getP2SHCollection(reader) };
+    sections[0].setClaimed(3);
+    sections[0].setClaimed(999);
+    sections[1].setClaimed(0);
+    sections[1].setClaimed(499);
+
+    bst::exportColumns(reader, "test", false, 2);
+    bst::exportColumns(reader, "test", true, 2);
+
+    string names[3] = { "test.p2pkh.columns", "test.p2sh.columns", "test.columns" };
+    for (int f = 0; f < 3; f++) {
+        bst::column_file file;
+        if (! bst::readColumnDirectory(names[f], file) || file.block_hash != reader.header.block_hash
+            || file.columns.size() != (f == 2 ? 4 : 3) || file.columns[0].name != "hash"
+            || file.columns[2].type != bst::COLUMN_BITMAP)
+        {
+            cout << "test_columns--- 1" << endl;
+            cout << "bad directory in " << names[f] << endl;
+            continue;
+        }
+
+        // the columns are used in place through a mapping
+        int fd = open(names[f].c_str(), O_RDONLY);
+        struct stat st;
+        fstat(fd, &st);
+        const uint8_t* data = (const uint8_t*) mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        const uint8_t* hashes = data + file.columns[0].offset;
+        const uint64_t* amounts = reinterpret_cast<const uint64_t*>(data + file.columns[1].offset);
+        const uint8_t* claimed = data + file.columns[2].offset;
+
+        uint64_t row = 0;
+        for (int s = 0; s < 2; s++) {
+            if (f != 2 && f != s) continue;
+            for (int64_t i = 0; i < sections[s].amount; i++, row++) {
+                bst::snapshot_entry entry;
+                sections[s].getEntry(i, entry);
+                bool claimedBit = (claimed[row / 8] & (1 << (row % 8))) != 0;
+                if (memcmp(hashes + row * 20, &entry.hash[0], 20) != 0 || amounts[row] != entry.amount
+                    || claimedBit != entry.claimed
+                    || (f == 2 && data[file.columns[3].offset + row] != s))
+                {
+                    cout << "test_columns--- 2" << endl;
+                    cout << names[f] << " row " << row << " differs from the snapshot" << endl;
+                    s = 2;
+                    break;
+                }
+            }
+        }
+        if (row != file.rows)
+        {
+            cout << "test_columns--- 3" << endl;
+            cout << "expected: " << file.rows << endl;
+            cout << "result  : " << row << endl;
+        }
+        munmap((void*) data, st.st_size);
+        close(fd);
+        remove(names[f].c_str());
+    }
+
+    remove("temp.sqlite");
+}
+
+void test_import()
+{
+    string pks[2] = { "2345FBB2B00E115C98C1D6E975C99B5431DE9CDE", "1345FBB2B00E115C98C1D6E975C99B5431DE9CDE" };
+    string sh = "29a16fbc4929fc7c83ada40641411c09fe4b76d8";
+    string addresses[3];
+    for (int i = 0; i < 3; i++) {
+        vector<uint8_t> hash;
+        bst::decodeVector(i < 2 ? pks[i] : sh, hash);
+        bc::short_hash short_hash;
+        copy(hash.begin(), hash.end(), short_hash.begin());
+        addresses[i] = bc::payment_address(i == 0 ? 0 : i == 1 ? 111 : 5, short_hash).encoded();
+    }
+
+    // a header, both separators, a blank line, a hex hash and a repeated address
+    {
+        ofstream balances("balances.test");
+        balances << "address,amount\n";
+        balances << addresses[0] << ",100\n";
+        balances << addresses[2] << "\t300\r\n";
+        balances << "\n";
+        balances << pks[1] << ",7\n";
+        balances << addresses[1] << ", 3\n";
+        balances << addresses[0] << ",5";
+    }
+    bst::import_options options;
+    options.threads = 2;
+    bst::import_stats stats;
+    vector<uint8_t> block_hash(32, 7);
+    if (! bst::importBalances("balances.test", block_hash, options, stats, "import.snapshot", "import.claimed")
+        || stats.invalid != 0 || stats.merged != 2 || stats.p2pkh != 2 || stats.p2sh != 1)
+    {
+        cout << "test_import--- 1" << endl;
+        cout << "invalid " << stats.invalid << " merged " << stats.merged << " p2pkh " << stats.p2pkh
+             << " p2sh " << stats.p2sh << endl;
+    }
+
+    ifstream stream;
+    bst::snapshot_reader reader;
+    bst::openSnapshot(stream, reader, "import.snapshot");
+    bst::SnapshotEntryCollection p2pkhEntries = bst::getP2PKHCollection(reader);
+    bst::SnapshotEntryCollection p2shEntries = bst::getP2SHCollection(reader);
+    bst::snapshot_entry entry;
+    vector<uint8_t> hash;
+    bool ok = reader.header.block_hash == block_hash;
+    for (int i = 0; i < 3 && ok; i++) {
+        hash.clear();
+        bst::decodeVector(i < 2 ? pks[i] : sh, hash);
+        uint64_t expected = i == 0 ? 105 : i == 1 ? 10 : 300;
+        ok = (i < 2 ? p2pkhEntries : p2shEntries).getEntry(hash, entry) && entry.amount == expected;
+    }
+    p2pkhEntries.getEntry(0, entry);
+    hash.clear();
+    bst::decodeVector(pks[1], hash);
+    if (! ok || entry.hash != hash)
+    {
+        cout << "test_import--- 2" << endl;
+        cout << "imported entries don't match the balance file" << endl;
+    }
+
+    // records cut off under an open reader fail to read rather than reading as zeros
+    if (truncate("import.snapshot", reader.format->data_offset) != 0
+        || p2pkhEntries.getEntry(0, entry) || p2pkhEntries.getEntry(hash, entry))
+    {
+        cout << "test_import--- 4" << endl;
+        cout << "records past the end of the snapshot were read" << endl;
+    }
+    stream.close();
+
+    // a bad checksum fails the import, unless invalid lines are skipped
+    {
+        ofstream balances("balances.test");
+        string broken = addresses[0];
+        broken[10] = broken[10] == 'a' ? 'b' : 'a';
+        balances << addresses[0] << ",100\n" << broken << ",1\n";
+    }
+    bool imported = bst::importBalances("balances.test", block_hash, options, stats, "import.snapshot", "import.claimed");
+    options.skip_invalid = true;
+    if (imported || stats.invalid != 1 || stats.first_invalid != addresses[0].size() + 5
+        || ! bst::importBalances("balances.test", block_hash, options, stats, "import.snapshot", "import.claimed")
+        || stats.p2pkh != 1)
+    {
+        cout << "test_import--- 3" << endl;
+        cout << "invalid " << stats.invalid << " at " << stats.first_invalid << endl;
+    }
+
+    remove("balances.test");
+    remove("import.snapshot");
+    remove("import.claimed");
+}
+
+void test_record_formats()
+{
+    // the same balances written packed and aligned must read back the same
+    vector<uint8_t> block_hash(32, 1);
+    bst::import_options options;
+    auto line = [](uint64_t i) {
+        char text[64];
+        sprintf(text, "%032x%08x,%d\n", (unsigned) i * 7, (unsigned) i, (int) i + 1);
+        return string(text);
+    };
+    options.version = bst::SNAPSHOT_ALIGNED_VERSION;
+    bool imported = importTestBalances(3000, line, block_hash, options, "aligned.snapshot");
+    options.version = bst::SNAPSHOT_VERSION;
+    imported = imported && importTestBalances(3000, line, block_hash, options);
+
+    ifstream packedStream, alignedStream;
+    bst::snapshot_reader packed, aligned;
+    if (! imported || ! bst::openSnapshot(packedStream, packed, "import.snapshot")
+        || ! bst::openSnapshot(alignedStream, aligned, "aligned.snapshot")
+        || aligned.format->record_size != 32 || aligned.format->data_offset != 64)
+    {
+        cout << "test_record_formats--- 1" << endl;
+        cout << "aligned snapshot didn't open" << endl;
+        return;
+    }
+    struct stat st;
+    stat("aligned.snapshot", &st);
+    if (st.st_size != 64 + 3000 * 32)
+    {
+        cout << "test_record_formats--- 2" << endl;
+        cout << "expected " << 64 + 3000 * 32 << " bytes, result " << st.st_size << endl;
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        // the second pass reads through the mapping
+        if (pass == 1) bst::mapSnapshot(aligned);
+        bst::SnapshotEntryCollection packedEntries = bst::getP2PKHCollection(packed);
+        bst::SnapshotEntryCollection alignedEntries = bst::getP2PKHCollection(aligned);
+
+        vector<bst::uint160_t> hashes;
+        bool same = true;
+        bst::SnapshotEntryCollection::scan_iterator end = alignedEntries.scanEnd();
+        bst::SnapshotEntryCollection::const_iterator expected = packedEntries.begin();
+        for (auto i = alignedEntries.scanBegin(); i != end; ++i, ++expected) {
+            same = same && i->hash == expected->hash && i->amount == expected->amount;
+            hashes.push_back(i->hash);
+        }
+        bst::snapshot_entry entry;
+        bst::snapshot_section section;
+        same = same && alignedEntries.getEntry(hashes[1234], entry) && entry.amount == 1235 && entry.index == 1234
+               && bst::findEntry(aligned, hashes[2999], entry, section) && entry.amount == 3000;
+        hashes[0][19] ^= 1;
+        same = same && ! alignedEntries.getEntry(hashes[0], entry);
+
+        // enough hashes for the sequential pass
+        bst::ThreadPool pool(2);
+        vector<bst::snapshot_entry> entries;
+        vector<bool> found;
+        alignedEntries.getEntries(hashes, entries, found, pool);
+        for (size_t i = 0; i < hashes.size() && same; i++) {
+            same = found[i] == (i != 0) && (i == 0 || entries[i].amount == i + 1);
+        }
+        if (! same)
+        {
+            cout << "test_record_formats--- 3" << endl;
+            cout << "aligned entries differ on pass " << pass << endl;
+        }
+    }
+    packedStream.close();
+    alignedStream.close();
+
+    // versions without a record format don't open
+    {
+        fstream header("aligned.snapshot", ios::in | ios::out | ios::binary);
+        uint32_t version = 99;
+        header.write(reinterpret_cast<const char*>(&version), sizeof(version));
+    }
+    ifstream unknownStream;
+    bst::snapshot_reader unknown;
+    if (bst::openSnapshot(unknownStream, unknown, "aligned.snapshot"))
+    {
+        cout << "test_record_formats--- 4" << endl;
+        cout << "opened a snapshot of version 99" << endl;
+    }
+    unknownStream.close();
+
+    remove("balances.test");
+    remove("import.snapshot");
+    remove("aligned.snapshot");
+    remove("import.claimed");
+}
+
+void test_async_reader()
+{
+    vector<uint8_t> block_hash(32);
+    bst::import_options options;
+    auto line = [](uint64_t i) {
+        char text[64];
+        sprintf(text, "%032x%08x,%d\n", (unsigned) i * 3, (unsigned) i, (int) i + 1);
+        return string(text);
+    };
+    for (uint32_t version : { bst::SNAPSHOT_VERSION, bst::SNAPSHOT_ALIGNED_VERSION }) {
+        options.version = version;
+        importTestBalances(5000, line, block_hash, options);
+        ifstream stream;
+        bst::snapshot_reader reader;
+        bst::openSnapshot(stream, reader, "import.snapshot");
+        bst::SnapshotEntryCollection entries = bst::getP2PKHCollection(reader);
+
+        // hits spread over the section, misses before, between and after the entries, and one repeat
+        vector<bst::uint160_t> hashes;
+        for (int i = 0; i < 5000; i += 7) {
+            bst::uint160_t hash;
+            entries.getKey(i, hash);
+            hashes.push_back(hash);
+            hash[19] ^= 1;
+            hashes.push_back(hash);
+        }
+        hashes.push_back(bst::uint160_t(20, 0));
+        hashes.push_back(bst::uint160_t(20, 0xff));
+        hashes.push_back(hashes[10]);
+
+        for (int uring = 0; uring < 2; uring++) {
+            bst::AsyncSnapshotReader async(8, uring == 1);
+            vector<bst::snapshot_entry> results;
+            vector<bool> found;
+            bool ok = async.getEntries(entries, hashes, results, found);
+            for (size_t i = 0; i < hashes.size() && ok; i++) {
+                bst::snapshot_entry expected;
+                bool present = entries.getEntry(hashes[i], expected);
+                ok = found[i] == present && (! present || (results[i].amount == expected.amount
+                        && results[i].index == expected.index && results[i].hash == hashes[i]));
+            }
+            if (! ok)
+            {
+                cout << "test_async_reader--- 1" << endl;
+                cout << "version " << version << (uring ? " io_uring" : " pread") << " lookups differ" << endl;
+            }
+        }
+
+        // records cut off under the reader fail the lookups
+        bst::AsyncSnapshotReader async(8, false);
+        vector<bst::snapshot_entry> results;
+        vector<bool> found;
+        if (truncate("import.snapshot", reader.format->data_offset) != 0
+            || async.getEntries(entries, hashes, results, found))
+        {
+            cout << "test_async_reader--- 2" << endl;
+            cout << "version " << version << " unreadable records were not reported" << endl;
+        }
+        stream.close();
+    }
+
+    remove("balances.test");
+    remove("import.snapshot");
+    remove("import.claimed");
+}
+
+void test_search_index()
+{
+    vector<uint8_t> block_hash(32, 3);
+    bst::import_options options;
+    // spread out hashes, then hashes that all share their first 8 bytes
+    for (int shared = 0; shared < 2; shared++) {
+        importTestBalances(5000, [&](uint64_t i) { return spreadBalance(i, shared); }, block_hash, options);
+
+        for (uint64_t step : { 1, 3, 16 }) {
+            ifstream stream;
+            bst::snapshot_reader reader;
+            bst::openSnapshot(stream, reader, "import.snapshot");
+            bst::SnapshotEntryCollection plain = bst::getP2PKHCollection(reader);
+            shared_ptr<bst::eytzinger_index> index = make_shared<bst::eytzinger_index>();
+            if (! bst::buildSnapshotIndex("import.snapshot", "import.eytzinger", step)
+                || ! bst::readSnapshotIndex(*index, reader.header, "import.eytzinger")
+                || index->sections[0].nodes != (5000 + step - 1) / step)
+            {
+                cout << "test_search_index--- 1" << endl;
+                cout << "could not index with step " << step << endl;
+                continue;
+            }
+            reader.search_index = index;
+            bst::SnapshotEntryCollection indexed = bst::getP2PKHCollection(reader);
+
+            bool same = indexed.search_index != 0;
+            for (int i = 0; i < 5000 && same; i++) {
+                bst::uint160_t hash;
+                plain.getKey(i, hash);
+                for (int miss = 0; miss < 2 && same; miss++) {
+                    if (miss) hash[19] ^= 1;
+                    bst::snapshot_entry expected, entry;
+                    bool present = plain.getEntry(hash, expected);
+                    same = indexed.getEntry(hash, entry) == present && (! present || entry.index == expected.index);
+                }
+            }
+            bst::snapshot_entry entry;
+            same = same && ! indexed.getEntry(bst::uint160_t(20, 0), entry)
+                   && ! indexed.getEntry(bst::uint160_t(20, 0xff), entry);
+            if (! same)
+            {
+                cout << "test_search_index--- 2" << endl;
+                cout << "indexed lookups differ, step " << step << (shared ? " with shared prefixes" : "") << endl;
+            }
+            stream.close();
+        }
+    }
+
+    // an index for a different snapshot isn't used
+    bst::snapshot_header other;
+    bst::eytzinger_index index;
+    if (bst::readSnapshotIndex(index, other, "import.eytzinger"))
+    {
+        cout << "test_search_index--- 3" << endl;
+        cout << "index read for the wrong snapshot" << endl;
+    }
+
+    remove("balances.test");
+    remove("import.snapshot");
+    remove("import.claimed");
+    remove("import.eytzinger");
+}
+
+void test_learned_index()
+{
+    vector<uint8_t> block_hash(32, 4);
+    bst::import_options options;
+    // spread out hashes, then hashes that all share their first 8 bytes
+    for (int shared = 0; shared < 2; shared++) {
+        auto line = [&](uint64_t i) { return spreadBalance(i, shared); };
+        // a small error, so lookups often land on the edge of the window
+        options.model_error = 4;
+        importTestBalances(20000, line, block_hash, options);
+        options.model_error = 0;
+        importTestBalances(20000, line, block_hash, options, "plain.snapshot");
+
+        ifstream stream, plainStream;
+        bst::snapshot_reader reader, plainReader;
+        bst::openSnapshot(stream, reader, "import.snapshot");
+        bst::openSnapshot(plainStream, plainReader, "plain.snapshot");
+        struct stat st;
+        stat("import.snapshot", &st);
+        if (! reader.model || plainReader.model || st.st_size - (bst::HEADER_SIZE + 20000 * 28) > 64 * 1024)
+        {
+            cout << "test_learned_index--- 1" << endl;
+            cout << "model " << (reader.model ? "" : "not ") << "read, " << st.st_size << " bytes" << endl;
+            continue;
+        }
+        bst::SnapshotEntryCollection indexed = bst::getP2PKHCollection(reader);
+        bst::SnapshotEntryCollection plain = bst::getP2PKHCollection(plainReader);
+
+        bool same = indexed.model != 0;
+        int64_t inWindow = 0;
+        for (int i = 0; i < 20000 && same; i++) {
+            bst::uint160_t hash;
+            plain.getKey(i, hash);
+            int64_t low, high;
+            indexed.model->predict(&hash[0], indexed.amount, low, high);
+            if (low <= i && i < high) inWindow++;
+            for (int miss = 0; miss < 2 && same; miss++) {
+                if (miss) hash[19] ^= 1;
+                bst::snapshot_entry expected, entry;
+                bool present = plain.getEntry(hash, expected);
+                same = indexed.getEntry(hash, entry) == present && (! present || entry.index == expected.index);
+            }
+        }
+        bst::snapshot_entry entry;
+        same = same && ! indexed.getEntry(bst::uint160_t(20, 0), entry)
+               && ! indexed.getEntry(bst::uint160_t(20, 0xff), entry);
+        // spread hashes stay within the error, except where the double arithmetic rounds
+        if (! same || (! shared && inWindow < 19990))
+        {
+            cout << "test_learned_index--- 2" << endl;
+            cout << "model lookups differ" << (shared ? " with shared prefixes" : "") << ", " << inWindow
+                 << " in the window" << endl;
+        }
+
+        // the trailer is invisible to whole section reads
+        uint64_t scanned = 0;
+        for (auto i = indexed.scanBegin(); i != indexed.scanEnd(); ++i) scanned++;
+        if (scanned != 20000)
+        {
+            cout << "test_learned_index--- 3" << endl;
+            cout << "expected 20000, result " << scanned << endl;
+        }
+        stream.close();
+        plainStream.close();
+    }
+
+    remove("balances.test");
+    remove("import.snapshot");
+    remove("plain.snapshot");
+    remove("import.claimed");
+}
+
+void test_perfect_hash()
+{
+    vector<uint8_t> block_hash(32, 5);
+    bst::import_options options;
+    for (uint32_t version : { bst::SNAPSHOT_VERSION, bst::SNAPSHOT_ALIGNED_VERSION }) {
+        options.version = version;
+        importTestBalances(20000, [](uint64_t i) { return spreadBalance(i); }, block_hash, options);
+
+        for (double gamma : { 1.0, 2.0 }) {
+            ifstream stream;
+            bst::snapshot_reader reader;
+            bst::openSnapshot(stream, reader, "import.snapshot");
+            bst::SnapshotEntryCollection plain = bst::getP2PKHCollection(reader);
+            shared_ptr<bst::perfect_hash_index> index = make_shared<bst::perfect_hash_index>();
+            struct stat st;
+            if (! bst::buildPerfectHash("import.snapshot", "import.mphf", gamma, 4)
+                || ! bst::readPerfectHash(*index, reader.header, "import.mphf") || stat("import.mphf", &st) != 0)
+            {
+                cout << "test_perfect_hash--- 1" << endl;
+                cout << "could not build with gamma " << gamma << endl;
+                continue;
+            }
+            // the bits themselves stay near 3 per key, the entry indexes add 32
+            const bst::perfect_hash_section& section = index->sections[0];
+            if (section.keys != 20000 || section.bits() > 20000 * 4 || st.st_size > 20000 * 5 + 4096)
+            {
+                cout << "test_perfect_hash--- 2" << endl;
+                cout << section.bits() << " bits for " << section.keys << " keys, " << st.st_size << " bytes" << endl;
+            }
+            reader.perfect_hash = index;
+            bst::SnapshotEntryCollection hashed = bst::getP2PKHCollection(reader);
+
+            bool same = hashed.perfect_hash != 0;
+            for (int i = 0; i < 20000 && same; i++) {
+                bst::uint160_t hash;
+                plain.getKey(i, hash);
+                for (int miss = 0; miss < 2 && same; miss++) {
+                    if (miss) hash[19] ^= 1;
+                    bst::snapshot_entry entry;
+                    bool present = hashed.getEntry(hash, entry);
+                    same = present == ! miss && (miss || (entry.index == i && entry.hash == hash));
+                }
+            }
+            bst::snapshot_entry entry;
+            same = same && ! hashed.getEntry(bst::uint160_t(20, 0), entry)
+                   && ! hashed.getEntry(bst::uint160_t(20, 0xff), entry);
+            if (! same)
+            {
+                cout << "test_perfect_hash--- 3" << endl;
+                cout << "lookups differ, version " << version << " gamma " << gamma << endl;
+            }
+            stream.close();
+        }
+    }
+
+    // an index for a different snapshot isn't used
+    bst::snapshot_header other;
+    bst::perfect_hash_index index;
+    if (bst::readPerfectHash(index, other, "import.mphf"))
+    {
+        cout << "test_perfect_hash--- 4" << endl;
+        cout << "perfect hash read for the wrong snapshot" << endl;
+    }
+
+    remove("balances.test");
+    remove("import.snapshot");
+    remove("import.claimed");
+    remove("import.mphf");
+}
+
+void test_warmup()
+{
+    vector<uint8_t> block_hash(32, 6);
+    bst::import_options options;
+    importTestBalances(300000, [](uint64_t i) { return spreadBalance(i); }, block_hash, options);
+
+    ifstream plainStream;
+    bst::snapshot_reader plainReader;
+    bst::openSnapshot(plainStream, plainReader, "import.snapshot");
+    bst::SnapshotEntryCollection plain = bst::getP2PKHCollection(plainReader);
+
+    const bst::residency_mode modes[3] = { bst::RESIDENCY_PAGE_CACHE, bst::RESIDENCY_PAGE_CACHE,
+                                           bst::RESIDENCY_HUGE_PAGES };
+    for (int run = 0; run < 3; run++) {
+        ifstream stream;
+        bst::snapshot_reader reader;
+        bst::claim_bitfield bitfield;
+        bst::openSnapshot(stream, reader, "import.snapshot");
+        bst::openClaimBitfield(bitfield, "import.claimed");
+        reader.claims = &bitfield;
+
+        bst::warmup_options warmup;
+        warmup.mode = modes[run];
+        warmup.threads = 3;
+        // the second run serves while warming
+        warmup.wait = run != 1;
+        atomic<uint64_t> reported(0);
+        warmup.progress = [&](uint64_t done, uint64_t) {
+            uint64_t seen = reported;
+            while (done > seen && ! reported.compare_exchange_weak(seen, done)) {}
+        };
+        bst::SnapshotWarmer warmer;
+        if (! warmer.start(reader, &bitfield, warmup))
+        {
+            cout << "test_warmup--- 1" << endl;
+            cout << "could not warm, run " << run << endl;
+            continue;
+        }
+
+        bst::SnapshotEntryCollection warmed = bst::getP2PKHCollection(reader);
+        bool same = true;
+        for (int i = 0; i < 300000 && same; i += 7) {
+            bst::uint160_t hash;
+            plain.getKey(i, hash);
+            bst::snapshot_entry expected, entry;
+            same = plain.getEntry(hash, expected) && warmed.getEntry(hash, entry) && entry.index == expected.index
+                   && entry.amount == expected.amount;
+        }
+        if (! same)
+        {
+            cout << "test_warmup--- 2" << endl;
+            cout << "lookups differ while warming, run " << run << endl;
+        }
+
+        warmer.wait();
+        uint64_t total = reader.file->size + bitfield.size;
+        if (! warmer.finished() || warmer.bytesDone() != total || warmer.bytesTotal() != total || reported != total
+            || warmer.hugePages() != (modes[run] == bst::RESIDENCY_HUGE_PAGES))
+        {
+            cout << "test_warmup--- 3" << endl;
+            cout << "run " << run << " warmed " << warmer.bytesDone() << " of " << total << ", reported "
+                 << reported << endl;
+        }
+
+        // claims still reach the file through the warmed bitfield
+        if (run == 2) {
+            warmed.testAndSetClaimed(bitfield, 5);
+            bst::syncClaimBitfield(bitfield);
+            ifstream claimed("import.claimed", ios::binary);
+            char byte = 0;
+            claimed.read(&byte, 1);
+            if (! (byte & (1 << 5)))
+            {
+                cout << "test_warmup--- 4" << endl;
+                cout << "claim was not written back" << endl;
+            }
+        }
+        bst::closeClaimBitfield(bitfield);
+        stream.close();
+    }
+
+    // cancelling a huge page copy part way leaves the reader on its file mapping
+    {
+        ifstream stream;
+        bst::snapshot_reader reader;
+        bst::openSnapshot(stream, reader, "import.snapshot");
+        bst::mapSnapshot(reader);
+        const uint8_t* mapping = reader.file->data;
+
+        bst::SnapshotWarmer warmer;
+        thread canceller;
+        bst::warmup_options warmup;
+        warmup.mode = bst::RESIDENCY_HUGE_PAGES;
+        warmup.threads = 1;
+        warmup.progress = [&](uint64_t, uint64_t) {
+            if (canceller.joinable()) return;
+            canceller = thread([&]() { warmer.cancel(); });
+            // long enough for the cancel to land before the next chunk
+            this_thread::sleep_for(chrono::milliseconds(200));
+        };
+        bool started = warmer.start(reader, 0, warmup);
+        if (canceller.joinable()) canceller.join();
+
+        bst::SnapshotEntryCollection cancelled = bst::getP2PKHCollection(reader);
+        bool same = true;
+        for (int i = 0; i < 300000 && same; i += 7) {
+            bst::uint160_t hash;
+            plain.getKey(i, hash);
+            bst::snapshot_entry expected, entry;
+            same = plain.getEntry(hash, expected) && cancelled.getEntry(hash, entry) && entry.index == expected.index
+                   && entry.amount == expected.amount;
+        }
+        if (started || warmer.hugePages() || reader.file->data != mapping || ! same)
+        {
+            cout << "test_warmup--- 5" << endl;
+            cout << "cancelled copy replaced the mapping" << endl;
+        }
+        stream.close();
+    }
+    plainStream.close();
+
+    remove("balances.test");
+    remove("import.snapshot");
+    remove("import.claimed");
+}
+
+void test_concurrent_lookups()
+{
+    vector<uint8_t> block_hash(32, 7);
+    bst::import_options options;
+    importTestBalances(50000, [](uint64_t i) { return spreadBalance(i); }, block_hash, options);
+
+    // read through pread, then through the mapping
+    for (int mapped = 0; mapped < 2; mapped++) {
+        ifstream stream;
+        bst::snapshot_reader reader;
+        bst::openSnapshot(stream, reader, "import.snapshot");
+        if (mapped) bst::mapSnapshot(reader);
+        bst::SnapshotEntryCollection entries = bst::getP2PKHCollection(reader);
+        vector<bst::uint160_t> hashes(50000);
+        vector<uint64_t> amounts(50000);
+        for (int i = 0; i < 50000; i++) {
+            bst::snapshot_entry entry;
+            entries.getEntry(i, entry);
+            hashes[i] = entry.hash;
+            amounts[i] = entry.amount;
+        }
+
+        // every thread shares the reader and walks the entries from a different start, so reads interleave
+        const int threadCount = 8;
+        atomic<uint64_t> wrong(0);
+        vector<thread> threads;
+        for (int t = 0; t < threadCount; t++) {
+            threads.push_back(thread([&, t]() {
+                bst::SnapshotEntryCollection mine = bst::getP2PKHCollection(reader);
+                uint64_t bad = 0;
+                for (int n = 0; n < 50000; n++) {
+                    int i = (n * 7 + t * 6133) % 50000;
+                    bst::uint160_t hash = hashes[i];
+                    bst::snapshot_entry entry;
+                    if (! mine.getEntry(hash, entry) || entry.index != i || entry.amount != amounts[i]) bad++;
+                    hash[19] ^= 1;
+                    if (mine.getEntry(hash, entry)) bad++;
+                }
+                wrong += bad;
+            }));
+        }
+        for (auto& t : threads) t.join();
+        if (wrong != 0)
+        {
+            cout << "test_concurrent_lookups--- 1" << endl;
+            cout << wrong << " wrong lookups" << (mapped ? " through the mapping" : " through pread") << endl;
+        }
+        stream.close();
+    }
+
+    remove("balances.test");
+    remove("import.snapshot");
+    remove("import.claimed");
+}
+
+void test_claim_pipeline()
+{
+    string transaction1 = "76A9142345FBB2B00E115C98C1D6E975C99B5431DE9CDE88AC";
+    string transaction2 = "76A914992FA68A35E9706F5CE12036803DF00FF3003DC688AC";
+    string transaction3 = "2102f91ca5628d8a77fbf8e12fd098fdd871bdcb61c84cc3abf111a747b26ff6a2cbac";
+    vector<uint8_t> vector1;
+    vector<uint8_t> vector2;
+    vector<uint8_t> vector3;
+    bst::decodeVector(transaction1, vector1);
+    bst::decodeVector(transaction2, vector2);
+    bst::decodeVector(transaction3, vector3);
+    bst::snapshot_preparer preparer;
+    preparer.debug = false;
+    bst::prepareForUTXOs(preparer);
+    bst::writeUTXO(preparer, vector1, 24900000000);
+    bst::writeUTXO(preparer, vector2, 99998237);
+    bst::writeUTXO(preparer, vector3, 5000000643);
+    vector<uint8_t> block_hash = vector<uint8_t>(32);
+    bst::writeSnapshot(preparer, block_hash, 0);
+    string claim = "I claim funds.";
+    string signature = "Hxc0sSkslD2mFE3HtHzIDRqSutQBiAQ+TxrsgVPeL3jWbXtcusuD77MTX7Tc/hJsQtVrbZsf9xpSDs+6Khx7nNk=";
+    string signature2 = "H3ys4y9vnG2cvneZMo33Vvv1kQTKr2iCcBZZe78OFl8VaPbXYNwLVTtTh5K7Qu4MpdOQiVo+6SHq6pPSzdBm7PQ=";
+    string signature3 = "IIuXyLFeU+HVJnv9TPAGXnCnc0bCOi+enwjIWxsO5FmaMdVNBcRrkYGB07Qbdkghd+0XhnaUL3O+X+h4dzb0Kio=";
+
+    ifstream stream;
+    bst::snapshot_reader reader;
+    bst::openSnapshot(stream, reader);
+    string claimedName = "pipeline_test.claimed";
+    string journalName = claimedName + bst::JOURNAL_EXTENSION;
+    bst::resetClaims(reader.header, claimedName);
+    bst::claim_bitfield bitfield;
+    bst::openClaimBitfield(bitfield, claimedName);
+    bst::ClaimJournal journal;
+    journal.open(reader.header, bitfield, bst::journal_options(), journalName);
+
+    bst::pipeline_options options;
+    options.recover_threads = 2;
+    options.commit_threads = 2;
+    options.batch_size = 4;
+    bst::ClaimPipeline pipeline;
+    pipeline.open(reader, bitfield, &journal, options);
+
+    // the first three complete through futures, the rest through a callback
+    vector<future<bst::claim_result> > futures;
+    futures.push_back(pipeline.submit(bst::claim_request(claim, signature3)));
+    futures.push_back(pipeline.submit(bst::claim_request(claim, "not base64!")));
+    futures.push_back(pipeline.submit(bst::claim_request(claim, signature)));
+    bst::claim_result later[3];
+    vector<bst::claim_request> rest;
+    rest.push_back(bst::claim_request("I claim someone else's funds.", signature2));
+    rest.push_back(bst::claim_request(claim, signature2));
+    rest.push_back(bst::claim_request(claim, signature3));
+    for (int i = 0; i < 3; i++) {
+        pipeline.submit(rest[i], [&later, i](const bst::claim_result& result) { later[i] = result; });
+    }
+    pipeline.close();
+
+    bst::claim_result results[6];
+    for (int i = 0; i < 3; i++) results[i] = futures[i].get();
+    for (int i = 0; i < 3; i++) results[i + 3] = later[i];
+
+    // signature3 claims the same entry twice, the first submitted wins however the threads run
+    bst::claim_status expectedStatus[6] = { bst::CLAIM_VALID, bst::CLAIM_BAD_SIGNATURE, bst::CLAIM_VALID,
+                                            bst::CLAIM_NOT_FOUND, bst::CLAIM_VALID, bst::CLAIM_ALREADY_CLAIMED };
+    uint64_t expectedAmount[6] = { 5000000643, 0, 24900000000, 0, 99998237, 5000000643 };
+    for (int i = 0; i < 6; i++) {
+        if (results[i].status != expectedStatus[i] || results[i].amount != expectedAmount[i])
+        {
+            cout << "test_claim_pipeline--- " << i << endl;
+            cout << "expected: " << expectedStatus[i] << " " << expectedAmount[i] << endl;
+            cout << "result  : " << results[i].status << " " << results[i].amount << endl;
+        }
+    }
+    if (pipeline.commits() == 0 || pipeline.commits() > 3)
+    {
+        cout << "test_claim_pipeline--- 6" << endl;
+        cout << pipeline.commits() << " journal commits for 3 claims" << endl;
+    }
+
+    journal.close();
+    bst::closeClaimBitfield(bitfield);
+    stream.close();
+    remove(claimedName.c_str());
+    remove(journalName.c_str());
+}
+
+void test_claim_resolution()
+{
+    vector<uint8_t> block_hash(32, 7);
+    bst::import_options options;
+    importTestBalances(1000, [](uint64_t i) { return spreadBalance(i); }, block_hash, options);
+
+    ifstream stream;
+    bst::snapshot_reader reader;
+    bst::openSnapshot(stream, reader, "import.snapshot");
+    bst::SnapshotEntryCollection entries = bst::getP2PKHCollection(reader);
+    bst::ThreadPool pool(4);
+
+    // a batch of 20000 claims on 1000 entries, every entry claimed by 20 results spread through the batch
+    vector<bst::claim_result> batch(20000);
+    for (size_t i = 0; i < batch.size(); i++) {
+        batch[i].status = i % 7 == 3 ? bst::CLAIM_BAD_SIGNATURE : bst::CLAIM_VALID;
+        batch[i].index = (int64_t) ((i * 37) % 1000);
+    }
+    // the caller's ordering ranks later positions first
+    vector<uint64_t> reversed(batch.size());
+    for (size_t i = 0; i < batch.size(); i++) reversed[i] = batch.size() - i;
+
+    for (int ordered = 0; ordered < 2; ordered++) {
+        // runs repeatedly, so a winner that depended on interleaving would show
+        for (int run = 0; run < 5; run++) {
+            bst::resetClaims(reader.header, "import.claimed");
+            bst::claim_bitfield bitfield;
+            bst::openClaimBitfield(bitfield, "import.claimed");
+            entries.testAndSetClaimed(bitfield, 500);
+
+            vector<bst::claim_result> results = batch;
+            bst::claimEntries(entries, bitfield, results, pool, ordered ? reversed : vector<uint64_t>());
+
+            vector<int64_t> winner(1000, -1);
+            for (size_t n = 0; n < batch.size(); n++) {
+                size_t i = ordered ? batch.size() - 1 - n : n;
+                if (batch[i].status == bst::CLAIM_VALID && winner[batch[i].index] < 0) winner[batch[i].index] = i;
+            }
+            uint64_t wrong = 0;
+            for (size_t i = 0; i < batch.size(); i++) {
+                bst::claim_status expected = bst::CLAIM_BAD_SIGNATURE;
+                if (batch[i].status == bst::CLAIM_VALID) {
+                    bool wins = winner[batch[i].index] == (int64_t) i && batch[i].index != 500;
+                    expected = wins ? bst::CLAIM_VALID : bst::CLAIM_ALREADY_CLAIMED;
+                }
+                if (results[i].status != expected) wrong++;
+            }
+            for (int64_t index = 0; index < 1000; index++) {
+                if (! bst::isClaimed(bitfield, entries.claimed_offset + index)) wrong++;
+            }
+            bst::closeClaimBitfield(bitfield);
+            if (wrong != 0)
+            {
+                cout << "test_claim_resolution--- " << ordered << endl;
+                cout << wrong << " wrong results" << (ordered ? " with a caller ordering" : " by position") << endl;
+                break;
+            }
+        }
+    }
+
+    // an ordering that doesn't rank every result claims nothing
+    bst::resetClaims(reader.header, "import.claimed");
+    bst::claim_bitfield bitfield;
+    bst::openClaimBitfield(bitfield, "import.claimed");
+    vector<bst::claim_result> results = batch;
+    bst::claimEntries(entries, bitfield, results, pool, vector<uint64_t>(reversed.begin(), reversed.end() - 1));
+    for (size_t i = 0; i < batch.size(); i++) {
+        bst::claim_status expected = batch[i].status == bst::CLAIM_VALID ? bst::CLAIM_ERROR : batch[i].status;
+        if (results[i].status != expected || bst::isClaimed(bitfield, entries.claimed_offset + batch[i].index))
+        {
+            cout << "test_claim_resolution--- 2" << endl;
+            cout << "result " << i << " status " << results[i].status << " with a short ordering" << endl;
+            break;
+        }
+    }
+    bst::closeClaimBitfield(bitfield);
+
+    stream.close();
+    remove("balances.test");
+    remove("import.snapshot");
+    remove("import.claimed");
+}
+
+void test_reset_claims()
+{
+    string claimedName = "reset_test.claimed";
+    string journalName = claimedName + bst::JOURNAL_EXTENSION;
+    bst::snapshot_header header;
+    header.nP2PKH = 1000000;
+    header.nP2SH = 3;
+    bst::resetClaims(header, claimedName);
+
+    // claims and a journal left over from before, which the next reset must both forget
+    bst::claim_bitfield bitfield;
+    bst::openClaimBitfield(bitfield, claimedName);
+    for (uint64_t bit = 0; bit < header.nP2PKH + header.nP2SH; bit += 4099) bst::testAndSetClaimed(bitfield, bit);
+    bst::closeClaimBitfield(bitfield);
+    ofstream(journalName) << "stale";
+
+    bst::resetClaims(header, claimedName);
+    bst::openClaimBitfield(bitfield, claimedName);
+    if (bitfield.size != (header.nP2PKH + header.nP2SH + 7) / 8)
+    {
+        cout << "test_reset_claims--- 1" << endl;
+        cout << "expected: " << (header.nP2PKH + header.nP2SH + 7) / 8 << " bytes" << endl;
+        cout << "result  : " << bitfield.size << " bytes" << endl;
+    }
+    for (uint64_t i = 0; i < bitfield.size; i++) {
+        if (bitfield.data[i] != 0)
+        {
+            cout << "test_reset_claims--- 2" << endl;
+            cout << "byte " << i << " still set after reset" << endl;
+            break;
+        }
+    }
+    bst::closeClaimBitfield(bitfield);
+    if (ifstream(journalName).is_open())
+    {
+        cout << "test_reset_claims--- 3" << endl;
+        cout << "journal not removed" << endl;
+    }
+    remove(claimedName.c_str());
+
+    // a claim file that can't be created fails the reset, and the snapshot written with it
+    bst::snapshot_writer writer;
+    vector<uint8_t> block_hash(32);
+    if (bst::resetClaims(header, "missing/reset_test.claimed")
+        || ! bst::openSnapshotWriter(writer, block_hash, "reset_test.snapshot")
+        || bst::closeSnapshotWriter(writer, "missing/reset_test.claimed"))
+    {
+        cout << "test_reset_claims--- 4" << endl;
+        cout << "claim file that could not be created was not reported" << endl;
+    }
+    remove("reset_test.snapshot");
+}
+
 void test_all()
 {
     test_signing_check();
@@ -525,6 +2485,30 @@ void test_all()
     test_write_sql_and_snapshot_separately();
     test_claim_bitfield();
     test_dust_pruning();
+    test_concurrent_claims();
+    test_claim_journal();
+    test_batch_claims();
+    test_batch_lookup();
+    test_snapshot_filter();
+    test_find_entry();
+    test_daemon();
+    test_key_cache();
+    test_scan_iterator();
+    test_random_access_iterator();
+    test_parallel_scan();
+    test_export();
+    test_columns();
+    test_import();
+    test_record_formats();
+    test_async_reader();
+    test_search_index();
+    test_learned_index();
+    test_perfect_hash();
+    test_warmup();
+    test_concurrent_lookups();
+    test_claim_pipeline();
+    test_claim_resolution();
+    test_reset_claims();
 }
 
 void temp_make_address()
@@ -14,11 +14,54 @@
  * limitations under the License.
  */
 
+#include <cstdlib>
+#include <unistd.h>
 #include <bitcoin/bitcoin.hpp>
 #include "bitcoin/bst/claim.h"
+#include "bitcoin/bst/export.h"
 
 using namespace std;
 
+void usage()
+{
+    cout << "Usage: print_snapshot [--format text|csv|jsonl] [--network mainnet|testnet] [-t threads]" << endl;
+    cout << "       print_snapshot --columns [--combined] [-t threads]    writes snapshot.*.columns" << endl;
+}
+
 int main(int argv, char** argc) {
-    bst::printSnapshot();
+    bst::export_options options;
+    bool columns = false;
+    bool combined = false;
+    for (int i = 1; i < argv; i++) {
+        string arg(argc[i]);
+        string value = i + 1 < argv ? argc[i + 1] : "";
+        if (arg == "--columns" || arg == "--combined") {
+            columns = columns || arg == "--columns";
+            combined = combined || arg == "--combined";
+            continue;
+        }
+        if (arg == "--format" && (value == "text" || value == "csv" || value == "jsonl")) {
+            options.format = value == "text" ? bst::EXPORT_TEXT : value == "csv" ? bst::EXPORT_CSV : bst::EXPORT_JSONL;
+        } else if (arg == "--network" && (value == "mainnet" || value == "testnet")) {
+            options.p2pkh_version = value == "mainnet" ? 0 : 111;
+            options.p2sh_version = value == "mainnet" ? 5 : 196;
+        } else if (arg == "-t" && ! value.empty()) {
+            options.threads = atoi(value.c_str());
+        } else {
+            usage();
+            return -1;
+        }
+        i++;
+    }
+
+    ifstream stream;
+    bst::snapshot_reader reader;
+    if (! bst::openSnapshot(stream, reader)) {
+        cout << "Could not open snapshot." << endl;
+        return -1;
+    }
+    if (columns) {
+        return bst::exportColumns(reader, bst::SNAPSHOT_NAME, combined, options.threads) ? 0 : -1;
+    }
+    return bst::exportSnapshot(reader, STDOUT_FILENO, options) ? 0 : -1;
 }
@@ -0,0 +1,79 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <csignal>
+#include <cstdlib>
+#include <atomic>
+#include <bitcoin/bitcoin.hpp>
+#include "bitcoin/bst/daemon.h"
+
+using namespace std;
+
+static bst::SnapshotDaemon snapshotDaemon;
+static atomic<int> warmedPercent(0);
+
+void handleSignal(int)
+{
+    snapshotDaemon.stop();
+}
+
+// prints every tenth of the way, whichever warming thread gets there first
+void reportWarmup(uint64_t done, uint64_t total)
+{
+    int percent = (int) (done * 10 / total) * 10;
+    int reported = warmedPercent;
+    if (percent > reported && warmedPercent.compare_exchange_strong(reported, percent)) {
+        cout << "warmed " << percent << "%" << endl;
+    }
+}
+
+int main(int argv, char** argc) {
+    bst::daemon_options options;
+    for (int i = 1; i < argv; i++) {
+        string arg(argc[i]);
+        if (arg == "-s" && i + 1 < argv) {
+            options.socket_name = argc[++i];
+        } else if (arg == "-c" && i + 1 < argv) {
+            options.claimed_name = argc[++i];
+            options.journal_name = options.claimed_name + bst::JOURNAL_EXTENSION;
+        } else if (arg == "-t" && i + 1 < argv) {
+            options.threads = atoi(argc[++i]);
+        } else if (arg == "-w") {
+            options.warm = true;
+        } else if (arg == "-b") {
+            options.warm = true;
+            options.warmup.wait = false;
+        } else if (arg == "-H") {
+            options.warm = true;
+            options.warmup.mode = bst::RESIDENCY_HUGE_PAGES;
+        } else {
+            cout << "Usage: snapshot_daemon [-s socket] [-c claimed] [-t threads] [-w | -b] [-H]" << endl;
+            cout << "       -w warms the snapshot before serving, -b serves while warming in the background" << endl;
+            cout << "       -H copies the snapshot onto huge pages first" << endl;
+            return -1;
+        }
+    }
+    options.warmup.progress = reportWarmup;
+
+    if (! snapshotDaemon.open(options)) return -1;
+    signal(SIGINT, handleSignal);
+    signal(SIGTERM, handleSignal);
+
+    cout << "serving " << options.snapshot_name << " on " << options.socket_name << endl;
+    snapshotDaemon.run();
+    snapshotDaemon.close();
+    return 0;
+}
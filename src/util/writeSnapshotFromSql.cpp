@@ -20,10 +20,19 @@
 
 using namespace std;
 
-int main() {
+int main(int argv, char** argc) {
 
+    bst::snapshot_options options;
+    for (int i = 1; i < argv; i++) {
+        string arg = argc[i];
+        if (arg == "--filter") options.write_filter = true;
+        if (arg == "--index") options.write_index = true;
+        if (arg == "--model") options.model_error = bst::MODEL_ERROR;
+        // records padded to 32 bytes, so none crosses a cache line
+        if (arg == "--aligned") options.version = bst::SNAPSHOT_ALIGNED_VERSION;
+    }
     vector<uint8_t> block_hash = vector<uint8_t>(32);
-    bst::writeSnapshotFromSqlite(block_hash, 0);
+    bst::writeSnapshotFromSqlite(block_hash, 0, options);
 
     return 0;
 
@@ -0,0 +1,150 @@
+/**
+ * Copyright (C) 2015 Bitcoin Spinoff Toolkit developers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <sys/mman.h>
+#include "bitcoin/bst/warmup.h"
+
+using namespace std;
+
+namespace bst {
+
+    static const uint64_t WARMUP_PAGE_SIZE = 4096;
+    static const uint64_t HUGE_PAGE_SIZE = 2 << 20;
+
+    // faults a page aligned range in, in one call where the kernel can populate it. only for reading, even on the
+    // bitfield: populating a shared mapping for writing dirties every page, and all of them would go back to the file
+    static void faultIn(uint8_t* data, uint64_t length)
+    {
+#ifdef MADV_POPULATE_READ
+        if (madvise(data, length, MADV_POPULATE_READ) == 0) return;
+#endif
+        // older kernels: reading a byte of every page. pages written later take one more, minor, fault
+        volatile uint8_t sink = 0;
+        for (uint64_t offset = 0; offset < length; offset += WARMUP_PAGE_SIZE) sink ^= data[offset];
+    }
+
+    SnapshotWarmer::SnapshotWarmer() : next_chunk(0), done(0), total(0), running(0), cancelled(false), huge(false) {}
+
+    SnapshotWarmer::~SnapshotWarmer()
+    {
+        cancel();
+    }
+
+    bool SnapshotWarmer::start(snapshot_reader& reader, claim_bitfield* bitfield, const warmup_options& options_)
+    {
+        cancel();
+        options = options_;
+        cancelled = false;
+        huge = false;
+        done = 0;
+        if (! mapSnapshot(reader)) return false;
+        file = reader.file;
+        bool warmBitfield = bitfield && bitfield->data;
+        total = file->size + (warmBitfield ? bitfield->size : 0);
+
+        if (options.mode == RESIDENCY_HUGE_PAGES) {
+            uint64_t length = (file->size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+            void* copy = mmap(0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (copy == MAP_FAILED) {
+                // no reserved huge pages, ask for transparent ones
+                copy = mmap(0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (copy == MAP_FAILED) return false;
+#ifdef MADV_HUGEPAGE
+                madvise(copy, length, MADV_HUGEPAGE);
+#endif
+            }
+            region snapshot = { static_cast<uint8_t*>(copy), file->size, file->data };
+            launch(vector<region>(1, snapshot));
+            wait();
+            if (cancelled) {
+                // the copy stopped part way, the reader stays on the file mapping
+                munmap(copy, length);
+                return false;
+            }
+            mprotect(copy, length, PROT_READ);
+            munmap(const_cast<uint8_t*>(file->data), file->mapping_size);
+            file->data = static_cast<const uint8_t*>(copy);
+            file->mapping_size = length;
+            huge = true;
+        }
+
+        vector<region> faults;
+        if (! huge) {
+            region snapshot = { const_cast<uint8_t*>(file->data), file->size, 0 };
+            faults.push_back(snapshot);
+        }
+        if (warmBitfield) {
+            region claims = { bitfield->data, bitfield->size, 0 };
+            faults.push_back(claims);
+        }
+        launch(faults);
+        if (options.wait) wait();
+        return true;
+    }
+
+    void SnapshotWarmer::launch(const vector<region>& regions_)
+    {
+        regions = regions_;
+        chunks.clear();
+        for (size_t r = 0; r < regions.size(); r++) {
+            for (uint64_t offset = 0; offset < regions[r].size; offset += WARMUP_CHUNK_SIZE) {
+                chunks.push_back(make_pair(r, offset));
+            }
+        }
+        next_chunk = 0;
+
+        unsigned count = options.threads ? options.threads : max(1u, thread::hardware_concurrency());
+        count = (unsigned) min((uint64_t) count, (uint64_t) chunks.size());
+        running = count;
+        lock_guard<mutex> guard(threads_lock);
+        for (unsigned i = 0; i < count; i++) {
+            threads.push_back(thread(&SnapshotWarmer::work, this));
+        }
+    }
+
+    void SnapshotWarmer::work()
+    {
+        uint64_t chunk;
+        while (! cancelled && (chunk = next_chunk++) < chunks.size()) {
+            const region& r = regions[chunks[chunk].first];
+            uint64_t offset = chunks[chunk].second;
+            uint64_t length = min(WARMUP_CHUNK_SIZE, r.size - offset);
+            if (r.source) {
+                memcpy(r.data + offset, r.source + offset, length);
+            } else {
+                faultIn(r.data + offset, length);
+            }
+            uint64_t now = done += length;
+            if (options.progress) options.progress(now, total);
+        }
+        running--;
+    }
+
+    void SnapshotWarmer::wait()
+    {
+        lock_guard<mutex> guard(threads_lock);
+        for (auto& worker : threads) worker.join();
+        threads.clear();
+    }
+
+    void SnapshotWarmer::cancel()
+    {
+        cancelled = true;
+        wait();
+    }
+}